@@ -0,0 +1,273 @@
+/* asset_reloader.hpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Implementation of the detection assets and their background hot reload
+
+**/
+
+#pragma once
+
+#include <sys/stat.h>
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace lidar_obstacle_detector {
+
+// The region kept by the detection, besides the ROI box. An asset set is
+// immutable once built, the detector keeps a shared pointer to one of them
+// per frame.
+struct DetectionAssets {
+  // Boxes whose points are dropped (the ego vehicle by default)
+  std::vector<std::pair<Eigen::Vector4f, Eigen::Vector4f>> exclusion_boxes;
+
+  // Optional x-y grid of the cells to keep, row 0 at the lowest y
+  std::vector<char> mask;
+  Eigen::Vector2f mask_origin = Eigen::Vector2f::Zero();
+  float mask_cell_size = 1.0f;
+  int mask_width = 0, mask_height = 0;
+
+  template <typename PointT>
+  bool keeps(const PointT &p) const {
+    for (auto &box : exclusion_boxes) {
+      const Eigen::Vector4f &min = box.first, &max = box.second;
+      if (p.x >= min(0) && p.y >= min(1) && p.z >= min(2) && p.x <= max(0) &&
+          p.y <= max(1) && p.z <= max(2))
+        return false;
+    }
+    return inMask(p);
+  }
+
+  // True without a mask
+  template <typename PointT>
+  bool inMask(const PointT &p) const {
+    if (mask.empty()) return true;
+    const int col = std::floor((p.x - mask_origin(0)) / mask_cell_size);
+    const int row = std::floor((p.y - mask_origin(1)) / mask_cell_size);
+    return col >= 0 && row >= 0 && col < mask_width && row < mask_height &&
+           mask[row * mask_width + col];
+  }
+};
+
+// The car roof region that used to be hard-coded in filterCloud
+inline std::shared_ptr<const DetectionAssets> defaultAssets() {
+  std::shared_ptr<DetectionAssets> assets(new DetectionAssets);
+  assets->exclusion_boxes.emplace_back(Eigen::Vector4f(-1.5, -1.7, -1, 1),
+                                       Eigen::Vector4f(2.6, 1.7, -0.4, 1));
+  return assets;
+}
+
+// Reads a binary (P5) or plain (P2) PGM, non-zero pixels are kept. The top
+// row of the image is the highest y, as in the ROS map_server maps.
+inline bool loadMask(const std::string &path, DetectionAssets *assets,
+                     std::string *error) {
+  std::ifstream file(path, std::ios::binary);
+  std::string magic;
+  int width = 0, height = 0, max_value = 0;
+  const auto next = [&file](int *value) {
+    file >> std::ws;
+    while (file.peek() == '#') {
+      file.ignore(4096, '\n');
+      file >> std::ws;
+    }
+    return static_cast<bool>(file >> *value);
+  };
+  file >> magic;
+  if (!file || (magic != "P5" && magic != "P2") || !next(&width) ||
+      !next(&height) || !next(&max_value) || width <= 0 || height <= 0 ||
+      max_value <= 0 || max_value > 255) {
+    *error = "cannot read the PGM mask " + path;
+    return false;
+  }
+  file.get();
+
+  assets->mask.assign(width * height, 0);
+  assets->mask_width = width;
+  assets->mask_height = height;
+  for (int row = height - 1; row >= 0; --row) {
+    for (int col = 0; col < width; ++col) {
+      int value = 0;
+      if (magic == "P5")
+        value = file.get();
+      else
+        file >> value;
+      if (!file) {
+        *error = "truncated PGM mask " + path;
+        return false;
+      }
+      assets->mask[row * width + col] = value > 0;
+    }
+  }
+  return true;
+}
+
+// One asset per line, '#' starts a comment:
+//   exclude <min x> <min y> <min z> <max x> <max y> <max z>
+//   mask <pgm file> <origin x> <origin y> <cell size>
+// Relative mask paths are relative to the assets file. The other files it
+// refers to are appended to `files`, also when they fail to load.
+inline std::shared_ptr<const DetectionAssets> loadAssets(
+    const std::string &path, std::string *error,
+    std::vector<std::string> *files = nullptr) {
+  std::ifstream file(path);
+  if (!file) {
+    *error = "cannot open " + path;
+    return nullptr;
+  }
+  const std::string directory =
+      path.find('/') == std::string::npos
+          ? std::string()
+          : path.substr(0, path.find_last_of('/') + 1);
+
+  std::shared_ptr<DetectionAssets> assets(new DetectionAssets);
+  std::string line;
+  for (int number = 1; std::getline(file, line); ++number) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream stream(line);
+    std::string kind;
+    if (!(stream >> kind)) continue;
+    bool valid = false;
+    if (kind == "exclude") {
+      Eigen::Vector4f min(0, 0, 0, 1), max(0, 0, 0, 1);
+      valid = static_cast<bool>(stream >> min(0) >> min(1) >> min(2) >>
+                                max(0) >> max(1) >> max(2));
+      if (valid) assets->exclusion_boxes.emplace_back(min, max);
+    } else if (kind == "mask") {
+      std::string mask_path;
+      valid = static_cast<bool>(stream >> mask_path >>
+                                assets->mask_origin(0) >>
+                                assets->mask_origin(1) >>
+                                assets->mask_cell_size) &&
+              assets->mask_cell_size > 0;
+      if (valid && mask_path[0] != '/') mask_path = directory + mask_path;
+      if (valid && files) files->push_back(mask_path);
+      if (valid && !loadMask(mask_path, assets.get(), error)) return nullptr;
+    }
+    if (!valid) {
+      *error = path + ":" + std::to_string(number) + ": cannot parse \"" +
+               line + "\"";
+      return nullptr;
+    }
+  }
+  return assets;
+}
+
+// Modification time of a file in ns, -1 if it does not exist
+inline int64_t modificationTime(const std::string &path) {
+  struct stat status;
+  if (stat(path.c_str(), &status) != 0) return -1;
+  return status.st_mtim.tv_sec * 1000000000ll + status.st_mtim.tv_nsec;
+}
+
+// Watches an assets file and the mask it refers to from its own thread. A
+// change to either is loaded and preprocessed there into a new asset set,
+// which is then swapped in; the processing thread only ever copies a shared
+// pointer, so a reload costs it nothing and a frame keeps the set it started
+// with. A file that fails to load leaves the current set in place.
+class AssetReloader {
+ public:
+  typedef std::function<void(const std::string &message, bool error)> Logger;
+
+  AssetReloader(const std::string &path, const double poll_period,
+                const Logger &logger)
+      : path_(path),
+        poll_period_(poll_period),
+        logger_(logger),
+        files_(1, path),
+        running_(true) {
+    std::atomic_store(&assets_, defaultAssets());
+    reload();
+    thread_ = std::thread(&AssetReloader::watch, this);
+  }
+
+  ~AssetReloader() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      running_ = false;
+    }
+    wake_.notify_all();
+    if (thread_.joinable()) thread_.join();
+  }
+
+  std::shared_ptr<const DetectionAssets> current() const {
+    return std::atomic_load(&assets_);
+  }
+
+ private:
+  const std::string path_;
+  const double poll_period_;
+  const Logger logger_;
+  // The assets file and the files it referred to at the last load, with
+  // their modification times then
+  std::vector<std::string> files_;
+  std::vector<int64_t> modified_;
+  std::shared_ptr<const DetectionAssets> assets_;
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool running_;
+  std::thread thread_;
+
+  void watch();
+  void reload();
+};
+
+inline void AssetReloader::watch() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (running_) {
+    wake_.wait_for(lock, std::chrono::duration<double>(poll_period_));
+    if (!running_) break;
+    lock.unlock();
+    reload();
+    lock.lock();
+  }
+}
+
+inline void AssetReloader::reload() {
+  if (modificationTime(path_) < 0) return;
+  std::vector<int64_t> modified;
+  for (auto &file : files_) modified.push_back(modificationTime(file));
+  if (modified == modified_) return;
+
+  // The times are taken before the load, so a change during it is loaded
+  // on the next poll. A newly referenced file starts from its time now.
+  std::vector<std::string> files(1, path_);
+  std::string error;
+  const auto assets = loadAssets(path_, &error, &files);
+  modified_.clear();
+  for (auto &file : files) {
+    const auto known = std::find(files_.begin(), files_.end(), file);
+    modified_.push_back(known != files_.end()
+                            ? modified[known - files_.begin()]
+                            : modificationTime(file));
+  }
+  files_.swap(files);
+  if (!assets) {
+    logger_("Keeping the current assets: " + error, true);
+    return;
+  }
+  std::atomic_store(&assets_, assets);
+  logger_("Loaded the assets of " + path_ + " (" +
+              std::to_string(assets->exclusion_boxes.size()) +
+              " exclusion boxes, " +
+              std::to_string(assets->mask_width * assets->mask_height) +
+              " mask cells)",
+          false);
+}
+
+}  // namespace lidar_obstacle_detector
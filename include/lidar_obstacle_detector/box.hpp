@@ -10,12 +10,21 @@
 
 #include <Eigen/Geometry>
 
+#include <climits>
+#include <cstddef>
+
 struct Box {
  public:
   int id;
   Eigen::Vector3f position;
   Eigen::Vector3f dimension;
   Eigen::Quaternionf quaternion;
+  Eigen::Vector3f velocity = Eigen::Vector3f::Zero();  // in the sensor frame
+  bool velocity_valid = false;
+  bool velocity_reliable = false;  // relative to the ground, not the sensor
+  // Position of the track filtered by the JPDA tracker, in the box's frame
+  Eigen::Vector3f track_position = Eigen::Vector3f::Zero();
+  bool track_filtered = false;
 
   Box() {}
 
@@ -32,3 +41,10 @@ struct Box {
         dimension(dimension),
         quaternion(quaternion) {}
 };
+
+// The id `n` ids after `id`. Ids wrap around to 0 past INT_MAX, so they stay
+// non-negative (-1 marks a free slot) and never overflow.
+inline int advanceBoxId(const int id, const size_t n) {
+  return static_cast<int>((static_cast<size_t>(id) + n) %
+                          (static_cast<size_t>(INT_MAX) + 1));
+}
@@ -0,0 +1,61 @@
+/* cloud_transform.hpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Implementation of the cloud transform fused into the ROS serialisation
+
+**/
+
+#pragma once
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <sensor_msgs/PointCloud2.h>
+
+#include <Eigen/Geometry>
+
+#include "lidar_obstacle_detector/simd_kernels.hpp"
+
+namespace lidar_obstacle_detector {
+
+// Writes the points of cloud, moved by transform, as packed {x, y, z, 1}
+// floats, with the SIMD kernel of the CPU
+inline void transformPoints(const pcl::PointCloud<pcl::PointXYZ> &cloud,
+                            const Eigen::Affine3f &transform, float *out) {
+  static_assert(sizeof(pcl::PointXYZ) == 4 * sizeof(float),
+                "PointXYZ is expected to be padded to 4 floats");
+  const Eigen::Matrix<float, 3, 4, Eigen::RowMajor> matrix =
+      transform.matrix().topRows<3>();
+  simdKernels().transformPoints(
+      reinterpret_cast<const float *>(cloud.points.data()),
+      cloud.points.size(), 4, matrix.data(), out);
+}
+
+// Same message as pcl::toROSMsg, with the points already in the target frame
+inline void toROSMsgTransformed(const pcl::PointCloud<pcl::PointXYZ> &cloud,
+                                const Eigen::Affine3f &transform,
+                                sensor_msgs::PointCloud2 *msg) {
+  const char *names[] = {"x", "y", "z"};
+  msg->fields.resize(3);
+  for (int i = 0; i < 3; ++i) {
+    msg->fields[i].name = names[i];
+    msg->fields[i].offset = i * sizeof(float);
+    msg->fields[i].datatype = sensor_msgs::PointField::FLOAT32;
+    msg->fields[i].count = 1;
+  }
+  msg->height = cloud.height;
+  msg->width = cloud.width;
+  if (cloud.height * cloud.width != cloud.points.size()) {
+    msg->height = 1;
+    msg->width = cloud.points.size();
+  }
+  msg->is_bigendian = false;
+  msg->point_step = sizeof(pcl::PointXYZ);
+  msg->row_step = msg->point_step * msg->width;
+  msg->is_dense = cloud.is_dense;
+  msg->data.resize(cloud.points.size() * sizeof(pcl::PointXYZ));
+  transformPoints(cloud, transform,
+                  reinterpret_cast<float *>(msg->data.data()));
+}
+
+}  // namespace lidar_obstacle_detector
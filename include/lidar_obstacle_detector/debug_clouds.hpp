@@ -0,0 +1,104 @@
+/* debug_clouds.hpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Implementation of the reduced ground and obstacle clouds for visualisation
+
+**/
+
+#pragma once
+
+#include <pcl/point_cloud.h>
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <utility>
+
+namespace lidar_obstacle_detector {
+
+// How the ground is published
+enum GroundOutput {
+  GROUND_POINTS = 0,       // every ground point
+  GROUND_HEIGHT_GRID = 1,  // one point per grid cell, at its mean height
+  GROUND_PLANE = 2,        // the coefficients of a plane only
+};
+
+// The debug cloud settings of a frame, copied from the dynamic parameters
+// so that they can be published from another thread
+struct DebugCloudParams {
+  int ground_output;
+  float ground_grid_size;
+  int max_points;
+};
+
+// Every n-th point so that at most max_points are left, 0 keeps them all
+template <typename PointT>
+typename pcl::PointCloud<PointT>::ConstPtr decimate(
+    const typename pcl::PointCloud<PointT>::ConstPtr &cloud,
+    const int max_points) {
+  if (max_points <= 0 || cloud->size() <= max_points) return cloud;
+
+  const size_t stride = (cloud->size() + max_points - 1) / max_points;
+  typename pcl::PointCloud<PointT>::Ptr decimated(new pcl::PointCloud<PointT>);
+  decimated->points.reserve(max_points);
+  for (size_t i = 0; i < cloud->size(); i += stride)
+    decimated->points.push_back(cloud->points[i]);
+  decimated->width = decimated->points.size();
+  decimated->height = 1;
+  decimated->is_dense = cloud->is_dense;
+
+  return decimated;
+}
+
+// One point per occupied cell of the x-y grid, at the cell centre and the
+// mean height of its points, in cell order
+template <typename PointT>
+typename pcl::PointCloud<PointT>::Ptr heightGrid(
+    const pcl::PointCloud<PointT> &cloud, const float cell_size) {
+  const float inverse_cell = 1.0f / std::max(cell_size, 0.01f);
+  std::map<std::pair<int, int>, std::pair<float, int>> cells;
+  for (auto &p : cloud.points) {
+    auto &cell = cells[{static_cast<int>(std::floor(p.x * inverse_cell)),
+                        static_cast<int>(std::floor(p.y * inverse_cell))}];
+    cell.first += p.z;
+    cell.second++;
+  }
+
+  typename pcl::PointCloud<PointT>::Ptr grid(new pcl::PointCloud<PointT>);
+  grid->points.reserve(cells.size());
+  for (auto &cell : cells) {
+    PointT point;
+    point.x = (cell.first.first + 0.5f) * cell_size;
+    point.y = (cell.first.second + 0.5f) * cell_size;
+    point.z = cell.second.first / cell.second.second;
+    grid->points.push_back(point);
+  }
+  grid->width = grid->points.size();
+  grid->height = 1;
+  grid->is_dense = true;
+
+  return grid;
+}
+
+// Least squares plane z = a x + b y + c through the points, returned as
+// the normalised ax + by + cz + d = 0 coefficients
+template <typename PointT>
+Eigen::Vector4f fitGroundPlane(const pcl::PointCloud<PointT> &cloud) {
+  Eigen::Matrix3d normal = Eigen::Matrix3d::Zero();
+  Eigen::Vector3d rhs = Eigen::Vector3d::Zero();
+  for (auto &p : cloud.points) {
+    const Eigen::Vector3d row(p.x, p.y, 1.0);
+    normal += row * row.transpose();
+    rhs += row * p.z;
+  }
+  if (cloud.size() < 3) return Eigen::Vector4f(0, 0, 1, 0);
+
+  const Eigen::Vector3d solution = normal.ldlt().solve(rhs);
+  const Eigen::Vector4d plane(solution(0), solution(1), -1.0, solution(2));
+  return (-plane / plane.head<3>().norm()).cast<float>();
+}
+
+}  // namespace lidar_obstacle_detector
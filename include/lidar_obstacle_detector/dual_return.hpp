@@ -0,0 +1,193 @@
+/* dual_return.hpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Implementation of the dual return aware conversion of the input scans
+
+**/
+
+#pragma once
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <pcl_conversions/pcl_conversions.h>
+#include <sensor_msgs/PointCloud2.h>
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <unordered_map>
+
+namespace lidar_obstacle_detector {
+
+// Reads one field of the points of a PointCloud2 as a float, whatever its
+// datatype. Invalid if the message has no field of that name.
+class PointFieldReader {
+ public:
+  PointFieldReader(const sensor_msgs::PointCloud2 &msg,
+                   const std::string &name) {
+    for (auto &field : msg.fields) {
+      if (field.name != name) continue;
+      offset_ = field.offset;
+      datatype_ = field.datatype;
+    }
+  }
+
+  bool valid() const { return datatype_ != 0; }
+
+  // The raw bytes of the field, to compare values exactly
+  uint64_t bits(const uint8_t *point) const {
+    uint64_t bits = 0;
+    std::memcpy(&bits, point + offset_, size());
+    return bits;
+  }
+
+  float operator()(const uint8_t *point) const {
+    const uint8_t *data = point + offset_;
+    switch (datatype_) {
+      case sensor_msgs::PointField::INT8:
+        return read<int8_t>(data);
+      case sensor_msgs::PointField::UINT8:
+        return read<uint8_t>(data);
+      case sensor_msgs::PointField::INT16:
+        return read<int16_t>(data);
+      case sensor_msgs::PointField::UINT16:
+        return read<uint16_t>(data);
+      case sensor_msgs::PointField::INT32:
+        return read<int32_t>(data);
+      case sensor_msgs::PointField::UINT32:
+        return read<uint32_t>(data);
+      case sensor_msgs::PointField::FLOAT64:
+        return read<double>(data);
+      default:
+        return read<float>(data);
+    }
+  }
+
+ private:
+  uint32_t offset_ = 0;
+  int datatype_ = 0;
+
+  size_t size() const {
+    switch (datatype_) {
+      case sensor_msgs::PointField::INT8:
+      case sensor_msgs::PointField::UINT8:
+        return 1;
+      case sensor_msgs::PointField::INT16:
+      case sensor_msgs::PointField::UINT16:
+        return 2;
+      case sensor_msgs::PointField::FLOAT64:
+        return 8;
+      default:
+        return 4;
+    }
+  }
+
+  template <typename T>
+  static float read(const uint8_t *data) {
+    T value;
+    std::memcpy(&value, data, sizeof(T));
+    return value;
+  }
+};
+
+// Converts the scans of dual return sensors, dropping the second returns
+// that are within `epsilon` of the range of the first return of the same
+// firing. Returns further away are kept, they are genuine second targets
+// (through vegetation, glass or the edge of an object). The two returns of
+// a firing share their "ring" and their per point time ("time", "t" or
+// "timestamp") or "azimuth" field. Without these fields the returns cannot
+// be paired, and the scan is converted untouched: nearby points of other
+// firings must never be taken for duplicates. With a "return_type" (or
+// "return") field only returns of another type than the first are compared.
+class DualReturnFilter {
+ public:
+  // Also drops the non-finite points. epsilon <= 0 converts everything.
+  void convert(const sensor_msgs::PointCloud2 &msg, const float epsilon,
+               pcl::PointCloud<pcl::PointXYZ> *cloud);
+
+  // Second returns dropped from the last scan
+  int dropped() const { return dropped_; }
+  // False if the last scan had no fields to pair the returns of a firing
+  bool paired() const { return paired_; }
+
+ private:
+  // Ring and raw bits of the time or azimuth of a firing
+  struct Firing {
+    uint64_t bits;
+    int ring;
+    bool operator==(const Firing &other) const {
+      return bits == other.bits && ring == other.ring;
+    }
+  };
+  struct FiringHash {
+    size_t operator()(const Firing &firing) const {
+      return std::hash<uint64_t>()(firing.bits * 31 + firing.ring);
+    }
+  };
+  struct FirstReturn {
+    float range;
+    float type;
+  };
+
+  std::unordered_map<Firing, FirstReturn, FiringHash> first_returns_;
+  int dropped_ = 0;
+  bool paired_ = false;
+};
+
+inline void DualReturnFilter::convert(const sensor_msgs::PointCloud2 &msg,
+                                      const float epsilon,
+                                      pcl::PointCloud<pcl::PointXYZ> *cloud) {
+  const PointFieldReader x(msg, "x"), y(msg, "y"), z(msg, "z");
+  const PointFieldReader ring_field(msg, "ring");
+  PointFieldReader firing_field(msg, "time");
+  for (const char *name : {"t", "timestamp", "azimuth"})
+    if (!firing_field.valid()) firing_field = PointFieldReader(msg, name);
+  PointFieldReader type_field(msg, "return_type");
+  if (!type_field.valid()) type_field = PointFieldReader(msg, "return");
+
+  const size_t n = static_cast<size_t>(msg.width) * msg.height;
+  paired_ = ring_field.valid() && firing_field.valid();
+  const bool filter = epsilon > 0.0f && paired_;
+  first_returns_.clear();
+  if (filter) first_returns_.reserve(n);
+
+  pcl_conversions::toPCL(msg.header, cloud->header);
+  cloud->points.clear();
+  cloud->points.reserve(n);
+  dropped_ = 0;
+  for (size_t row = 0; row < msg.height; ++row) {
+    const uint8_t *data = msg.data.data() + row * msg.row_step;
+    for (size_t i = 0; i < msg.width; ++i, data += msg.point_step) {
+      pcl::PointXYZ p;
+      p.x = x(data), p.y = y(data), p.z = z(data);
+      if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z))
+        continue;
+      if (!filter) {
+        cloud->points.push_back(p);
+        continue;
+      }
+
+      const Firing firing = {firing_field.bits(data),
+                             static_cast<int>(ring_field(data))};
+      const float range = p.getVector3fMap().norm();
+      const float type = type_field.valid() ? type_field(data) : 0.0f;
+      const auto inserted =
+          first_returns_.emplace(firing, FirstReturn{range, type});
+      const FirstReturn &first = inserted.first->second;
+      if (!inserted.second && (!type_field.valid() || type != first.type) &&
+          std::abs(range - first.range) < epsilon) {
+        dropped_++;
+        continue;
+      }
+      cloud->points.push_back(p);
+    }
+  }
+  cloud->width = cloud->points.size();
+  cloud->height = 1;
+  cloud->is_dense = true;
+}
+
+}  // namespace lidar_obstacle_detector
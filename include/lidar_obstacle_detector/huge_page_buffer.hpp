@@ -0,0 +1,264 @@
+/* huge_page_buffer.hpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Implementation of reusable buffers backed by 2 MB huge pages
+
+**/
+
+#pragma once
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace lidar_obstacle_detector {
+
+// Requested backing of the buffers, and the backing they actually got
+enum HugePageMode {
+  HUGE_PAGES_OFF = 0,      // regular 4 KB pages
+  HUGE_PAGES_THP = 1,      // transparent huge pages, madvise'd mmap region
+  HUGE_PAGES_HUGETLB = 2,  // explicit hugetlbfs pages (MAP_HUGETLB)
+};
+
+const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+inline std::atomic<int> &hugePageMode() {
+  static std::atomic<int> mode(HUGE_PAGES_OFF);
+  return mode;
+}
+
+// Applies to the buffers (re)allocated afterwards
+inline void setHugePageMode(const int mode) { hugePageMode() = mode; }
+
+inline int parseHugePageMode(const std::string &name) {
+  if (name == "hugetlb") return HUGE_PAGES_HUGETLB;
+  if (name == "thp") return HUGE_PAGES_THP;
+  return HUGE_PAGES_OFF;
+}
+
+inline const char *hugePageModeName(const int mode) {
+  return mode == HUGE_PAGES_HUGETLB ? "hugetlb"
+         : mode == HUGE_PAGES_THP   ? "thp"
+                                    : "off";
+}
+
+// Whether the kernel would honour MADV_HUGEPAGE at all
+inline bool transparentHugePagesEnabled() {
+  std::ifstream file("/sys/kernel/mm/transparent_hugepage/enabled");
+  std::string line;
+  std::getline(file, line);
+  return !line.empty() && line.find("[never]") == std::string::npos;
+}
+
+struct HugePageRegion {
+  void *data = nullptr;
+  size_t bytes = 0;
+  int backing = HUGE_PAGES_OFF;
+  bool mapped = false;  // mmap'd rather than malloc'd
+};
+
+// Allocates at least `bytes`, trying the requested mode first and falling
+// back to the next cheaper one
+inline HugePageRegion allocateRegion(const size_t bytes, const int mode) {
+  HugePageRegion region;
+  if (bytes == 0) return region;
+  const size_t rounded =
+      (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+
+  if (mode >= HUGE_PAGES_HUGETLB) {
+    void *data = mmap(nullptr, rounded, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (data != MAP_FAILED) {
+      region.data = data;
+      region.bytes = rounded;
+      region.backing = HUGE_PAGES_HUGETLB;
+      region.mapped = true;
+      return region;
+    }
+  }
+
+  if (mode >= HUGE_PAGES_THP) {
+    // Over-allocate to trim the region to a 2 MB aligned start
+    void *raw = mmap(nullptr, rounded + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw != MAP_FAILED) {
+      const uintptr_t start = reinterpret_cast<uintptr_t>(raw);
+      const uintptr_t aligned =
+          (start + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+      if (aligned > start) munmap(raw, aligned - start);
+      const size_t tail = start + rounded + HUGE_PAGE_SIZE - aligned - rounded;
+      if (tail > 0) munmap(reinterpret_cast<void *>(aligned + rounded), tail);
+
+      region.data = reinterpret_cast<void *>(aligned);
+      region.bytes = rounded;
+      region.mapped = true;
+      region.backing = madvise(region.data, rounded, MADV_HUGEPAGE) == 0 &&
+                               transparentHugePagesEnabled()
+                           ? HUGE_PAGES_THP
+                           : HUGE_PAGES_OFF;
+      return region;
+    }
+  }
+
+  region.data = std::malloc(bytes);
+  region.bytes = region.data ? bytes : 0;
+  region.backing = HUGE_PAGES_OFF;
+  return region;
+}
+
+inline void releaseRegion(const HugePageRegion &region) {
+  if (!region.data) return;
+  if (region.mapped)
+    munmap(region.data, region.bytes);
+  else
+    std::free(region.data);
+}
+
+class HugePageBufferBase;
+
+// All the live buffers, for reporting which of them got huge pages
+struct HugePageBufferInfo {
+  std::string name;
+  size_t bytes;
+  int backing;
+};
+
+class HugePageBufferRegistry {
+ public:
+  static HugePageBufferRegistry &instance() {
+    static HugePageBufferRegistry registry;
+    return registry;
+  }
+
+  // Registers the buffer under `name`, or under the first free "name_<n>"
+  // when a live buffer has it already (e.g. the same buffer of every sector
+  // detector). Returns the name it got.
+  std::string add(const HugePageBufferBase *buffer, const std::string &name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string unique = name;
+    for (int n = 1; taken(unique); ++n) unique = name + "_" + std::to_string(n);
+    entries_.push_back({buffer, unique});
+    return unique;
+  }
+
+  void remove(const HugePageBufferBase *buffer) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.erase(std::remove_if(entries_.begin(), entries_.end(),
+                                  [buffer](const Entry &entry) {
+                                    return entry.buffer == buffer;
+                                  }),
+                   entries_.end());
+  }
+
+  std::vector<HugePageBufferInfo> snapshot() const;
+
+ private:
+  struct Entry {
+    const HugePageBufferBase *buffer;
+    std::string name;
+  };
+
+  mutable std::mutex mutex_;
+  std::vector<Entry> entries_;
+
+  bool taken(const std::string &name) const {
+    for (auto &entry : entries_) {
+      if (entry.name == name) return true;
+    }
+    return false;
+  }
+};
+
+class HugePageBufferBase {
+ public:
+  explicit HugePageBufferBase(const std::string &name) {
+    name_ = HugePageBufferRegistry::instance().add(this, name);
+  }
+  virtual ~HugePageBufferBase() {
+    HugePageBufferRegistry::instance().remove(this);
+    releaseRegion(region_);
+  }
+  HugePageBufferBase(const HugePageBufferBase &) = delete;
+  HugePageBufferBase &operator=(const HugePageBufferBase &) = delete;
+
+  const std::string &name() const { return name_; }
+  size_t capacityBytes() const { return bytes_.load(); }
+  int backing() const { return backing_.load(); }
+
+ protected:
+  // Grows the region to at least `bytes`, keeping the first `keep` bytes
+  void reserveBytes(const size_t bytes, const size_t keep) {
+    if (bytes <= region_.bytes) return;
+    const HugePageRegion region =
+        allocateRegion(std::max(bytes, 2 * region_.bytes), hugePageMode());
+    if (!region.data) throw std::bad_alloc();
+    if (keep > 0) std::memcpy(region.data, region_.data, keep);
+    releaseRegion(region_);
+    region_ = region;
+    bytes_ = region.bytes;
+    backing_ = region.backing;
+  }
+
+  HugePageRegion region_;
+
+ private:
+  std::string name_;  // unique among the live buffers
+  std::atomic<size_t> bytes_{0};
+  std::atomic<int> backing_{HUGE_PAGES_OFF};
+};
+
+inline std::vector<HugePageBufferInfo> HugePageBufferRegistry::snapshot()
+    const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<HugePageBufferInfo> infos;
+  for (auto &entry : entries_) {
+    infos.push_back({entry.name, entry.buffer->capacityBytes(),
+                     entry.buffer->backing()});
+  }
+  return infos;
+}
+
+// A grow-only array of trivially copyable elements. The memory is kept from
+// frame to frame, so after the first frames resize() never allocates.
+template <typename T>
+class HugePageBuffer : public HugePageBufferBase {
+ public:
+  explicit HugePageBuffer(const std::string &name)
+      : HugePageBufferBase(name) {}
+
+  void resize(const size_t n) {
+    reserveBytes(n * sizeof(T), size_ * sizeof(T));
+    size_ = n;
+  }
+
+  void assign(const size_t n, const T &value) {
+    resize(n);
+    std::fill(data(), data() + n, value);
+  }
+
+  T *data() { return static_cast<T *>(region_.data); }
+  const T *data() const { return static_cast<const T *>(region_.data); }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  T &operator[](const size_t i) { return data()[i]; }
+  const T &operator[](const size_t i) const { return data()[i]; }
+  T *begin() { return data(); }
+  T *end() { return data() + size_; }
+  const T *begin() const { return data(); }
+  const T *end() const { return data() + size_; }
+
+ private:
+  size_t size_ = 0;
+};
+
+}  // namespace lidar_obstacle_detector
@@ -0,0 +1,237 @@
+/* jpda.hpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Implementation of the Joint Probabilistic Data Association (JPDA) backend
+
+**/
+
+#pragma once
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+#include "lidar_obstacle_detector/box.hpp"
+
+namespace lidar_obstacle_detector {
+
+struct JPDAParams {
+  float detection_prob = 0.9f;   // P_D, probability a track is detected
+  float clutter_density = 0.1f;  // lambda, density of false detections
+  float gate_sigma = 0.5f;       // std dev of the normalised displacement
+  int max_hypotheses = 256;      // hard cap of joint events per cluster
+};
+
+class JPDA {
+ public:
+  explicit JPDA(const JPDAParams &params) : params_(params) {}
+
+  // Computes the association probabilities between tracks and detections.
+  // gate[i][j] is true if detection j falls inside the gate of track i.
+  // likelihood[i][j] is the measurement likelihood of detection j given
+  // track i. Returns beta[i][j] (j < detections) and beta[i][detections],
+  // the probability that track i was not detected.
+  std::vector<std::vector<float>> associate(
+      const std::vector<std::vector<bool>> &gate,
+      const std::vector<std::vector<float>> &likelihood) const;
+
+  // Number of joint events enumerated in the last call to associate()
+  int hypothesesEvaluated() const { return hypotheses_evaluated_; }
+
+  // Number of clusters whose enumeration hit max_hypotheses
+  int clustersTruncated() const { return clusters_truncated_; }
+
+ private:
+  JPDAParams params_;
+  mutable int hypotheses_evaluated_ = 0;
+  mutable int clusters_truncated_ = 0;
+
+  // Split tracks and detections into independent gated clusters
+  std::vector<std::pair<std::vector<int>, std::vector<int>>> gateClusters(
+      const std::vector<std::vector<bool>> &gate) const;
+
+  // Enumerate the joint events of one cluster and accumulate the marginals
+  void enumerateCluster(const std::vector<int> &tracks,
+                        const std::vector<int> &detections,
+                        const std::vector<std::vector<bool>> &gate,
+                        const std::vector<std::vector<float>> &likelihood,
+                        std::vector<std::vector<float>> *beta) const;
+
+  int findRoot(std::vector<int> *parent, int i) const;
+};
+
+// The update of a track: every detection weighted by the probability that
+// it belongs to the track, and the prediction by the probability that the
+// track was missed. beta is the track's row of JPDA::associate().
+inline Eigen::Vector3f weightedUpdate(const std::vector<float> &beta,
+                                      const std::vector<Box> &detections,
+                                      const Eigen::Vector3f &prediction) {
+  Eigen::Vector3f state = beta[detections.size()] * prediction;
+  for (size_t j = 0; j < detections.size(); ++j)
+    state += beta[j] * detections[j].position;
+  return state;
+}
+
+inline std::vector<std::vector<float>> JPDA::associate(
+    const std::vector<std::vector<bool>> &gate,
+    const std::vector<std::vector<float>> &likelihood) const {
+  hypotheses_evaluated_ = 0;
+  clusters_truncated_ = 0;
+
+  const int num_tracks = gate.size();
+  const int num_detections = num_tracks > 0 ? gate[0].size() : 0;
+  std::vector<std::vector<float>> beta(
+      num_tracks, std::vector<float>(num_detections + 1, 0.0f));
+  for (auto &row : beta) row[num_detections] = 1.0f;
+
+  for (auto &cluster : gateClusters(gate)) {
+    enumerateCluster(cluster.first, cluster.second, gate, likelihood, &beta);
+  }
+
+  return beta;
+}
+
+inline int JPDA::findRoot(std::vector<int> *parent, int i) const {
+  while ((*parent)[i] != i) {
+    (*parent)[i] = (*parent)[(*parent)[i]];
+    i = (*parent)[i];
+  }
+  return i;
+}
+
+inline std::vector<std::pair<std::vector<int>, std::vector<int>>>
+JPDA::gateClusters(const std::vector<std::vector<bool>> &gate) const {
+  const int num_tracks = gate.size();
+  const int num_detections = num_tracks > 0 ? gate[0].size() : 0;
+
+  // Union-find over tracks [0, num_tracks) and detections [num_tracks, ...)
+  std::vector<int> parent(num_tracks + num_detections);
+  std::iota(parent.begin(), parent.end(), 0);
+  for (int i = 0; i < num_tracks; ++i) {
+    for (int j = 0; j < num_detections; ++j) {
+      if (!gate[i][j]) continue;
+      const int a = findRoot(&parent, i);
+      const int b = findRoot(&parent, num_tracks + j);
+      if (a != b) parent[std::max(a, b)] = std::min(a, b);
+    }
+  }
+
+  // Only tracks with at least one gated detection form a cluster, the others
+  // keep their default "not detected" probability of 1
+  std::vector<int> cluster_of(num_tracks + num_detections, -1);
+  std::vector<std::pair<std::vector<int>, std::vector<int>>> clusters;
+  for (int i = 0; i < num_tracks; ++i) {
+    if (std::none_of(gate[i].begin(), gate[i].end(),
+                     [](bool g) { return g; }))
+      continue;
+    const int root = findRoot(&parent, i);
+    if (cluster_of[root] == -1) {
+      cluster_of[root] = clusters.size();
+      clusters.emplace_back();
+    }
+    clusters[cluster_of[root]].first.push_back(i);
+  }
+  for (int j = 0; j < num_detections; ++j) {
+    const int root = findRoot(&parent, num_tracks + j);
+    if (cluster_of[root] != -1)
+      clusters[cluster_of[root]].second.push_back(j);
+  }
+
+  return clusters;
+}
+
+inline void JPDA::enumerateCluster(
+    const std::vector<int> &tracks, const std::vector<int> &detections,
+    const std::vector<std::vector<bool>> &gate,
+    const std::vector<std::vector<float>> &likelihood,
+    std::vector<std::vector<float>> *beta) const {
+  const int num_detections = gate[0].size();
+  const float missed_weight = 1.0f - params_.detection_prob;
+
+  // Candidate detections of every track, most likely first, so that the
+  // events enumerated before hitting the cap are the dominant ones
+  std::vector<std::vector<std::pair<float, int>>> candidates(tracks.size());
+  for (size_t t = 0; t < tracks.size(); ++t) {
+    for (int j : detections) {
+      if (!gate[tracks[t]][j]) continue;
+      const float weight = params_.detection_prob *
+                           likelihood[tracks[t]][j] / params_.clutter_density;
+      candidates[t].emplace_back(weight, j);
+    }
+    std::sort(candidates[t].begin(), candidates[t].end(),
+              [](const std::pair<float, int> &a,
+                 const std::pair<float, int> &b) { return a.first > b.first; });
+  }
+
+  // Depth-first enumeration of the feasible joint events. choice[t] is the
+  // detection assigned to track t, or -1 if it was missed
+  std::vector<float> marginals(tracks.size() * (num_detections + 1), 0.0f);
+  std::vector<int> choice(tracks.size(), -1);
+  std::vector<bool> used(num_detections, false);
+  float total = 0.0f;
+  int evaluated = 0;
+
+  // Every frame holds the next option to try for its track and the weight of
+  // the partial event over the tracks before it
+  struct Frame {
+    int next;
+    float weight;
+  };
+  std::vector<Frame> stack;
+  stack.push_back({0, 1.0f});
+  while (!stack.empty() && evaluated < params_.max_hypotheses) {
+    const int t = stack.size() - 1;
+    Frame &frame = stack.back();
+    const int num_candidates = candidates[t].size();
+
+    // Release the detection taken by the previous option of this track
+    if (choice[t] >= 0) used[choice[t]] = false;
+    choice[t] = -1;
+
+    // Every free candidate in order, then option num_candidates (missed)
+    int option = frame.next;
+    while (option < num_candidates && used[candidates[t][option].second])
+      ++option;
+    if (option > num_candidates) {
+      stack.pop_back();
+      continue;
+    }
+    frame.next = option + 1;
+
+    float weight = frame.weight;
+    if (option == num_candidates) {
+      weight *= missed_weight;
+    } else {
+      choice[t] = candidates[t][option].second;
+      used[choice[t]] = true;
+      weight *= candidates[t][option].first;
+    }
+
+    if (t + 1 < static_cast<int>(tracks.size())) {
+      stack.push_back({0, weight});
+      continue;
+    }
+
+    // A complete joint event
+    total += weight;
+    ++evaluated;
+    for (size_t k = 0; k < tracks.size(); ++k) {
+      const int j = choice[k] >= 0 ? choice[k] : num_detections;
+      marginals[k * (num_detections + 1) + j] += weight;
+    }
+  }
+  if (!stack.empty()) ++clusters_truncated_;
+  hypotheses_evaluated_ += evaluated;
+
+  if (total <= 0.0f) return;
+  for (size_t k = 0; k < tracks.size(); ++k) {
+    for (int j = 0; j <= num_detections; ++j) {
+      (*beta)[tracks[k]][j] = marginals[k * (num_detections + 1) + j] / total;
+    }
+  }
+}
+
+}  // namespace lidar_obstacle_detector
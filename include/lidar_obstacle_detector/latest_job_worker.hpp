@@ -0,0 +1,83 @@
+/* latest_job_worker.hpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Implementation of the low priority worker of the debug outputs
+
+**/
+
+#pragma once
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+namespace lidar_obstacle_detector {
+
+// Runs jobs one at a time on its own thread, niced so that it only gets the
+// CPU time the detection leaves. Only the latest job is kept: one submitted
+// while another is still waiting replaces it, as a newer frame makes the
+// debug output of an older one worthless. submit() never waits for a job.
+class LatestJobWorker {
+ public:
+  typedef std::function<void()> Job;
+
+  explicit LatestJobWorker(const int niceness)
+      : niceness_(niceness), running_(true) {
+    thread_ = std::thread(&LatestJobWorker::run, this);
+  }
+
+  // Finishes the running job, the waiting one is dropped
+  ~LatestJobWorker() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      running_ = false;
+    }
+    wake_.notify_all();
+    if (thread_.joinable()) thread_.join();
+  }
+
+  // False if a waiting job was replaced
+  bool submit(Job job) {
+    bool replaced;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      replaced = static_cast<bool>(pending_);
+      pending_ = std::move(job);
+    }
+    wake_.notify_one();
+    return !replaced;
+  }
+
+ private:
+  const int niceness_;
+  Job pending_;
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool running_;
+  std::thread thread_;
+
+  void run() {
+    // Linux threads have their own nice value
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), niceness_);
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      wake_.wait(lock, [this] { return !running_ || pending_; });
+      if (!running_) break;
+      Job job = std::move(pending_);
+      pending_ = nullptr;
+      lock.unlock();
+      job();
+      lock.lock();
+    }
+  }
+};
+
+}  // namespace lidar_obstacle_detector
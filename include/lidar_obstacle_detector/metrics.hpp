@@ -0,0 +1,306 @@
+/* metrics.hpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Lock-free metrics and a minimal OpenMetrics HTTP endpoint
+
+**/
+
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace lidar_obstacle_detector {
+
+class Counter {
+ public:
+  void inc(const uint64_t n = 1) {
+    value_.fetch_add(n, std::memory_order_relaxed);
+  }
+  uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<uint64_t> value_{0};
+};
+
+class Gauge {
+ public:
+  void set(const double value) {
+    value_.store(value, std::memory_order_relaxed);
+  }
+  double value() const { return value_.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<double> value_{0.0};
+};
+
+// Fixed buckets set at construction, observe() only touches atomics
+class Histogram {
+ public:
+  explicit Histogram(const std::vector<double> &bounds)
+      : bounds_(bounds), counts_(bounds.size() + 1) {
+    for (auto &count : counts_) count.store(0);
+  }
+
+  void observe(const double value) {
+    size_t i = 0;
+    while (i < bounds_.size() && value > bounds_[i]) ++i;
+    counts_[i].fetch_add(1, std::memory_order_relaxed);
+    double sum = sum_.load(std::memory_order_relaxed);
+    while (!sum_.compare_exchange_weak(sum, sum + value,
+                                       std::memory_order_relaxed)) {
+    }
+  }
+
+  const std::vector<double> &bounds() const { return bounds_; }
+  uint64_t count(const size_t bucket) const {
+    return counts_[bucket].load(std::memory_order_relaxed);
+  }
+  double sum() const { return sum_.load(std::memory_order_relaxed); }
+
+ private:
+  const std::vector<double> bounds_;
+  std::deque<std::atomic<uint64_t>> counts_;
+  std::atomic<double> sum_{0.0};
+};
+
+// Owns all the metrics. Metrics are registered at startup, afterwards the
+// processing thread only updates them and the server thread only reads them.
+class MetricsRegistry {
+ public:
+  Counter *counter(const std::string &name, const std::string &help,
+                   const std::string &labels = "") {
+    counters_.emplace_back();
+    addSample(name, help, "counter", labels, 'c', counters_.size() - 1);
+    return &counters_.back();
+  }
+
+  Gauge *gauge(const std::string &name, const std::string &help,
+               const std::string &labels = "") {
+    gauges_.emplace_back();
+    addSample(name, help, "gauge", labels, 'g', gauges_.size() - 1);
+    return &gauges_.back();
+  }
+
+  Histogram *histogram(const std::string &name, const std::string &help,
+                       const std::vector<double> &bounds,
+                       const std::string &labels = "") {
+    histograms_.emplace_back(bounds);
+    addSample(name, help, "histogram", labels, 'h', histograms_.size() - 1);
+    return &histograms_.back();
+  }
+
+  // Called on the server thread before every render, to refresh metrics
+  // that are cheaper to sample on scrape than to update per frame
+  void addCollector(const std::function<void()> &collector) {
+    collectors_.push_back(collector);
+  }
+
+  // A gauge family of which the samples, labels and values, are only known
+  // on scrape, e.g. one per object that may be created or destroyed while
+  // running. `sampler` is called on the server thread before every render.
+  typedef std::vector<std::pair<std::string, double>> GaugeSamples;
+  void gaugeFamily(const std::string &name, const std::string &help,
+                   const std::function<GaugeSamples()> &sampler) {
+    families_.push_back({name, help, "gauge", {}, sampler});
+  }
+
+  // Render all the metrics in the OpenMetrics text format
+  std::string render() const;
+
+ private:
+  struct Sample {
+    std::string labels;
+    char kind;
+    size_t index;
+  };
+  struct Family {
+    std::string name, help, type;
+    std::vector<Sample> samples;
+    std::function<GaugeSamples()> sampler;
+  };
+
+  std::deque<Counter> counters_;
+  std::deque<Gauge> gauges_;
+  std::deque<Histogram> histograms_;
+  std::vector<Family> families_;
+  std::vector<std::function<void()>> collectors_;
+
+  void addSample(const std::string &name, const std::string &help,
+                 const std::string &type, const std::string &labels,
+                 const char kind, const size_t index) {
+    for (auto &family : families_) {
+      if (family.name == name) {
+        family.samples.push_back({labels, kind, index});
+        return;
+      }
+    }
+    families_.push_back({name, help, type, {{labels, kind, index}}, nullptr});
+  }
+
+  static std::string withLabels(const std::string &labels,
+                                const std::string &extra = "") {
+    if (labels.empty() && extra.empty()) return "";
+    if (labels.empty()) return "{" + extra + "}";
+    if (extra.empty()) return "{" + labels + "}";
+    return "{" + labels + "," + extra + "}";
+  }
+};
+
+inline std::string MetricsRegistry::render() const {
+  for (auto &collector : collectors_) collector();
+
+  std::ostringstream out;
+  for (auto &family : families_) {
+    out << "# TYPE " << family.name << " " << family.type << "\n";
+    out << "# HELP " << family.name << " " << family.help << "\n";
+    if (family.sampler) {
+      for (auto &sample : family.sampler())
+        out << family.name << withLabels(sample.first) << " " << sample.second
+            << "\n";
+    }
+    for (auto &sample : family.samples) {
+      if (sample.kind == 'c') {
+        out << family.name << "_total" << withLabels(sample.labels) << " "
+            << counters_[sample.index].value() << "\n";
+      } else if (sample.kind == 'g') {
+        out << family.name << withLabels(sample.labels) << " "
+            << gauges_[sample.index].value() << "\n";
+      } else {
+        const Histogram &histogram = histograms_[sample.index];
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i <= histogram.bounds().size(); ++i) {
+          cumulative += histogram.count(i);
+          std::ostringstream le;
+          if (i < histogram.bounds().size())
+            le << "le=\"" << histogram.bounds()[i] << "\"";
+          else
+            le << "le=\"+Inf\"";
+          out << family.name << "_bucket"
+              << withLabels(sample.labels, le.str()) << " " << cumulative
+              << "\n";
+        }
+        out << family.name << "_sum" << withLabels(sample.labels) << " "
+            << histogram.sum() << "\n";
+        out << family.name << "_count" << withLabels(sample.labels) << " "
+            << cumulative << "\n";
+      }
+    }
+  }
+  out << "# EOF\n";
+
+  return out.str();
+}
+
+// Serves GET requests on a local port with the rendered registry, from its
+// own thread. The processing thread is never involved in a scrape.
+class MetricsServer {
+ public:
+  MetricsServer(const MetricsRegistry &registry, const int port)
+      : registry_(registry), port_(port), running_(true) {
+    thread_ = std::thread(&MetricsServer::serve, this);
+  }
+
+  ~MetricsServer() {
+    running_ = false;
+    if (thread_.joinable()) thread_.join();
+  }
+
+ private:
+  const MetricsRegistry &registry_;
+  const int port_;
+  std::atomic<bool> running_;
+  std::thread thread_;
+
+  void serve();
+  void respond(const int client);
+};
+
+inline void MetricsServer::serve() {
+  const int server = socket(AF_INET, SOCK_STREAM, 0);
+  if (server < 0) {
+    std::cerr << "Metrics server: could not create a socket" << std::endl;
+    return;
+  }
+  const int reuse = 1;
+  setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port_);
+  if (bind(server, reinterpret_cast<sockaddr *>(&address), sizeof(address)) <
+          0 ||
+      listen(server, 4) < 0) {
+    std::cerr << "Metrics server: could not listen on port " << port_
+              << std::endl;
+    close(server);
+    return;
+  }
+
+  // Poll with a timeout so that the destructor can stop the thread
+  pollfd fd{server, POLLIN, 0};
+  while (running_) {
+    if (poll(&fd, 1, 200) <= 0) continue;
+    const int client = accept(server, nullptr, nullptr);
+    if (client < 0) continue;
+    respond(client);
+    close(client);
+  }
+  close(server);
+}
+
+inline void MetricsServer::respond(const int client) {
+  // Read the request header, only the request line matters
+  std::string request;
+  char buffer[1024];
+  pollfd fd{client, POLLIN, 0};
+  while (request.find("\r\n\r\n") == std::string::npos &&
+         request.size() < 8192 && poll(&fd, 1, 500) > 0) {
+    const ssize_t n = recv(client, buffer, sizeof(buffer), 0);
+    if (n <= 0) break;
+    request.append(buffer, n);
+  }
+
+  std::string status = "200 OK";
+  std::string body;
+  if (request.compare(0, 12, "GET /metrics") == 0 ||
+      request.compare(0, 6, "GET / ") == 0) {
+    body = registry_.render();
+  } else {
+    status = "404 Not Found";
+  }
+
+  std::ostringstream response;
+  response << "HTTP/1.1 " << status << "\r\n"
+           << "Content-Type: application/openmetrics-text; version=1.0.0; "
+              "charset=utf-8\r\n"
+           << "Content-Length: " << body.size() << "\r\n"
+           << "Connection: close\r\n\r\n"
+           << body;
+  const std::string data = response.str();
+  size_t sent = 0;
+  while (sent < data.size()) {
+    const ssize_t n =
+        send(client, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (n <= 0) break;
+    sent += n;
+  }
+}
+
+}  // namespace lidar_obstacle_detector
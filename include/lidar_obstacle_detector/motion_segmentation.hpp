@@ -0,0 +1,287 @@
+/* motion_segmentation.hpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Implementation of the static/dynamic labelling from voxel occupancy history
+
+**/
+
+#pragma once
+
+#include <pcl/point_cloud.h>
+
+#include <Eigen/Geometry>
+#include <algorithm>
+#include <bitset>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "lidar_obstacle_detector/box.hpp"
+
+namespace lidar_obstacle_detector {
+
+struct MotionParams {
+  float voxel_size = 0.4f;  // of the occupancy grid, in the fixed frame
+  int history_frames = 10;  // frames remembered per voxel, at most 64
+  int static_hits = 6;      // earlier frames a voxel must be occupied in
+  float static_ratio = 0.6f;  // of a cluster's points in static voxels
+  int hold_frames = 3;        // a new label must persist before it is taken
+  float hold_distance = 1.0f;  // between the centroids of the same object
+  int static_missed_frames = 5;  // a static track outlives its last box
+};
+
+// One bit per frame of the last history_frames frames for every voxel of a
+// frame fixed to the world (e.g. odom), so that the ego motion is
+// compensated. A point is static if its voxel was occupied in enough earlier
+// frames, and a cluster is static if enough of its points are. The label of
+// a cluster only flips once the new one held for hold_frames frames at about
+// the same place, so that the objects near the threshold do not flicker.
+template <typename PointT>
+class OccupancyHistory {
+ public:
+  explicit OccupancyHistory(const MotionParams &params = MotionParams())
+      : params_(params), frame_(0) {}
+
+  // Forgets the history if the grid changes
+  void setParams(const MotionParams &params);
+
+  // Labels the clusters of the next frame (1 for static), then adds their
+  // points to the history. to_fixed moves the sensor frame to the fixed one.
+  // A frame without a transform should not be passed at all.
+  std::vector<char> update(
+      const std::vector<typename pcl::PointCloud<PointT>::Ptr> &clusters,
+      const Eigen::Affine3f &to_fixed);
+
+ private:
+  // The bits are aged lazily: bit i is frame `frame - i`
+  struct Voxel {
+    uint64_t bits;
+    uint32_t frame;
+  };
+
+  // The label held at a place of the fixed frame, and for how many frames
+  // the opposite one was measured there
+  struct Held {
+    Eigen::Vector2f centroid;
+    char label;
+    int pending;
+    uint32_t frame;  // last seen
+  };
+
+  MotionParams params_;
+  uint32_t frame_;
+  std::unordered_map<int64_t, Voxel> voxels_;
+  std::vector<int64_t> keys_;
+  std::vector<Held> held_;
+
+  // Applies the hysteresis to the raw labels of the clusters
+  void holdLabels(const std::vector<Eigen::Vector2f> &centroids,
+                  std::vector<char> *labels);
+
+  uint64_t windowMask() const {
+    const int frames = std::min(std::max(params_.history_frames, 1), 64);
+    return frames == 64 ? ~0ull : (1ull << frames) - 1;
+  }
+  uint64_t bitsNow(const Voxel &voxel) const {
+    const uint32_t age = frame_ - voxel.frame;
+    return age >= 64 ? 0 : (voxel.bits << age) & windowMask();
+  }
+};
+
+template <typename PointT>
+void OccupancyHistory<PointT>::setParams(const MotionParams &params) {
+  if (params.voxel_size != params_.voxel_size) voxels_.clear();
+  params_ = params;
+}
+
+template <typename PointT>
+std::vector<char> OccupancyHistory<PointT>::update(
+    const std::vector<typename pcl::PointCloud<PointT>::Ptr> &clusters,
+    const Eigen::Affine3f &to_fixed) {
+  frame_++;
+  const float inverse_voxel = 1.0f / std::max(params_.voxel_size, 0.01f);
+  const auto key = [inverse_voxel](const Eigen::Vector3f &p) {
+    const int64_t x = std::floor(p(0) * inverse_voxel) + (1 << 20);
+    const int64_t y = std::floor(p(1) * inverse_voxel) + (1 << 20);
+    const int64_t z = std::floor(p(2) * inverse_voxel) + (1 << 20);
+    return (x << 42) | (y << 21) | z;
+  };
+
+  // Label against the earlier frames only, bit 0 is not set yet
+  std::vector<char> labels(clusters.size(), 0);
+  std::vector<Eigen::Vector2f> centroids(clusters.size());
+  keys_.clear();
+  for (size_t c = 0; c < clusters.size(); ++c) {
+    int static_points = 0;
+    Eigen::Vector3f sum = Eigen::Vector3f::Zero();
+    for (auto &p : clusters[c]->points) {
+      const Eigen::Vector3f fixed = to_fixed * p.getVector3fMap();
+      sum += fixed;
+      keys_.push_back(key(fixed));
+      const auto found = voxels_.find(keys_.back());
+      if (found == voxels_.end()) continue;
+      const std::bitset<64> bits(bitsNow(found->second));
+      if (bits.count() >= params_.static_hits) static_points++;
+    }
+    labels[c] = !clusters[c]->empty() &&
+                static_points >= params_.static_ratio * clusters[c]->size();
+    centroids[c] = sum.head<2>() / std::max<size_t>(clusters[c]->size(), 1);
+  }
+  holdLabels(centroids, &labels);
+
+  for (auto voxel_key : keys_) {
+    Voxel &voxel = voxels_[voxel_key];
+    voxel.bits = bitsNow(voxel) | 1;
+    voxel.frame = frame_;
+  }
+
+  // Drop the voxels that fell out of the window, once per window
+  const int frames = std::min(std::max(params_.history_frames, 1), 64);
+  if (frame_ % frames == 0) {
+    for (auto it = voxels_.begin(); it != voxels_.end();) {
+      if (bitsNow(it->second) == 0)
+        it = voxels_.erase(it);
+      else
+        ++it;
+    }
+  }
+
+  return labels;
+}
+
+template <typename PointT>
+void OccupancyHistory<PointT>::holdLabels(
+    const std::vector<Eigen::Vector2f> &centroids, std::vector<char> *labels) {
+  // The nearest held label within hold_distance, through a grid of
+  // hold_distance cells
+  const float cell_size = std::max(params_.hold_distance, 0.1f);
+  const auto cell = [cell_size](const float value) {
+    return static_cast<int64_t>(std::floor(value / cell_size));
+  };
+  const auto key = [](const int64_t x, const int64_t y) {
+    return ((x + (1 << 30)) << 32) | (y + (1 << 30));
+  };
+  std::unordered_map<int64_t, std::vector<int>> grid;
+  for (int h = 0; h < held_.size(); ++h)
+    grid[key(cell(held_[h].centroid(0)), cell(held_[h].centroid(1)))]
+        .push_back(h);
+
+  std::vector<Held> held;
+  std::vector<char> matched(held_.size(), 0);
+  for (size_t c = 0; c < centroids.size(); ++c) {
+    int best = -1;
+    float best_distance = params_.hold_distance;
+    const int64_t cx = cell(centroids[c](0)), cy = cell(centroids[c](1));
+    for (int64_t x = cx - 1; x <= cx + 1; ++x) {
+      for (int64_t y = cy - 1; y <= cy + 1; ++y) {
+        const auto found = grid.find(key(x, y));
+        if (found == grid.end()) continue;
+        for (int h : found->second) {
+          const float distance = (held_[h].centroid - centroids[c]).norm();
+          if (!matched[h] && distance < best_distance) {
+            best = h;
+            best_distance = distance;
+          }
+        }
+      }
+    }
+
+    char &label = (*labels)[c];
+    Held next = {centroids[c], label, 0, frame_};
+    if (best >= 0) {
+      matched[best] = 1;
+      const Held &last = held_[best];
+      if (label != last.label && last.pending + 1 < params_.hold_frames) {
+        next.label = last.label;
+        next.pending = last.pending + 1;
+      }
+    }
+    label = next.label;
+    held.push_back(next);
+  }
+
+  // The places of the objects missed in this frame are remembered over the
+  // history window
+  for (int h = 0; h < held_.size(); ++h) {
+    if (!matched[h] && frame_ - held_[h].frame < params_.history_frames)
+      held.push_back(held_[h]);
+  }
+  held_.swap(held);
+}
+
+// The cheap tracking of the static objects: a box takes the id of the
+// nearest earlier static box within max_distance in the fixed frame, found
+// through a grid of max_distance cells instead of a global assignment. A
+// track missed for up to max_missed frames keeps its id for when it is seen
+// again.
+class StaticTracker {
+ public:
+  void assignIds(std::vector<Box> *boxes, const Eigen::Affine3f &to_fixed,
+                 const float max_distance, const int max_missed);
+
+ private:
+  struct Track {
+    Eigen::Vector3f position;  // in the fixed frame
+    int id;
+    int missed;  // frames since the last box
+  };
+  std::unordered_map<int64_t, std::vector<int>> grid_;
+  std::vector<Track> tracks_;
+};
+
+inline void StaticTracker::assignIds(std::vector<Box> *boxes,
+                                     const Eigen::Affine3f &to_fixed,
+                                     const float max_distance,
+                                     const int max_missed) {
+  const float cell_size = std::max(max_distance, 0.1f);
+  const auto cell = [cell_size](const float value) {
+    return static_cast<int64_t>(std::floor(value / cell_size));
+  };
+  const auto key = [](const int64_t x, const int64_t y) {
+    return ((x + (1 << 30)) << 32) | (y + (1 << 30));
+  };
+
+  std::vector<Track> tracks;
+  std::vector<char> taken(tracks_.size(), 0);
+  for (auto &box : *boxes) {
+    const Eigen::Vector3f position = to_fixed * box.position;
+    int best = -1;
+    float best_distance = max_distance;
+    for (int64_t x = cell(position(0)) - 1; x <= cell(position(0)) + 1; ++x) {
+      for (int64_t y = cell(position(1)) - 1; y <= cell(position(1)) + 1;
+           ++y) {
+        const auto found = grid_.find(key(x, y));
+        if (found == grid_.end()) continue;
+        for (int t : found->second) {
+          const float distance =
+              (tracks_[t].position - position).head<2>().norm();
+          if (!taken[t] && distance < best_distance) {
+            best = t;
+            best_distance = distance;
+          }
+        }
+      }
+    }
+    if (best >= 0) {
+      taken[best] = 1;
+      box.id = tracks_[best].id;
+    }
+    tracks.push_back({position, box.id, 0});
+  }
+  for (int t = 0; t < tracks_.size(); ++t) {
+    if (!taken[t] && tracks_[t].missed < max_missed) {
+      tracks.push_back(tracks_[t]);
+      tracks.back().missed++;
+    }
+  }
+
+  tracks_.swap(tracks);
+  grid_.clear();
+  for (int t = 0; t < tracks_.size(); ++t)
+    grid_[key(cell(tracks_[t].position(0)), cell(tracks_[t].position(1)))]
+        .push_back(t);
+}
+
+}  // namespace lidar_obstacle_detector
@@ -0,0 +1,193 @@
+/* object_fusion.hpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Implementation of the object level fusion of several lidar detectors
+
+**/
+
+#pragma once
+
+#include <Eigen/Geometry>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <unordered_map>
+#include <vector>
+
+#include "lidar_obstacle_detector/box.hpp"
+
+namespace lidar_obstacle_detector {
+
+struct FusionParams {
+  float cell_size = 2.0f;       // gating grid cell, in metres
+  float merge_distance = 0.5f;  // closer centres are the same object
+  float merge_overlap = 0.1f;   // as are footprints with a larger IoU
+};
+
+// Move a box to another frame, its dimensions are kept
+inline Box transformBox(const Box &box, const Eigen::Affine3f &transform) {
+  const Eigen::Quaternionf rotation(transform.linear());
+  Box moved(box.id, transform * box.position, box.dimension,
+            (rotation * box.quaternion).normalized());
+  moved.velocity = transform.linear() * box.velocity;
+  moved.velocity_valid = box.velocity_valid;
+  moved.velocity_reliable = box.velocity_reliable;
+  moved.track_position = transform * box.track_position;
+  moved.track_filtered = box.track_filtered;
+  return moved;
+}
+
+// Collects the boxes of every sensor of a frame in a common frame, then
+// merges the detections of the same object by different sensors. Boxes of
+// one sensor are never merged with each other.
+class ObjectFusion {
+ public:
+  explicit ObjectFusion(const FusionParams &params = FusionParams())
+      : params_(params), num_sensors_(0) {}
+
+  void clear() {
+    entries_.clear();
+    num_sensors_ = 0;
+  }
+
+  // Boxes of the next sensor, and the transform from its frame
+  void addSensor(const std::vector<Box> &boxes,
+                 const Eigen::Affine3f &to_common);
+
+  // The merged boxes get the ids after first_id (see advanceBoxId)
+  std::vector<Box> fuse(const int first_id) const;
+
+ private:
+  struct Entry {
+    Box box;
+    int sensor;
+    Eigen::Vector2f min, max;  // footprint bounds in the common frame
+  };
+
+  FusionParams params_;
+  int num_sensors_;
+  std::vector<Entry> entries_;
+
+  bool sameObject(const Entry &a, const Entry &b) const;
+};
+
+inline void ObjectFusion::addSensor(const std::vector<Box> &boxes,
+                                    const Eigen::Affine3f &to_common) {
+  for (auto &box : boxes) {
+    Entry entry;
+    entry.box = transformBox(box, to_common);
+    entry.sensor = num_sensors_;
+    const Eigen::Vector3f half =
+        entry.box.quaternion.toRotationMatrix().cwiseAbs() *
+        (0.5f * entry.box.dimension);
+    entry.min = entry.box.position.head<2>() - half.head<2>();
+    entry.max = entry.box.position.head<2>() + half.head<2>();
+    entries_.push_back(entry);
+  }
+  num_sensors_++;
+}
+
+inline bool ObjectFusion::sameObject(const Entry &a, const Entry &b) const {
+  if ((a.box.position - b.box.position).head<2>().norm() <
+      params_.merge_distance)
+    return true;
+
+  const Eigen::Vector2f overlap =
+      (a.max.cwiseMin(b.max) - a.min.cwiseMax(b.min)).cwiseMax(0.0f);
+  const float intersection = overlap.prod();
+  const float area_a = (a.max - a.min).prod();
+  const float area_b = (b.max - b.min).prod();
+  const float union_area = area_a + area_b - intersection;
+  return union_area > 0 && intersection / union_area > params_.merge_overlap;
+}
+
+inline std::vector<Box> ObjectFusion::fuse(const int first_id) const {
+  // Gate with a grid of the footprints, so that only the boxes sharing a
+  // cell are compared
+  const float inverse_cell = 1.0f / std::max(params_.cell_size, 0.1f);
+  const auto cell = [inverse_cell](const float value) {
+    return static_cast<int64_t>(std::floor(value * inverse_cell));
+  };
+  const auto key = [](const int64_t x, const int64_t y) {
+    return ((x + (1 << 30)) << 32) | (y + (1 << 30));
+  };
+  const float margin = params_.merge_distance;
+  std::unordered_map<int64_t, std::vector<int>> grid;
+  for (int i = 0; i < entries_.size(); ++i) {
+    const Entry &entry = entries_[i];
+    for (int64_t x = cell(entry.min(0) - margin);
+         x <= cell(entry.max(0) + margin); ++x)
+      for (int64_t y = cell(entry.min(1) - margin);
+           y <= cell(entry.max(1) + margin); ++y)
+        grid[key(x, y)].push_back(i);
+  }
+
+  std::vector<int> parent(entries_.size());
+  std::iota(parent.begin(), parent.end(), 0);
+  const auto find = [&parent](int i) {
+    while (parent[i] != i) i = parent[i] = parent[parent[i]];
+    return i;
+  };
+  for (auto &cell_entries : grid) {
+    const auto &indices = cell_entries.second;
+    for (int a = 0; a < indices.size(); ++a) {
+      for (int b = a + 1; b < indices.size(); ++b) {
+        const Entry &first = entries_[indices[a]];
+        const Entry &second = entries_[indices[b]];
+        if (first.sensor == second.sensor) continue;
+        if (sameObject(first, second))
+          parent[find(indices[a])] = find(indices[b]);
+      }
+    }
+  }
+
+  // Groups in the order of their first box
+  std::vector<int> group(entries_.size(), -1);
+  std::vector<std::vector<int>> groups;
+  for (int i = 0; i < entries_.size(); ++i) {
+    const int root = find(i);
+    if (group[root] < 0) {
+      group[root] = groups.size();
+      groups.emplace_back();
+    }
+    groups[group[root]].push_back(i);
+  }
+
+  // A merged box keeps the orientation of its largest member and spans the
+  // corners of all the members
+  std::vector<Box> fused;
+  for (auto &members : groups) {
+    const Box *largest = &entries_[members.front()].box;
+    for (int i : members) {
+      const Box &box = entries_[i].box;
+      if (box.dimension.prod() > largest->dimension.prod()) largest = &box;
+    }
+    const Eigen::Matrix3f rotation = largest->quaternion.toRotationMatrix();
+
+    Eigen::Vector3f min = Eigen::Vector3f::Constant(1e9f);
+    Eigen::Vector3f max = Eigen::Vector3f::Constant(-1e9f);
+    for (int i : members) {
+      const Box &box = entries_[i].box;
+      const Eigen::Matrix3f box_rotation = box.quaternion.toRotationMatrix();
+      for (int corner = 0; corner < 8; ++corner) {
+        const Eigen::Vector3f sign((corner & 1) ? 0.5f : -0.5f,
+                                   (corner & 2) ? 0.5f : -0.5f,
+                                   (corner & 4) ? 0.5f : -0.5f);
+        const Eigen::Vector3f point =
+            box.position + box_rotation * sign.cwiseProduct(box.dimension);
+        const Eigen::Vector3f local = rotation.transpose() * point;
+        min = min.cwiseMin(local);
+        max = max.cwiseMax(local);
+      }
+    }
+    fused.emplace_back(advanceBoxId(first_id, fused.size()),
+                       rotation * (0.5f * (min + max)), max - min,
+                       largest->quaternion);
+  }
+
+  return fused;
+}
+
+}  // namespace lidar_obstacle_detector
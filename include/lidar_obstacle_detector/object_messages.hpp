@@ -0,0 +1,111 @@
+/* object_messages.hpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Implementation of the reused jsk box and autoware object messages
+
+**/
+
+#pragma once
+
+#include <autoware_msgs/DetectedObjectArray.h>
+#include <geometry_msgs/Pose.h>
+#include <jsk_recognition_msgs/BoundingBoxArray.h>
+#include <std_msgs/Header.h>
+
+#include <Eigen/Geometry>
+#include <utility>
+#include <vector>
+
+#include "lidar_obstacle_detector/box.hpp"
+
+namespace lidar_obstacle_detector {
+
+// Both output messages of a frame, kept from frame to frame and filled in
+// place in one pass over the boxes. The elements dropped when a frame has
+// fewer boxes are parked with their strings, and taken back before any new
+// element is made, so that a steady scene allocates nothing. The messages
+// are serialised by publish(), they can be refilled right after.
+class ObjectMessages {
+ public:
+  explicit ObjectMessages(const size_t capacity = 256) {
+    jsk_.boxes.reserve(capacity);
+    autoware_.objects.reserve(capacity);
+    spare_boxes_.reserve(capacity);
+    spare_objects_.reserve(capacity);
+  }
+
+  // Sizes both messages for `count` boxes of the frame of `header`
+  void reset(const std_msgs::Header &header, const size_t count) {
+    setHeader(header, &jsk_.header);
+    setHeader(header, &autoware_.header);
+    resize(count, &jsk_.boxes, &spare_boxes_);
+    resize(count, &autoware_.objects, &spare_objects_);
+  }
+
+  // Box i, at `pose` and `velocity` in the frame of the header
+  void set(const size_t i, const Box &box, const geometry_msgs::Pose &pose,
+           const Eigen::Vector3f &velocity) {
+    jsk_recognition_msgs::BoundingBox &jsk_bbox = jsk_.boxes[i];
+    setHeader(jsk_.header, &jsk_bbox.header);
+    jsk_bbox.pose = pose;
+    jsk_bbox.dimensions.x = box.dimension(0);
+    jsk_bbox.dimensions.y = box.dimension(1);
+    jsk_bbox.dimensions.z = box.dimension(2);
+    jsk_bbox.value = 1.0f;
+    jsk_bbox.label = box.id;
+
+    autoware_msgs::DetectedObject &autoware_object = autoware_.objects[i];
+    setHeader(autoware_.header, &autoware_object.header);
+    autoware_object.id = box.id;
+    autoware_object.label.assign("unknown");
+    autoware_object.score = 1.0f;
+    autoware_object.pose = pose;
+    autoware_object.pose_reliable = true;
+    autoware_object.dimensions.x = box.dimension(0);
+    autoware_object.dimensions.y = box.dimension(1);
+    autoware_object.dimensions.z = box.dimension(2);
+    autoware_object.velocity.linear.x = velocity(0);
+    autoware_object.velocity.linear.y = velocity(1);
+    autoware_object.velocity.linear.z = velocity(2);
+    autoware_object.velocity_reliable = box.velocity_reliable;
+    autoware_object.valid = true;
+  }
+
+  const jsk_recognition_msgs::BoundingBoxArray &jsk() const { return jsk_; }
+  const autoware_msgs::DetectedObjectArray &autoware() const {
+    return autoware_;
+  }
+
+ private:
+  jsk_recognition_msgs::BoundingBoxArray jsk_;
+  autoware_msgs::DetectedObjectArray autoware_;
+  std::vector<jsk_recognition_msgs::BoundingBox> spare_boxes_;
+  std::vector<autoware_msgs::DetectedObject> spare_objects_;
+
+  // The frame_id is only copied when it changes
+  static void setHeader(const std_msgs::Header &from, std_msgs::Header *to) {
+    to->seq = from.seq;
+    to->stamp = from.stamp;
+    if (to->frame_id != from.frame_id) to->frame_id = from.frame_id;
+  }
+
+  template <typename T>
+  static void resize(const size_t count, std::vector<T> *elements,
+                     std::vector<T> *spare) {
+    while (elements->size() > count) {
+      spare->push_back(std::move(elements->back()));
+      elements->pop_back();
+    }
+    while (elements->size() < count) {
+      if (spare->empty()) {
+        elements->emplace_back();
+        continue;
+      }
+      elements->push_back(std::move(spare->back()));
+      spare->pop_back();
+    }
+  }
+};
+
+}  // namespace lidar_obstacle_detector
@@ -0,0 +1,112 @@
+/* object_predictor.hpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Implementation of the high rate stream of the tracks predicted to now
+
+**/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lidar_obstacle_detector/box.hpp"
+#include "lidar_obstacle_detector/track_velocity.hpp"
+
+namespace lidar_obstacle_detector {
+
+// The tracks of the last scan, in a frame fixed to the world so that the
+// publisher can bring them to the current pose of the sensor. Only the
+// velocities relative to the ground should be valid.
+struct TrackSnapshot {
+  double stamp;          // s, of the scan
+  std::string frame_id;  // of the boxes
+  std::vector<Box> boxes;
+};
+
+// Publishes the tracks of the last snapshot, moved at their velocities to
+// the current time, at `rate` Hz from its own thread. The processing thread
+// only swaps in a new snapshot and the timer thread only copies the shared
+// pointer, so neither ever waits for the other. Snapshots older than
+// max_horizon seconds are not extrapolated any more (the lidar stopped), and
+// nothing is published while the snapshot is null.
+class ObjectPredictor {
+ public:
+  typedef std::function<double()> Clock;  // current time, s
+  typedef std::function<void(double stamp, const TrackSnapshot &snapshot,
+                             const std::vector<Box> &predicted)>
+      Publisher;
+
+  ObjectPredictor(const double rate, const double max_horizon,
+                  const Clock &clock, const Publisher &publisher)
+      : period_(std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(1.0 / rate))),
+        max_horizon_(max_horizon),
+        clock_(clock),
+        publisher_(publisher),
+        running_(true) {
+    thread_ = std::thread(&ObjectPredictor::run, this);
+  }
+
+  ~ObjectPredictor() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      running_ = false;
+    }
+    wake_.notify_all();
+    if (thread_.joinable()) thread_.join();
+  }
+
+  void update(const std::shared_ptr<const TrackSnapshot> &snapshot) {
+    std::atomic_store(&snapshot_, snapshot);
+  }
+
+ private:
+  const std::chrono::steady_clock::duration period_;
+  const double max_horizon_;
+  const Clock clock_;
+  const Publisher publisher_;
+  std::shared_ptr<const TrackSnapshot> snapshot_;
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool running_;
+  std::thread thread_;
+
+  void run();
+};
+
+inline void ObjectPredictor::run() {
+  using SteadyClock = std::chrono::steady_clock;
+  std::vector<Box> predicted;
+  auto next = SteadyClock::now();
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (running_) {
+    // Ticks on a fixed schedule, without a burst of ticks after a stall
+    next += period_;
+    wake_.wait_until(lock, next, [this] { return !running_; });
+    if (!running_) break;
+    next = std::max(next, SteadyClock::now() - period_);
+    lock.unlock();
+
+    const auto snapshot = std::atomic_load(&snapshot_);
+    const double now = clock_();
+    if (snapshot && now - snapshot->stamp <= max_horizon_) {
+      predicted = snapshot->boxes;
+      predictBoxes(std::max(now - snapshot->stamp, 0.0), &predicted);
+      publisher_(now, *snapshot, predicted);
+    }
+    lock.lock();
+  }
+}
+
+}  // namespace lidar_obstacle_detector
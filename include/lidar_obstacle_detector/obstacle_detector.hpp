@@ -11,7 +11,6 @@
 #include <pcl/common/common.h>
 #include <pcl/common/pca.h>
 #include <pcl/common/transforms.h>
-#include <pcl/filters/crop_box.h>
 #include <pcl/filters/extract_indices.h>
 #include <pcl/filters/voxel_grid.h>
 #include <pcl/kdtree/kdtree.h>
@@ -19,28 +18,79 @@
 #include <pcl/segmentation/sac_segmentation.h>
 
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
 #include <ctime>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <numeric>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
 #include <utility>
 #include <vector>
 
+#include "lidar_obstacle_detector/asset_reloader.hpp"
 #include "lidar_obstacle_detector/box.hpp"
+#include "lidar_obstacle_detector/huge_page_buffer.hpp"
+#include "lidar_obstacle_detector/jpda.hpp"
+#include "lidar_obstacle_detector/parallel.hpp"
+#include "lidar_obstacle_detector/range_image.hpp"
+#include "lidar_obstacle_detector/scan_line_run.hpp"
+#include "lidar_obstacle_detector/simd_kernels.hpp"
+#include "lidar_obstacle_detector/track_velocity.hpp"
+#include "lidar_obstacle_detector/voxel_summary.hpp"
 
 namespace lidar_obstacle_detector {
+
+// How the ground and the obstacles are found
+enum DetectionMode {
+  DETECTION_EUCLIDEAN = 0,      // voxel grid, RANSAC plane, euclidean clusters
+  DETECTION_RANGE_IMAGE = 1,    // one sweep over the range image
+  DETECTION_SCAN_LINE_RUN = 2,  // ground plane fitting, scan line runs
+  DETECTION_VOXEL_GRID = 3,     // ground and clusters from the voxel summary
+};
+
+inline int parseDetectionMode(const std::string &name) {
+  if (name == "range_image") return DETECTION_RANGE_IMAGE;
+  if (name == "scan_line_run") return DETECTION_SCAN_LINE_RUN;
+  if (name == "voxel_grid") return DETECTION_VOXEL_GRID;
+  if (name == "euclidean") return DETECTION_EUCLIDEAN;
+  return -1;
+}
+
 template <typename PointT>
 class ObstacleDetector {
  public:
   ObstacleDetector();
   virtual ~ObstacleDetector();
 
+  // Number of threads used by the parallel stages (1 by default)
+  void setNumThreads(const int num_threads);
+  int numThreads() const { return pool_ ? pool_->size() : 1; }
+
+  // In deterministic mode the clusters, and so the box ids, come out in a
+  // canonical order that does not depend on the threads or sectors used.
+  // Otherwise the order only depends on the input and the parameters.
+  void setDeterministic(const bool deterministic) {
+    deterministic_ = deterministic;
+  }
+
+  // Exclusion boxes and ROI mask of the next frames, see AssetReloader
+  void setAssets(const std::shared_ptr<const DetectionAssets> &assets) {
+    assets_ = assets;
+  }
+
   // ****************** Detection ***********************
 
+  // With a summary, the voxels are built by it instead of pcl::VoxelGrid and
+  // it is left with the voxels of the returned points, in the same order
   typename pcl::PointCloud<PointT>::Ptr filterCloud(
       const typename pcl::PointCloud<PointT>::ConstPtr &cloud,
       const float filter_res, const Eigen::Vector4f &min_pt,
-      const Eigen::Vector4f &max_pt);
+      const Eigen::Vector4f &max_pt, VoxelSummary<PointT> *summary = nullptr);
 
   std::pair<typename pcl::PointCloud<PointT>::Ptr,
             typename pcl::PointCloud<PointT>::Ptr>
@@ -57,13 +107,142 @@ class ObstacleDetector {
   Box pcaBoundingBox(const typename pcl::PointCloud<PointT>::Ptr &cluster,
                      const int id);
 
+  // Fit a box to every cluster in parallel, box i gets the i-th id after
+  // first_id (see advanceBoxId).
+  // pcaBoundingBox flattens the clusters unless preserve_clusters is set.
+  std::vector<Box> fitBoxes(
+      const std::vector<typename pcl::PointCloud<PointT>::Ptr> &clusters,
+      const bool use_pca_box, const int first_id,
+      const bool preserve_clusters = false);
+
+  // Filtering, ground segmentation and clustering of num_sectors angular
+  // sectors of the cloud, one sector per worker. Every sector also sees the
+  // points within `overlap` metres of its seams, so that the clusters cut by
+  // a seam can be stitched back; each point is kept by its own sector only.
+  // The ground and obstacle clouds are written to segmented_clouds.
+  std::vector<typename pcl::PointCloud<PointT>::Ptr> sectorDetection(
+      const typename pcl::PointCloud<PointT>::ConstPtr &cloud,
+      const float filter_res, const Eigen::Vector4f &min_pt,
+      const Eigen::Vector4f &max_pt, const int max_iterations,
+      const float distance_thresh, const float cluster_tolerance,
+      const int min_size, const int max_size, const int num_sectors,
+      const float overlap,
+      std::pair<typename pcl::PointCloud<PointT>::Ptr,
+                typename pcl::PointCloud<PointT>::Ptr> *segmented_clouds);
+
+  // Ground segmentation and clustering of the raw scan in one sweep over its
+  // range image, see RangeImageSegmenter. No voxel grid is applied, the
+  // image keeps one return per pixel. The ground and obstacle clouds are
+  // written to segmented_clouds.
+  std::vector<typename pcl::PointCloud<PointT>::Ptr> rangeImageDetection(
+      const typename pcl::PointCloud<PointT>::ConstPtr &cloud,
+      const Eigen::Vector4f &min_pt, const Eigen::Vector4f &max_pt,
+      const RangeImageParams &params, const float ground_thresh,
+      const float cluster_tolerance, const int min_size, const int max_size,
+      std::pair<typename pcl::PointCloud<PointT>::Ptr,
+                typename pcl::PointCloud<PointT>::Ptr> *segmented_clouds);
+
+  // Ground Plane Fitting over `segments` stretches of the ROI along x, and
+  // Scan Line Run clustering of the raw scan's rings, see ScanLineRun. The
+  // rings are found as in rangeImageDetection. The ground and obstacle
+  // clouds are written to segmented_clouds.
+  std::vector<typename pcl::PointCloud<PointT>::Ptr> scanLineRunDetection(
+      const typename pcl::PointCloud<PointT>::ConstPtr &cloud,
+      const Eigen::Vector4f &min_pt, const Eigen::Vector4f &max_pt,
+      const RangeImageParams &image, const ScanLineRunParams &params,
+      const float ground_thresh, const float cluster_tolerance,
+      const int min_size, const int max_size,
+      std::pair<typename pcl::PointCloud<PointT>::Ptr,
+                typename pcl::PointCloud<PointT>::Ptr> *segmented_clouds);
+
+  // Filtering, ground classification and grid clustering over the one
+  // voxel summary built by filterCloud. The ground is found per column of
+  // ground_cell metres, see VoxelSummary. The ground and obstacle clouds are
+  // written to segmented_clouds.
+  std::vector<typename pcl::PointCloud<PointT>::Ptr> voxelGridDetection(
+      const typename pcl::PointCloud<PointT>::ConstPtr &cloud,
+      const float filter_res, const Eigen::Vector4f &min_pt,
+      const Eigen::Vector4f &max_pt, const float ground_thresh,
+      const float ground_cell, const float cluster_tolerance,
+      const int min_size, const int max_size,
+      std::pair<typename pcl::PointCloud<PointT>::Ptr,
+                typename pcl::PointCloud<PointT>::Ptr> *segmented_clouds);
+
   // ****************** Tracking ***********************
   void obstacleTracking(const std::vector<Box> &prev_boxes,
                         std::vector<Box> *curr_boxes,
                         const float displacement_thresh,
                         const float iou_thresh);
 
+  // Probabilistic tracking for dense scenes (JPDA instead of Hungarian). The
+  // ids go to the most probable detections, and every track's filtered
+  // position (track_position, carried from prev_boxes) is updated with the
+  // probability weighted detections. The measured boxes are left as they are.
+  void obstacleTrackingJPDA(const std::vector<Box> &prev_boxes,
+                            std::vector<Box> *curr_boxes,
+                            const float displacement_thresh,
+                            const float iou_thresh, const JPDAParams &params);
+
+  // Velocity of every tracked box, box i being fitted to clusters[i], from a
+  // 2D ICP of its cluster against the track's points of the previous frame
+  // (dt seconds earlier), in parallel over the tracks. history is replaced
+  // by the points of the current tracks. With to_fixed, which moves the
+  // sensor frame to a frame fixed to the world, the clusters are matched
+  // in that frame and the velocities are relative to the ground (reliable).
+  // Without it they are relative to the moving sensor.
+  void estimateVelocities(
+      const std::vector<typename pcl::PointCloud<PointT>::Ptr> &clusters,
+      const double dt, const VelocityParams &params,
+      const Eigen::Affine3f *to_fixed, TrackPoints *history,
+      std::vector<Box> *boxes);
+
  private:
+  std::unique_ptr<WorkerPool> pool_;
+  bool deterministic_;
+  std::shared_ptr<const DetectionAssets> assets_;
+
+  // Reusable per-frame buffers
+  HugePageBuffer<char> roi_mask_;
+  HugePageBuffer<float> azimuth_;
+
+  // State of one sector of sectorDetection, which only its worker touches
+  struct Sector {
+    std::unique_ptr<ObstacleDetector<PointT>> detector;
+    std::vector<int> indices;  // of the input points it sees, ascending
+    typename pcl::PointCloud<PointT>::Ptr ground, obstacles;
+    std::vector<typename pcl::PointCloud<PointT>::Ptr> clusters;
+    std::vector<std::vector<int64_t>> seam_voxels;  // per cluster
+  };
+  std::vector<Sector> sectors_;
+
+  RangeImageSegmenter<PointT> range_image_;
+  ScanLineRun<PointT> scan_line_run_;
+  VoxelSummary<PointT> voxel_summary_;
+
+  // Runs fn(begin, end) over [0, n) on the worker pool, if any
+  template <typename Function>
+  void parallelFor(const int n, const Function &fn);
+
+  // keep[i] = 1 for the points inside the ROI and kept by the assets
+  // (outside the car roof), with the SIMD kernels over contiguous chunks
+  void regionMask(const pcl::PointCloud<PointT> &cloud,
+                  const Eigen::Vector4f &min_pt, const Eigen::Vector4f &max_pt,
+                  HugePageBuffer<char> *keep);
+
+  // Splits the cloud by the labels of a labeller (range image, scan line run
+  // or voxel summary): ground, obstacles, and the components within the size
+  // limits
+  template <typename Labeller>
+  std::vector<typename pcl::PointCloud<PointT>::Ptr> splitLabels(
+      const typename pcl::PointCloud<PointT>::ConstPtr &cloud,
+      const Labeller &labeller, const int min_size, const int max_size,
+      std::pair<typename pcl::PointCloud<PointT>::Ptr,
+                typename pcl::PointCloud<PointT>::Ptr> *segmented_clouds);
+
+  // Larger clusters first, then by centroid
+  void sortClusters(
+      std::vector<typename pcl::PointCloud<PointT>::Ptr> *clusters);
+
   // ****************** Detection ***********************
   std::pair<typename pcl::PointCloud<PointT>::Ptr,
             typename pcl::PointCloud<PointT>::Ptr>
@@ -100,52 +279,121 @@ class ObstacleDetector {
 
 // constructor:
 template <typename PointT>
-ObstacleDetector<PointT>::ObstacleDetector() {}
+ObstacleDetector<PointT>::ObstacleDetector()
+    : deterministic_(false),
+      assets_(defaultAssets()),
+      roi_mask_("filter_roi_mask"),
+      azimuth_("sector_azimuth") {}
 
 // de-constructor:
 template <typename PointT>
 ObstacleDetector<PointT>::~ObstacleDetector() {}
 
+template <typename PointT>
+void ObstacleDetector<PointT>::setNumThreads(const int num_threads) {
+  if (num_threads == numThreads()) return;
+  pool_.reset(num_threads > 1 ? new WorkerPool(num_threads) : nullptr);
+}
+
+template <typename PointT>
+template <typename Function>
+void ObstacleDetector<PointT>::parallelFor(const int n, const Function &fn) {
+  if (pool_)
+    pool_->parallelFor(n, fn);
+  else if (n > 0)
+    fn(0, n);
+}
+
+template <typename PointT>
+void ObstacleDetector<PointT>::sortClusters(
+    std::vector<typename pcl::PointCloud<PointT>::Ptr> *clusters) {
+  std::vector<std::pair<Eigen::Vector3f, int>> keys(clusters->size());
+  parallelFor(clusters->size(), [&](const int begin, const int end) {
+    for (int c = begin; c < end; ++c) {
+      Eigen::Vector3f sum = Eigen::Vector3f::Zero();
+      for (auto &p : (*clusters)[c]->points) sum += p.getVector3fMap();
+      keys[c] = {sum / (*clusters)[c]->size(), c};
+    }
+  });
+  std::stable_sort(keys.begin(), keys.end(),
+                   [clusters](const std::pair<Eigen::Vector3f, int> &a,
+                              const std::pair<Eigen::Vector3f, int> &b) {
+                     const size_t a_size = (*clusters)[a.second]->size();
+                     const size_t b_size = (*clusters)[b.second]->size();
+                     if (a_size != b_size) return a_size > b_size;
+                     return std::lexicographical_compare(
+                         a.first.data(), a.first.data() + 3, b.first.data(),
+                         b.first.data() + 3);
+                   });
+
+  std::vector<typename pcl::PointCloud<PointT>::Ptr> sorted;
+  sorted.reserve(keys.size());
+  for (auto &key : keys) sorted.push_back((*clusters)[key.second]);
+  clusters->swap(sorted);
+}
+
+template <typename PointT>
+void ObstacleDetector<PointT>::regionMask(const pcl::PointCloud<PointT> &cloud,
+                                          const Eigen::Vector4f &min_pt,
+                                          const Eigen::Vector4f &max_pt,
+                                          HugePageBuffer<char> *keep) {
+  static_assert(sizeof(PointT) % sizeof(float) == 0 &&
+                    sizeof(PointT) >= 4 * sizeof(float),
+                "the kernels read 4 floats per point");
+  const int stride = sizeof(PointT) / sizeof(float);
+  const float *points = reinterpret_cast<const float *>(cloud.points.data());
+  const SimdKernels &kernels = simdKernels();
+  keep->resize(cloud.size());
+  parallelFor(cloud.size(), [&](const int begin, const int end) {
+    const float *chunk = points + begin * stride;
+    char *chunk_keep = keep->data() + begin;
+    kernels.cropBox(chunk, end - begin, stride, min_pt.data(), max_pt.data(),
+                    chunk_keep);
+    for (auto &box : assets_->exclusion_boxes)
+      kernels.excludeBox(chunk, end - begin, stride, box.first.data(),
+                         box.second.data(), chunk_keep);
+    if (assets_->mask.empty()) return;
+    for (int i = begin; i < end; ++i) {
+      if ((*keep)[i]) (*keep)[i] = assets_->inMask(cloud.points[i]);
+    }
+  });
+}
+
 template <typename PointT>
 typename pcl::PointCloud<PointT>::Ptr ObstacleDetector<PointT>::filterCloud(
     const typename pcl::PointCloud<PointT>::ConstPtr &cloud,
     const float filter_res, const Eigen::Vector4f &min_pt,
-    const Eigen::Vector4f &max_pt) {
+    const Eigen::Vector4f &max_pt, VoxelSummary<PointT> *summary) {
   // Time segmentation process
   // const auto start_time = std::chrono::steady_clock::now();
 
   // Create the filtering object: downsample the dataset using a leaf size
-  pcl::VoxelGrid<PointT> vg;
   typename pcl::PointCloud<PointT>::Ptr cloud_filtered(
       new pcl::PointCloud<PointT>);
-  vg.setInputCloud(cloud);
-  vg.setLeafSize(filter_res, filter_res, filter_res);
-  vg.filter(*cloud_filtered);
+  if (summary) {
+    summary->build(*cloud, filter_res);
+    summary->centroids(*cloud, cloud_filtered.get());
+  } else {
+    pcl::VoxelGrid<PointT> vg;
+    vg.setInputCloud(cloud);
+    vg.setLeafSize(filter_res, filter_res, filter_res);
+    vg.filter(*cloud_filtered);
+  }
 
-  // Cropping the ROI
-  typename pcl::PointCloud<PointT>::Ptr cloud_roi(new pcl::PointCloud<PointT>);
-  pcl::CropBox<PointT> region(true);
-  region.setMin(min_pt);
-  region.setMax(max_pt);
-  region.setInputCloud(cloud_filtered);
-  region.filter(*cloud_roi);
-
-  // Removing the car roof region
-  std::vector<int> indices;
-  pcl::CropBox<PointT> roof(true);
-  roof.setMin(Eigen::Vector4f(-1.5, -1.7, -1, 1));
-  roof.setMax(Eigen::Vector4f(2.6, 1.7, -0.4, 1));
-  roof.setInputCloud(cloud_roi);
-  roof.filter(indices);
-
-  pcl::PointIndices::Ptr inliers(new pcl::PointIndices);
-  for (auto &point : indices) inliers->indices.push_back(point);
+  // Cropping the ROI and removing the excluded regions, in a single pass
+  // over contiguous chunks so that the point order is kept
+  HugePageBuffer<char> &keep = roi_mask_;
+  regionMask(*cloud_filtered, min_pt, max_pt, &keep);
 
-  pcl::ExtractIndices<PointT> extract;
-  extract.setInputCloud(cloud_roi);
-  extract.setIndices(inliers);
-  extract.setNegative(true);
-  extract.filter(*cloud_roi);
+  typename pcl::PointCloud<PointT>::Ptr cloud_roi(new pcl::PointCloud<PointT>);
+  cloud_roi->points.reserve(cloud_filtered->size());
+  for (size_t i = 0; i < cloud_filtered->size(); ++i) {
+    if (keep[i]) cloud_roi->points.push_back(cloud_filtered->points[i]);
+  }
+  cloud_roi->width = cloud_roi->points.size();
+  cloud_roi->height = 1;
+  cloud_roi->is_dense = cloud_filtered->is_dense;
+  if (summary) summary->compact(keep.data());
 
   // const auto end_time = std::chrono::steady_clock::now();
   // const auto elapsed_time =
@@ -193,8 +441,9 @@ ObstacleDetector<PointT>::segmentPlane(
   // Time segmentation process
   // const auto start_time = std::chrono::steady_clock::now();
 
-  // Find inliers for the cloud.
-  pcl::SACSegmentation<PointT> seg;
+  // Find inliers for the cloud. RANSAC samples from a fixed seed (random =
+  // false), the same cloud always gives the same plane.
+  pcl::SACSegmentation<PointT> seg(false);
   pcl::PointIndices::Ptr inliers{new pcl::PointIndices};
   pcl::ModelCoefficients::Ptr coefficients(new pcl::ModelCoefficients);
 
@@ -245,18 +494,23 @@ ObstacleDetector<PointT>::clustering(
   ec.setInputCloud(cloud);
   ec.extract(cluster_indices);
 
-  for (auto &getIndices : cluster_indices) {
-    typename pcl::PointCloud<PointT>::Ptr cluster(new pcl::PointCloud<PointT>);
+  clusters.resize(cluster_indices.size());
+  parallelFor(cluster_indices.size(), [&](const int begin, const int end) {
+    for (int c = begin; c < end; ++c) {
+      typename pcl::PointCloud<PointT>::Ptr cluster(
+          new pcl::PointCloud<PointT>);
+      cluster->points.reserve(cluster_indices[c].indices.size());
+      for (auto &index : cluster_indices[c].indices)
+        cluster->points.push_back(cloud->points[index]);
 
-    for (auto &index : getIndices.indices)
-      cluster->points.push_back(cloud->points[index]);
+      cluster->width = cluster->points.size();
+      cluster->height = 1;
+      cluster->is_dense = true;
 
-    cluster->width = cluster->points.size();
-    cluster->height = 1;
-    cluster->is_dense = true;
-
-    clusters.push_back(cluster);
-  }
+      clusters[c] = cluster;
+    }
+  });
+  if (deterministic_) sortClusters(&clusters);
 
   // const auto end_time = std::chrono::steady_clock::now();
   // const auto elapsed_time =
@@ -271,14 +525,13 @@ template <typename PointT>
 Box ObstacleDetector<PointT>::axisAlignedBoundingBox(
     const typename pcl::PointCloud<PointT>::ConstPtr &cluster, const int id) {
   // Find bounding box for one of the clusters
-  PointT min_pt, max_pt;
-  pcl::getMinMax3D(*cluster, min_pt, max_pt);
+  Eigen::Vector3f min_pt, max_pt;
+  simdKernels().minMax(reinterpret_cast<const float *>(cluster->points.data()),
+                       cluster->size(), sizeof(PointT) / sizeof(float),
+                       min_pt.data(), max_pt.data());
 
-  const Eigen::Vector3f position((max_pt.x + min_pt.x) / 2,
-                                 (max_pt.y + min_pt.y) / 2,
-                                 (max_pt.z + min_pt.z) / 2);
-  const Eigen::Vector3f dimension((max_pt.x - min_pt.x), (max_pt.y - min_pt.y),
-                                  (max_pt.z - min_pt.z));
+  const Eigen::Vector3f position = (max_pt + min_pt) / 2;
+  const Eigen::Vector3f dimension = max_pt - min_pt;
 
   return Box(id, position, dimension);
 }
@@ -286,10 +539,14 @@ Box ObstacleDetector<PointT>::axisAlignedBoundingBox(
 template <typename PointT>
 Box ObstacleDetector<PointT>::pcaBoundingBox(
     const typename pcl::PointCloud<PointT>::Ptr &cluster, const int id) {
+  const SimdKernels &kernels = simdKernels();
+  const float *points = reinterpret_cast<const float *>(cluster->points.data());
+  const int stride = sizeof(PointT) / sizeof(float);
+
   // Compute the bounding box height (to be used later for recreating the box)
-  PointT min_pt, max_pt;
-  pcl::getMinMax3D(*cluster, min_pt, max_pt);
-  const float box_height = max_pt.z - min_pt.z;
+  Eigen::Vector3f min_pt, max_pt;
+  kernels.minMax(points, cluster->size(), stride, min_pt.data(), max_pt.data());
+  const float box_height = max_pt(2) - min_pt(2);
   // const float box_z = (max_pt.z + min_pt.z) / 2;
 
   // Compute the cluster centroid
@@ -301,20 +558,19 @@ Box ObstacleDetector<PointT>::pcaBoundingBox(
     cluster->points[i].z = pca_centroid(2);
   }
 
-  // Compute principal directions & Transform the original cloud to PCA
-  // coordinates
-  pcl::PointCloud<pcl::PointXYZ>::Ptr pca_projected_cloud(
-      new pcl::PointCloud<pcl::PointXYZ>);
+  // Compute principal directions
   pcl::PCA<pcl::PointXYZ> pca;
   pca.setInputCloud(cluster);
-  pca.project(*cluster, *pca_projected_cloud);
-
-  const auto eigen_vectors = pca.getEigenVectors();
+  const Eigen::Matrix3f eigen_vectors = pca.getEigenVectors();
 
-  // Get the minimum and maximum points of the transformed cloud.
-  pcl::getMinMax3D(*pca_projected_cloud, min_pt, max_pt);
-  const Eigen::Vector3f meanDiagonal =
-      0.5f * (max_pt.getVector3fMap() + min_pt.getVector3fMap());
+  // Bounds of the cloud in PCA coordinates, projected on the fly as
+  // pca.project() would
+  Eigen::Matrix<float, 3, 4, Eigen::RowMajor> projection;
+  projection.leftCols<3>() = eigen_vectors.transpose();
+  projection.col(3) = -eigen_vectors.transpose() * pca.getMean().head<3>();
+  kernels.transformedMinMax(points, cluster->size(), stride, projection.data(),
+                            min_pt.data(), max_pt.data());
+  const Eigen::Vector3f meanDiagonal = 0.5f * (max_pt + min_pt);
 
   // Final transform
   const Eigen::Quaternionf quaternion(
@@ -322,12 +578,346 @@ Box ObstacleDetector<PointT>::pcaBoundingBox(
                        // https://www.youtube.com/watch?v=mHVwd8gYLnI
   const Eigen::Vector3f position =
       eigen_vectors * meanDiagonal + pca_centroid.head<3>();
-  const Eigen::Vector3f dimension((max_pt.x - min_pt.x), (max_pt.y - min_pt.y),
-                                  box_height);
+  const Eigen::Vector3f dimension((max_pt(0) - min_pt(0)),
+                                  (max_pt(1) - min_pt(1)), box_height);
 
   return Box(id, position, dimension, quaternion);
 }
 
+template <typename PointT>
+std::vector<Box> ObstacleDetector<PointT>::fitBoxes(
+    const std::vector<typename pcl::PointCloud<PointT>::Ptr> &clusters,
+    const bool use_pca_box, const int first_id, const bool preserve_clusters) {
+  std::vector<Box> boxes(clusters.size());
+  parallelFor(clusters.size(), [&](const int begin, const int end) {
+    for (int i = begin; i < end; ++i) {
+      const int id = advanceBoxId(first_id, i);
+      if (!use_pca_box) {
+        boxes[i] = axisAlignedBoundingBox(clusters[i], id);
+      } else if (preserve_clusters) {
+        typename pcl::PointCloud<PointT>::Ptr flattened(
+            new pcl::PointCloud<PointT>(*clusters[i]));
+        boxes[i] = pcaBoundingBox(flattened, id);
+      } else {
+        boxes[i] = pcaBoundingBox(clusters[i], id);
+      }
+    }
+  });
+
+  return boxes;
+}
+
+template <typename PointT>
+std::vector<typename pcl::PointCloud<PointT>::Ptr>
+ObstacleDetector<PointT>::sectorDetection(
+    const typename pcl::PointCloud<PointT>::ConstPtr &cloud,
+    const float filter_res, const Eigen::Vector4f &min_pt,
+    const Eigen::Vector4f &max_pt, const int max_iterations,
+    const float distance_thresh, const float cluster_tolerance,
+    const int min_size, const int max_size, const int num_sectors,
+    const float overlap,
+    std::pair<typename pcl::PointCloud<PointT>::Ptr,
+              typename pcl::PointCloud<PointT>::Ptr> *segmented_clouds) {
+  typedef typename pcl::PointCloud<PointT>::Ptr CloudPtr;
+  const int count = std::max(1, num_sectors);
+  const float width = 2 * M_PI / count;
+
+  // Angle from the start of sector k (its first seam), in [0, 2 pi)
+  const auto offset = [width](const float azimuth, const int k) {
+    float angle = std::fmod(azimuth + M_PI - k * width, 2 * M_PI);
+    return angle < 0 ? angle + static_cast<float>(2 * M_PI) : angle;
+  };
+  // Every point belongs to exactly one sector
+  const auto sector_of = [width, count](const float azimuth) {
+    return std::min(count - 1, static_cast<int>((azimuth + M_PI) / width));
+  };
+  // Distance to the seam at the start of sector k, on the sensor's side
+  const auto seam_distance = [&offset](const PointT &p, const float azimuth,
+                                       const int k) {
+    const float angle = offset(azimuth, k);
+    const float delta = std::min(angle, static_cast<float>(2 * M_PI) - angle);
+    if (delta >= M_PI / 2) return std::numeric_limits<float>::max();
+    return std::hypot(p.x, p.y) * std::sin(delta);
+  };
+  // Voxels of the filter grid, packed in 21 bits per axis. Both sectors of a
+  // seam downsample its overlap to the same points, one per voxel.
+  const float inverse_voxel = 1.0f / std::max(filter_res, 0.01f);
+  const auto voxel = [inverse_voxel](const PointT &p) {
+    const int64_t x = std::floor(p.x * inverse_voxel) + (1 << 20);
+    const int64_t y = std::floor(p.y * inverse_voxel) + (1 << 20);
+    const int64_t z = std::floor(p.z * inverse_voxel) + (1 << 20);
+    return (x << 42) | (y << 21) | z;
+  };
+
+  azimuth_.resize(cloud->size());
+  parallelFor(cloud->size(), [&](const int begin, const int end) {
+    for (int i = begin; i < end; ++i)
+      azimuth_[i] = std::atan2(cloud->points[i].y, cloud->points[i].x);
+  });
+
+  if (sectors_.size() != count) sectors_.resize(count);
+  for (auto &sector : sectors_) sector.indices.clear();
+
+  // Bucket the points in one pass: every point goes to its own sector, and
+  // to both sectors of every seam it is near. The seams within overlap of a
+  // point are at most asin(overlap / range) away from its azimuth.
+  for (int i = 0; i < cloud->size(); ++i) {
+    const PointT &p = cloud->points[i];
+    const float azimuth = azimuth_[i];
+    sectors_[sector_of(azimuth)].indices.push_back(i);
+    if (count == 1) continue;
+    const float range = std::hypot(p.x, p.y);
+    const float reach = overlap < range ? std::asin(overlap / range) : M_PI / 2;
+    const int lowest = std::floor((azimuth + M_PI - reach) / width);
+    const int highest = std::ceil((azimuth + M_PI + reach) / width);
+    for (int s = lowest; s <= highest && s - lowest < count; ++s) {
+      const int seam = (s % count + count) % count;
+      if (seam_distance(p, azimuth, seam) >= overlap) continue;
+      for (const int k : {seam, (seam + count - 1) % count}) {
+        std::vector<int> &indices = sectors_[k].indices;
+        if (indices.empty() || indices.back() != i) indices.push_back(i);
+      }
+    }
+  }
+
+  // The sectors only share the (read only) input cloud and their buckets
+  const auto detect = [&](const int k) {
+    Sector &sector = sectors_[k];
+    if (!sector.detector) sector.detector.reset(new ObstacleDetector<PointT>);
+    sector.detector->setAssets(assets_);
+    const int next = (k + 1) % count;
+    const auto near_seam = [&](const PointT &p, const float azimuth) {
+      return seam_distance(p, azimuth, k) < overlap ||
+             seam_distance(p, azimuth, next) < overlap;
+    };
+    const auto owned = [&](const PointT &p) {
+      return sector_of(std::atan2(p.y, p.x)) == k;
+    };
+
+    CloudPtr points(new pcl::PointCloud<PointT>);
+    points->points.reserve(sector.indices.size());
+    for (const int i : sector.indices)
+      points->points.push_back(cloud->points[i]);
+    points->width = points->points.size();
+    points->height = 1;
+    points->is_dense = cloud->is_dense;
+
+    sector.ground.reset(new pcl::PointCloud<PointT>);
+    sector.obstacles.reset(new pcl::PointCloud<PointT>);
+    sector.clusters.clear();
+    sector.seam_voxels.clear();
+    auto filtered =
+        sector.detector->filterCloud(points, filter_res, min_pt, max_pt);
+    if (filtered->empty()) return;
+    auto segmented = sector.detector->segmentPlane(filtered, max_iterations,
+                                                   distance_thresh);
+    // The size limits only apply to the stitched clusters: a fragment cut
+    // off by a seam can be small, and a sector can hold most of an object
+    auto clusters =
+        sector.detector->clustering(segmented.first, cluster_tolerance, 1,
+                                    std::numeric_limits<int>::max());
+
+    for (auto &p : segmented.second->points)
+      if (owned(p)) sector.ground->points.push_back(p);
+    for (auto &p : segmented.first->points)
+      if (owned(p)) sector.obstacles->points.push_back(p);
+    for (auto &cluster : clusters) {
+      CloudPtr core(new pcl::PointCloud<PointT>);
+      std::vector<int64_t> voxels;
+      for (auto &p : cluster->points) {
+        const float azimuth = std::atan2(p.y, p.x);
+        if (sector_of(azimuth) == k) core->points.push_back(p);
+        if (near_seam(p, azimuth)) voxels.push_back(voxel(p));
+      }
+      std::sort(voxels.begin(), voxels.end());
+      voxels.erase(std::unique(voxels.begin(), voxels.end()), voxels.end());
+      sector.clusters.push_back(core);
+      sector.seam_voxels.push_back(voxels);
+    }
+  };
+  // The threads claim the sectors as they go, which balances sectors of
+  // uneven density. The results are merged in the sector order regardless.
+  std::atomic<int> next_sector(0);
+  parallelFor(numThreads(), [&](const int, const int) {
+    for (int k = next_sector++; k < count; k = next_sector++) detect(k);
+  });
+
+  // Stitch the clusters of neighbouring sectors that share a voxel near their
+  // common seam
+  std::vector<int> first(count + 1, 0);
+  for (int k = 0; k < count; ++k)
+    first[k + 1] = first[k] + sectors_[k].clusters.size();
+  std::vector<int> parent(first[count]);
+  std::iota(parent.begin(), parent.end(), 0);
+  const auto find = [&parent](int i) {
+    while (parent[i] != i) i = parent[i] = parent[parent[i]];
+    return i;
+  };
+  for (int s = 0; count > 1 && s < count; ++s) {
+    const int prev = (s + count - 1) % count;
+    std::unordered_map<int64_t, std::vector<int>> occupied;
+    for (int c = 0; c < sectors_[s].clusters.size(); ++c)
+      for (auto key : sectors_[s].seam_voxels[c])
+        occupied[key].push_back(first[s] + c);
+    for (int c = 0; c < sectors_[prev].clusters.size(); ++c) {
+      for (auto key : sectors_[prev].seam_voxels[c]) {
+        const auto found = occupied.find(key);
+        if (found == occupied.end()) continue;
+        for (int other : found->second)
+          parent[find(first[prev] + c)] = find(other);
+      }
+    }
+  }
+
+  // Merge in the order of the first cluster of every group, so that the
+  // output order only depends on the input
+  std::vector<int> group(parent.size(), -1);
+  std::vector<CloudPtr> merged;
+  for (int k = 0; k < count; ++k) {
+    for (int c = 0; c < sectors_[k].clusters.size(); ++c) {
+      const int root = find(first[k] + c);
+      if (group[root] < 0) {
+        group[root] = merged.size();
+        merged.emplace_back(new pcl::PointCloud<PointT>);
+      }
+      auto &points = merged[group[root]]->points;
+      const auto &core = sectors_[k].clusters[c]->points;
+      points.insert(points.end(), core.begin(), core.end());
+    }
+  }
+  std::vector<CloudPtr> clusters;
+  for (auto &cluster : merged) {
+    if (cluster->size() < min_size || cluster->size() > max_size) continue;
+    cluster->width = cluster->points.size();
+    cluster->height = 1;
+    cluster->is_dense = true;
+    clusters.push_back(cluster);
+  }
+  if (deterministic_) sortClusters(&clusters);
+
+  CloudPtr ground(new pcl::PointCloud<PointT>);
+  CloudPtr obstacles(new pcl::PointCloud<PointT>);
+  for (int k = 0; k < count; ++k) {
+    const Sector &sector = sectors_[k];
+    ground->points.insert(ground->points.end(), sector.ground->points.begin(),
+                          sector.ground->points.end());
+    obstacles->points.insert(obstacles->points.end(),
+                             sector.obstacles->points.begin(),
+                             sector.obstacles->points.end());
+  }
+  for (auto &output : {ground, obstacles}) {
+    output->width = output->points.size();
+    output->height = 1;
+    output->is_dense = true;
+  }
+  *segmented_clouds = std::make_pair(obstacles, ground);
+
+  return clusters;
+}
+
+template <typename PointT>
+std::vector<typename pcl::PointCloud<PointT>::Ptr>
+ObstacleDetector<PointT>::rangeImageDetection(
+    const typename pcl::PointCloud<PointT>::ConstPtr &cloud,
+    const Eigen::Vector4f &min_pt, const Eigen::Vector4f &max_pt,
+    const RangeImageParams &params, const float ground_thresh,
+    const float cluster_tolerance, const int min_size, const int max_size,
+    std::pair<typename pcl::PointCloud<PointT>::Ptr,
+              typename pcl::PointCloud<PointT>::Ptr> *segmented_clouds) {
+  HugePageBuffer<char> &keep = roi_mask_;
+  regionMask(*cloud, min_pt, max_pt, &keep);
+  range_image_.segment(*cloud, keep.data(), params, ground_thresh,
+                       cluster_tolerance);
+
+  return splitLabels(cloud, range_image_, min_size, max_size,
+                     segmented_clouds);
+}
+
+template <typename PointT>
+std::vector<typename pcl::PointCloud<PointT>::Ptr>
+ObstacleDetector<PointT>::scanLineRunDetection(
+    const typename pcl::PointCloud<PointT>::ConstPtr &cloud,
+    const Eigen::Vector4f &min_pt, const Eigen::Vector4f &max_pt,
+    const RangeImageParams &image, const ScanLineRunParams &params,
+    const float ground_thresh, const float cluster_tolerance,
+    const int min_size, const int max_size,
+    std::pair<typename pcl::PointCloud<PointT>::Ptr,
+              typename pcl::PointCloud<PointT>::Ptr> *segmented_clouds) {
+  HugePageBuffer<char> &keep = roi_mask_;
+  regionMask(*cloud, min_pt, max_pt, &keep);
+  scan_line_run_.segment(*cloud, keep.data(), image, params, min_pt(0),
+                         max_pt(0), ground_thresh, cluster_tolerance);
+
+  return splitLabels(cloud, scan_line_run_, min_size, max_size,
+                     segmented_clouds);
+}
+
+template <typename PointT>
+std::vector<typename pcl::PointCloud<PointT>::Ptr>
+ObstacleDetector<PointT>::voxelGridDetection(
+    const typename pcl::PointCloud<PointT>::ConstPtr &cloud,
+    const float filter_res, const Eigen::Vector4f &min_pt,
+    const Eigen::Vector4f &max_pt, const float ground_thresh,
+    const float ground_cell, const float cluster_tolerance, const int min_size,
+    const int max_size,
+    std::pair<typename pcl::PointCloud<PointT>::Ptr,
+              typename pcl::PointCloud<PointT>::Ptr> *segmented_clouds) {
+  // Voxel i of the summary is point i of the filtered cloud
+  const auto filtered_cloud =
+      filterCloud(cloud, filter_res, min_pt, max_pt, &voxel_summary_);
+  voxel_summary_.classifyGround(ground_thresh, ground_cell);
+  voxel_summary_.cluster(cluster_tolerance);
+
+  return splitLabels(filtered_cloud, voxel_summary_, min_size, max_size,
+                     segmented_clouds);
+}
+
+template <typename PointT>
+template <typename Labeller>
+std::vector<typename pcl::PointCloud<PointT>::Ptr>
+ObstacleDetector<PointT>::splitLabels(
+    const typename pcl::PointCloud<PointT>::ConstPtr &cloud,
+    const Labeller &labeller, const int min_size, const int max_size,
+    std::pair<typename pcl::PointCloud<PointT>::Ptr,
+              typename pcl::PointCloud<PointT>::Ptr> *segmented_clouds) {
+  typedef typename pcl::PointCloud<PointT>::Ptr CloudPtr;
+
+  // The components come out in the labeller's order
+  CloudPtr ground(new pcl::PointCloud<PointT>);
+  CloudPtr obstacles(new pcl::PointCloud<PointT>);
+  std::vector<CloudPtr> components(labeller.numComponents());
+  for (auto &component : components)
+    component.reset(new pcl::PointCloud<PointT>);
+  for (size_t i = 0; i < cloud->size(); ++i) {
+    const int label = labeller.label(i);
+    if (label == Labeller::GROUND) {
+      ground->points.push_back(cloud->points[i]);
+    } else if (label >= 0) {
+      obstacles->points.push_back(cloud->points[i]);
+      components[label]->points.push_back(cloud->points[i]);
+    }
+  }
+
+  std::vector<CloudPtr> clusters;
+  for (auto &cluster : components) {
+    if (cluster->size() < min_size || cluster->size() > max_size) continue;
+    cluster->width = cluster->points.size();
+    cluster->height = 1;
+    cluster->is_dense = true;
+    clusters.push_back(cluster);
+  }
+  if (deterministic_) sortClusters(&clusters);
+
+  for (auto &output : {ground, obstacles}) {
+    output->width = output->points.size();
+    output->height = 1;
+    output->is_dense = cloud->is_dense;
+  }
+  *segmented_clouds = std::make_pair(obstacles, ground);
+
+  return clusters;
+}
+
 // ************************* Tracking ***************************
 template <typename PointT>
 void ObstacleDetector<PointT>::obstacleTracking(
@@ -373,6 +963,138 @@ void ObstacleDetector<PointT>::obstacleTracking(
   }
 }
 
+template <typename PointT>
+void ObstacleDetector<PointT>::obstacleTrackingJPDA(
+    const std::vector<Box> &prev_boxes, std::vector<Box> *curr_boxes,
+    const float displacement_thresh, const float iou_thresh,
+    const JPDAParams &params) {
+  // New tracks start at their measured position
+  for (auto &curr_box : *curr_boxes) {
+    curr_box.track_position = curr_box.position;
+    curr_box.track_filtered = true;
+  }
+  if (curr_boxes->empty() || prev_boxes.empty()) return;
+
+  // Where every track is expected, its filtered position if it has one
+  std::vector<Eigen::Vector3f> predictions;
+  for (auto &prev_box : prev_boxes)
+    predictions.push_back(prev_box.track_filtered ? prev_box.track_position
+                                                  : prev_box.position);
+
+  // Gate with the same similarity test as the Hungarian tracker, and score
+  // the gated pairs by their normalised displacement from the prediction
+  std::vector<std::vector<bool>> gate(
+      prev_boxes.size(), std::vector<bool>(curr_boxes->size(), false));
+  std::vector<std::vector<float>> likelihood(
+      prev_boxes.size(), std::vector<float>(curr_boxes->size(), 0.0f));
+  for (int i = 0; i < prev_boxes.size(); ++i) {
+    const Box &prev_box = prev_boxes[i];
+    for (int j = 0; j < curr_boxes->size(); ++j) {
+      const Box &curr_box = (*curr_boxes)[j];
+      if (!compareBoxes(curr_box, prev_box, displacement_thresh, iou_thresh))
+        continue;
+      const float min_dim = std::min(prev_box.dimension.maxCoeff(),
+                                     curr_box.dimension.maxCoeff());
+      const float ctr_dis =
+          (curr_box.position - predictions[i]).norm() / min_dim;
+      const float z = ctr_dis / params.gate_sigma;
+      gate[i][j] = true;
+      likelihood[i][j] = std::exp(-0.5f * z * z);
+    }
+  }
+
+  JPDA jpda(params);
+  const auto beta = jpda.associate(gate, likelihood);
+
+  // Hand every track id to its most probable detection, one to one
+  std::vector<std::pair<float, std::pair<int, int>>> ranked;
+  for (int i = 0; i < prev_boxes.size(); ++i) {
+    for (int j = 0; j < curr_boxes->size(); ++j) {
+      if (beta[i][j] > 0.0f) ranked.push_back({beta[i][j], {i, j}});
+    }
+  }
+  std::sort(ranked.begin(), ranked.end(),
+            [](const std::pair<float, std::pair<int, int>> &a,
+               const std::pair<float, std::pair<int, int>> &b) {
+              return a.first > b.first;
+            });
+
+  // The detection that continues a track carries the track's updated state
+  std::vector<Eigen::Vector3f> states;
+  for (int i = 0; i < prev_boxes.size(); ++i)
+    states.push_back(weightedUpdate(beta[i], *curr_boxes, predictions[i]));
+  std::vector<bool> prev_taken(prev_boxes.size(), false);
+  std::vector<bool> curr_taken(curr_boxes->size(), false);
+  int count = 0;
+  for (auto &entry : ranked) {
+    const int i = entry.second.first;
+    const int j = entry.second.second;
+    if (prev_taken[i] || curr_taken[j]) continue;
+    prev_taken[i] = curr_taken[j] = true;
+    count++;
+    (*curr_boxes)[j].id = prev_boxes[i].id;
+    (*curr_boxes)[j].track_position = states[i];
+  }
+
+  std::cout << "For: " << curr_boxes->size()
+            << " current frame bounding boxes, JPDA found: " << count
+            << " matches in previous frame (" << jpda.hypothesesEvaluated()
+            << " hypotheses, " << jpda.clustersTruncated()
+            << " clusters truncated)" << std::endl;
+}
+
+template <typename PointT>
+void ObstacleDetector<PointT>::estimateVelocities(
+    const std::vector<typename pcl::PointCloud<PointT>::Ptr> &clusters,
+    const double dt, const VelocityParams &params,
+    const Eigen::Affine3f *to_fixed, TrackPoints *history,
+    std::vector<Box> *boxes) {
+  const bool fixed = to_fixed != nullptr;
+  const Eigen::Affine3f transform =
+      fixed ? *to_fixed : Eigen::Affine3f::Identity();
+  // The points of another frame than the last ones cannot be matched
+  if (history->fixed != fixed) history->points.clear();
+
+  std::vector<std::vector<Eigen::Vector2f>> points(boxes->size());
+  parallelFor(boxes->size(), [&](const int begin, const int end) {
+    for (int i = begin; i < end; ++i) {
+      Box &box = (*boxes)[i];
+      points[i] = trackPoints(*clusters[i], params.max_points, transform);
+      box.velocity.setZero();
+      box.velocity_valid = false;
+      box.velocity_reliable = false;
+      const auto previous = history->points.find(box.id);
+      if (previous == history->points.end() || points[i].empty() || dt <= 0)
+        continue;
+
+      // From the centroid shift, refined by the ICP
+      const auto &target = previous->second;
+      Eigen::Vector2f source_mean = Eigen::Vector2f::Zero();
+      Eigen::Vector2f target_mean = Eigen::Vector2f::Zero();
+      for (auto &point : points[i]) source_mean += point;
+      for (auto &point : target) target_mean += point;
+      source_mean /= points[i].size();
+      target_mean /= target.size();
+      Eigen::Isometry2f motion = Eigen::Isometry2f::Identity();
+      motion.translation() = target_mean - source_mean;
+      if (!icp2D(points[i], target, params, &motion)) continue;
+
+      // The motion takes the current points back to the previous ones,
+      // and the velocity is given in the sensor frame
+      const Eigen::Vector2f shift = source_mean - motion * source_mean;
+      box.velocity.head<2>() = shift / dt;
+      box.velocity = transform.linear().transpose() * box.velocity;
+      box.velocity_valid = true;
+      box.velocity_reliable = fixed;
+    }
+  });
+
+  history->points.clear();
+  history->fixed = fixed;
+  for (int i = 0; i < boxes->size(); ++i)
+    history->points[(*boxes)[i].id].swap(points[i]);
+}
+
 template <typename PointT>
 bool ObstacleDetector<PointT>::compareBoxes(const Box &a, const Box &b,
                                             const float displacement_thresh,
@@ -509,4 +1231,8 @@ int ObstacleDetector<PointT>::searchBoxIndex(const std::vector<Box> &boxes,
   return -1;
 }
 
+// Compiled once in the library (src/obstacle_detector.cpp), so that every
+// executable runs the same, profile-optimised, code
+extern template class ObstacleDetector<pcl::PointXYZ>;
+
 }  // namespace lidar_obstacle_detector
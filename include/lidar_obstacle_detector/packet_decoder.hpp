@@ -0,0 +1,451 @@
+/* packet_decoder.hpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Implementation of the Velodyne and Ouster packet decoders
+
+**/
+
+#pragma once
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include <Eigen/Core>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace lidar_obstacle_detector {
+
+// A full revolution decoded from the packets
+struct PacketScan {
+  pcl::PointCloud<pcl::PointXYZ>::Ptr cloud;
+  double stamp;               // s, of the first packet of the scan
+  int dual_returns_dropped;  // second returns close to their first return
+};
+
+// Decodes the UDP payloads of a lidar straight into the point cloud of the
+// detector, without the PointCloud2 of a driver in between. The points are
+// in the ROS convention (x forward, y left, z up), in metres.
+class PacketDecoder {
+ public:
+  virtual ~PacketDecoder() {}
+
+  // Decodes one payload received at `stamp`. True if it completed a scan,
+  // which is then taken with takeScan(). Other payloads are ignored.
+  virtual bool decode(const uint8_t *data, size_t size, double stamp) = 0;
+
+  PacketScan takeScan() {
+    PacketScan scan = done_;
+    done_.cloud.reset();
+    return scan;
+  }
+
+  // Drops the second returns within epsilon (m) of the first return of the
+  // same firing. Can be set from any thread, <= 0 keeps every return.
+  void setDualReturnEpsilon(const float epsilon) { epsilon_ = epsilon; }
+
+ protected:
+  PacketScan current_ = {nullptr, 0.0, 0}, done_ = {nullptr, 0.0, 0};
+  std::atomic<float> epsilon_{0.0f};
+
+  // The scan the next points go to, started at `stamp` if there is none
+  pcl::PointCloud<pcl::PointXYZ> &scan(const double stamp) {
+    if (!current_.cloud) {
+      current_.cloud.reset(new pcl::PointCloud<pcl::PointXYZ>);
+      // Sized like the last scan, so that the points are never moved
+      if (done_.cloud) current_.cloud->points.reserve(done_.cloud->size());
+      current_.stamp = stamp;
+      current_.dual_returns_dropped = 0;
+    }
+    return *current_.cloud;
+  }
+
+  // False if the scan had no points
+  bool finishScan() {
+    if (!current_.cloud || current_.cloud->empty()) return false;
+    current_.cloud->width = current_.cloud->size();
+    current_.cloud->height = 1;
+    current_.cloud->is_dense = true;
+    done_ = current_;
+    current_.cloud.reset();
+    return true;
+  }
+
+  static uint16_t read16(const uint8_t *data) {
+    return data[0] | data[1] << 8;
+  }
+  static uint32_t read32(const uint8_t *data) {
+    return read16(data) | static_cast<uint32_t>(read16(data + 2)) << 16;
+  }
+};
+
+// The value of the first <tag>value</tag> of an XML text
+inline bool xmlValue(const std::string &text, const std::string &tag,
+                     double *value) {
+  const size_t begin = text.find("<" + tag + ">");
+  if (begin == std::string::npos) return false;
+  *value = std::strtod(text.c_str() + begin + tag.size() + 2, nullptr);
+  return true;
+}
+
+// The numbers of the value of "key" in a JSON text, a number or an array of
+// numbers (nested arrays are flattened). Empty if the key is missing.
+inline std::vector<double> jsonNumbers(const std::string &text,
+                                       const std::string &key) {
+  std::vector<double> numbers;
+  size_t i = text.find("\"" + key + "\"");
+  if (i == std::string::npos) return numbers;
+  i = text.find(':', i);
+  if (i == std::string::npos) return numbers;
+  int depth = 0;
+  for (++i; i < text.size(); ++i) {
+    const char c = text[i];
+    if (c == '[') {
+      depth++;
+    } else if (c == ']') {
+      if (--depth <= 0) break;
+    } else if (c == '-' || c == '.' || (c >= '0' && c <= '9')) {
+      char *end;
+      numbers.push_back(std::strtod(text.c_str() + i, &end));
+      i = end - text.c_str() - 1;
+      if (depth == 0) break;
+    } else if (depth == 0 && c != ' ' && c != '\n' && c != '\t' &&
+               c != '\r') {
+      break;
+    }
+  }
+  return numbers;
+}
+
+// The string value of "key" in a JSON text, empty if the key is missing
+inline std::string jsonString(const std::string &text, const std::string &key) {
+  size_t i = text.find("\"" + key + "\"");
+  if (i == std::string::npos) return "";
+  i = text.find('"', text.find(':', i));
+  if (i == std::string::npos) return "";
+  return text.substr(i + 1, text.find('"', i + 1) - i - 1);
+}
+
+inline bool readFile(const std::string &path, std::string *text,
+                     std::string *error) {
+  std::ifstream file(path);
+  if (!file) {
+    *error = "cannot open " + path;
+    return false;
+  }
+  std::stringstream stream;
+  stream << file.rdbuf();
+  *text = stream.str();
+  return true;
+}
+
+// Corrections of one laser, from the calibration of the sensor
+struct VelodyneLaser {
+  float sin_rot, cos_rot;    // of the azimuth correction
+  float sin_vert, cos_vert;  // of the elevation
+  float dist_correction;     // m
+  float vert_offset;         // m
+  float horiz_offset;        // m
+};
+
+// HDL-32E, HDL-64E, VLP-16 and VLP-32C data packets: 12 blocks of 32
+// firings, each block with its azimuth. The 16 laser sensors fire twice per
+// block, the second firing is at the azimuth halfway to the next block. The
+// HDL-64E sends the upper and lower lasers in alternate blocks. In dual
+// return mode the blocks come in pairs of the same firings (the returns of
+// the HDL-64E are not paired up, they are all kept).
+class VelodyneDecoder : public PacketDecoder {
+ public:
+  static const size_t PACKET_SIZE = 1206;
+
+  explicit VelodyneDecoder(const std::vector<VelodyneLaser> &lasers)
+      : lasers_(lasers), sin_(36000), cos_(36000) {
+    for (int a = 0; a < 36000; ++a) {
+      sin_[a] = std::sin(a * M_PI / 18000.0);
+      cos_[a] = std::cos(a * M_PI / 18000.0);
+    }
+  }
+
+  bool decode(const uint8_t *data, size_t size, double stamp) override;
+
+  // Metres per unit of the raw distances, from the product id of a packet:
+  // 4 mm on the VLP-32C, 2 mm on the others
+  static float distanceResolution(const uint8_t product_id) {
+    return product_id == 0x28 ? 0.004f : 0.002f;
+  }
+
+ private:
+  const std::vector<VelodyneLaser> lasers_;
+  std::vector<float> sin_, cos_;  // of the azimuths, in 0.01 degrees
+  int last_azimuth_ = -1;
+  int last_gap_ = 0;  // between the azimuths of two blocks
+};
+
+// Loads the corrections from a VeloView calibration XML (angles in degrees,
+// offsets in centimetres), ordered by the id_ of the lasers
+inline std::unique_ptr<PacketDecoder> loadVelodyneDecoder(
+    const std::string &path, std::string *error) {
+  std::string text;
+  if (!readFile(path, &text, error)) return nullptr;
+
+  std::vector<std::pair<int, VelodyneLaser>> lasers;
+  for (size_t begin = text.find("<px"); begin != std::string::npos;
+       begin = text.find("<px", begin + 1)) {
+    const std::string px =
+        text.substr(begin, text.find("</px>", begin) - begin);
+    double id = 0.0, rot = 0.0, vert = 0.0, dist = 0.0;
+    double vert_offset = 0.0, horiz_offset = 0.0;
+    if (!xmlValue(px, "id_", &id) || !xmlValue(px, "rotCorrection_", &rot) ||
+        !xmlValue(px, "vertCorrection_", &vert) ||
+        !xmlValue(px, "distCorrection_", &dist)) {
+      *error = path + ": laser without id_, rotCorrection_, "
+                      "vertCorrection_ or distCorrection_";
+      return nullptr;
+    }
+    xmlValue(px, "vertOffsetCorrection_", &vert_offset);
+    xmlValue(px, "horizOffsetCorrection_", &horiz_offset);
+
+    VelodyneLaser laser;
+    laser.sin_rot = std::sin(rot * M_PI / 180.0);
+    laser.cos_rot = std::cos(rot * M_PI / 180.0);
+    laser.sin_vert = std::sin(vert * M_PI / 180.0);
+    laser.cos_vert = std::cos(vert * M_PI / 180.0);
+    laser.dist_correction = dist / 100.0;
+    laser.vert_offset = vert_offset / 100.0;
+    laser.horiz_offset = horiz_offset / 100.0;
+    lasers.emplace_back(static_cast<int>(id), laser);
+  }
+  if (lasers.size() != 16 && lasers.size() != 32 && lasers.size() != 64) {
+    *error = path + ": " + std::to_string(lasers.size()) +
+             " lasers, expected 16, 32 or 64";
+    return nullptr;
+  }
+
+  std::sort(lasers.begin(), lasers.end(),
+            [](const std::pair<int, VelodyneLaser> &a,
+               const std::pair<int, VelodyneLaser> &b) {
+              return a.first < b.first;
+            });
+  std::vector<VelodyneLaser> ordered;
+  for (auto &laser : lasers) ordered.push_back(laser.second);
+  return std::unique_ptr<PacketDecoder>(new VelodyneDecoder(ordered));
+}
+
+inline bool VelodyneDecoder::decode(const uint8_t *data, size_t size,
+                                    double stamp) {
+  // The position packets go to another port, but may share a capture
+  if (size != PACKET_SIZE) return false;
+  const int num_lasers = lasers_.size();
+  const bool dual = data[1204] == 0x39 && num_lasers < 64;
+  const float resolution = distanceResolution(data[1205]);
+  const float epsilon = epsilon_;
+  bool completed = false;
+
+  for (int b = 0; b < 12; ++b) {
+    const uint8_t *block = data + b * 100;
+    const int azimuth = read16(block + 2);
+    if (azimuth >= 36000) continue;
+
+    // A new scan starts when the azimuth wraps around
+    if (azimuth < last_azimuth_) completed |= finishScan();
+    last_azimuth_ = azimuth;
+    pcl::PointCloud<pcl::PointXYZ> &cloud = scan(stamp);
+
+    for (int next = b + 1; next < 12; ++next) {
+      const int next_azimuth = read16(data + next * 100 + 2);
+      if (next_azimuth == azimuth || next_azimuth >= 36000) continue;
+      last_gap_ = (next_azimuth - azimuth + 36000) % 36000;
+      break;
+    }
+
+    const int first_laser = read16(block) == 0xDDFF ? 32 : 0;
+    const bool second_return = dual && b % 2 == 1;
+    for (int c = 0; c < 32; ++c) {
+      const uint8_t *firing = block + 4 + 3 * c;
+      const int raw = read16(firing);
+      if (raw == 0) continue;
+      if (second_return && epsilon > 0.0f) {
+        const int first_raw = read16(firing - 100);
+        if (first_raw != 0 &&
+            std::abs(raw - first_raw) * resolution < epsilon) {
+          current_.dual_returns_dropped++;
+          continue;
+        }
+      }
+
+      int laser_index = first_laser + c;
+      int firing_azimuth = azimuth;
+      if (num_lasers == 16) {
+        laser_index = c % 16;
+        if (c >= 16) firing_azimuth = (azimuth + last_gap_ / 2) % 36000;
+      }
+      if (laser_index >= num_lasers) continue;
+      const VelodyneLaser &laser = lasers_[laser_index];
+
+      // Azimuth of the firing minus the correction of the laser, clockwise
+      const float sin_a = sin_[firing_azimuth], cos_a = cos_[firing_azimuth];
+      const float sin_rot = sin_a * laser.cos_rot - cos_a * laser.sin_rot;
+      const float cos_rot = cos_a * laser.cos_rot + sin_a * laser.sin_rot;
+      const float distance = raw * resolution + laser.dist_correction;
+      if (distance <= 0.0f) continue;
+      const float xy =
+          distance * laser.cos_vert - laser.vert_offset * laser.sin_vert;
+
+      pcl::PointXYZ p;
+      p.x = xy * cos_rot + laser.horiz_offset * sin_rot;
+      p.y = -(xy * sin_rot - laser.horiz_offset * cos_rot);
+      p.z = distance * laser.sin_vert + laser.vert_offset * laser.cos_vert;
+      cloud.points.push_back(p);
+    }
+  }
+  return completed;
+}
+
+// Legacy lidar packets of the OS-0/1/2: columns of a measurement header, the
+// pixels of every beam (20 bit range in mm, then signal fields) and a status
+// word. A scan is complete when the frame id of the columns changes.
+class OusterDecoder : public PacketDecoder {
+ public:
+  // Angles in degrees, lidar_to_sensor row major with a translation in mm
+  OusterDecoder(const std::vector<double> &altitudes,
+                const std::vector<double> &azimuths, const int columns,
+                const int columns_per_packet, const double origin_offset,
+                const std::vector<double> &lidar_to_sensor);
+
+  bool decode(const uint8_t *data, size_t size, double stamp) override;
+
+ private:
+  const int beams_, columns_, columns_per_packet_;
+  const size_t column_size_;
+  const float origin_offset_;  // m, from the lidar origin to the beams
+  // Per column and beam, the direction and the origin of the beam, in the
+  // sensor frame: a point is origin + (range - origin_offset) * direction
+  std::vector<Eigen::Vector3f> directions_;
+  std::vector<Eigen::Vector3f> origins_;  // per column
+  int frame_id_ = -1;
+};
+
+inline OusterDecoder::OusterDecoder(const std::vector<double> &altitudes,
+                                    const std::vector<double> &azimuths,
+                                    const int columns,
+                                    const int columns_per_packet,
+                                    const double origin_offset,
+                                    const std::vector<double> &lidar_to_sensor)
+    : beams_(altitudes.size()),
+      columns_(columns),
+      columns_per_packet_(columns_per_packet),
+      column_size_(16 + 12 * altitudes.size() + 4),
+      origin_offset_(origin_offset / 1000.0),
+      directions_(columns * altitudes.size()),
+      origins_(columns) {
+  Eigen::Matrix3f rotation = Eigen::Matrix3f::Identity();
+  Eigen::Vector3f translation = Eigen::Vector3f::Zero();
+  if (lidar_to_sensor.size() == 16) {
+    for (int r = 0; r < 3; ++r) {
+      for (int c = 0; c < 3; ++c) rotation(r, c) = lidar_to_sensor[4 * r + c];
+      translation(r) = lidar_to_sensor[4 * r + 3] / 1000.0;
+    }
+  }
+  for (int m = 0; m < columns_; ++m) {
+    const double encoder = 2.0 * M_PI * (columns_ - m) / columns_;
+    origins_[m] = rotation * Eigen::Vector3f(origin_offset_ * std::cos(encoder),
+                                             origin_offset_ * std::sin(encoder),
+                                             0.0f) +
+                  translation;
+    for (int i = 0; i < beams_; ++i) {
+      const double azimuth = encoder - azimuths[i] * M_PI / 180.0;
+      const double altitude = altitudes[i] * M_PI / 180.0;
+      directions_[m * beams_ + i] =
+          rotation * Eigen::Vector3f(std::cos(azimuth) * std::cos(altitude),
+                                     std::sin(azimuth) * std::cos(altitude),
+                                     std::sin(altitude));
+    }
+  }
+}
+
+// Loads the beam intrinsics and the lidar mode from the metadata JSON of the
+// sensor (as saved by the Ouster tools and drivers)
+inline std::unique_ptr<PacketDecoder> loadOusterDecoder(
+    const std::string &path, std::string *error) {
+  std::string text;
+  if (!readFile(path, &text, error)) return nullptr;
+
+  const std::string profile = jsonString(text, "udp_profile_lidar");
+  if (!profile.empty() && profile != "LEGACY") {
+    *error = path + ": lidar packet profile " + profile +
+             ", only LEGACY is supported";
+    return nullptr;
+  }
+  const std::vector<double> altitudes =
+      jsonNumbers(text, "beam_altitude_angles");
+  const std::vector<double> azimuths = jsonNumbers(text, "beam_azimuth_angles");
+  const int columns = std::atoi(jsonString(text, "lidar_mode").c_str());
+  if (altitudes.empty() || altitudes.size() != azimuths.size() ||
+      columns <= 0) {
+    *error = path + ": missing beam_altitude_angles, beam_azimuth_angles or "
+                    "lidar_mode";
+    return nullptr;
+  }
+  const std::vector<double> columns_per_packet =
+      jsonNumbers(text, "columns_per_packet");
+  const std::vector<double> origin_offset =
+      jsonNumbers(text, "lidar_origin_to_beam_origin_mm");
+  return std::unique_ptr<PacketDecoder>(new OusterDecoder(
+      altitudes, azimuths, columns,
+      columns_per_packet.empty() ? 16 : columns_per_packet[0],
+      origin_offset.empty() ? 0.0 : origin_offset[0],
+      jsonNumbers(text, "lidar_to_sensor_transform")));
+}
+
+inline bool OusterDecoder::decode(const uint8_t *data, size_t size,
+                                  double stamp) {
+  // The IMU packets go to another port, but may share a capture
+  if (size != columns_per_packet_ * column_size_) return false;
+  bool completed = false;
+
+  for (int col = 0; col < columns_per_packet_; ++col) {
+    const uint8_t *column = data + col * column_size_;
+    const int measurement_id = read16(column + 8);
+    const int frame_id = read16(column + 10);
+    if (read32(column + column_size_ - 4) != 0xFFFFFFFF) continue;
+    if (measurement_id >= columns_) continue;
+
+    if (frame_id != frame_id_) completed |= finishScan();
+    frame_id_ = frame_id;
+    pcl::PointCloud<pcl::PointXYZ> &cloud = scan(stamp);
+
+    const uint8_t *pixel = column + 16;
+    const Eigen::Vector3f *directions = &directions_[measurement_id * beams_];
+    for (int i = 0; i < beams_; ++i, pixel += 12) {
+      const uint32_t range = read32(pixel) & 0xFFFFF;
+      if (range == 0) continue;
+      const Eigen::Vector3f p = origins_[measurement_id] +
+                                (range * 0.001f - origin_offset_) *
+                                    directions[i];
+      cloud.points.emplace_back(p(0), p(1), p(2));
+    }
+  }
+  return completed;
+}
+
+// "velodyne" or "ouster", with the calibration file of the sensor
+inline std::unique_ptr<PacketDecoder> loadPacketDecoder(
+    const std::string &model, const std::string &calibration_file,
+    std::string *error) {
+  if (model == "velodyne") return loadVelodyneDecoder(calibration_file, error);
+  if (model == "ouster") return loadOusterDecoder(calibration_file, error);
+  *error = "unknown sensor model " + model + ", expected velodyne or ouster";
+  return nullptr;
+}
+
+}  // namespace lidar_obstacle_detector
@@ -0,0 +1,354 @@
+/* packet_source.hpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Implementation of the pcap and UDP inputs of the raw lidar packets
+
+**/
+
+#pragma once
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lidar_obstacle_detector/packet_decoder.hpp"
+
+namespace lidar_obstacle_detector {
+
+// A stream of the UDP payloads sent to one port
+class PacketSource {
+ public:
+  virtual ~PacketSource() {}
+
+  // The next payload and the time it was captured (s). False at the end of
+  // the stream, or when nothing came within timeout_ms.
+  virtual bool next(std::vector<uint8_t> *payload, double *stamp,
+                    int timeout_ms) = 0;
+
+  // A capture, which ends and is replayed at the pace it was recorded at
+  virtual bool recorded() const = 0;
+};
+
+// The UDP payloads to `port` (0 for any port) of a capture in the classic
+// pcap format, over Ethernet, Linux cooked or raw IPv4 links. Fragmented
+// datagrams (the Ouster packets are larger than an Ethernet frame) are
+// reassembled.
+class PcapReader : public PacketSource {
+ public:
+  PcapReader(const std::string &path, const uint16_t port)
+      : file_(path, std::ios::binary), port_(port) {}
+
+  bool open(std::string *error);
+  bool next(std::vector<uint8_t> *payload, double *stamp,
+            int timeout_ms) override;
+  bool recorded() const override { return true; }
+
+ private:
+  // Fragments of one datagram, by offset
+  struct Datagram {
+    std::vector<uint8_t> data;
+    size_t received = 0;
+    size_t size = 0;  // 0 until the last fragment came
+  };
+
+  std::ifstream file_;
+  const uint16_t port_;
+  bool swapped_ = false;
+  double fraction_unit_ = 1e-6;  // of the timestamps, us or ns
+  uint32_t link_type_ = 0;
+  std::vector<uint8_t> frame_;
+  std::map<uint16_t, Datagram> datagrams_;  // by IP id
+
+  uint32_t read32(const uint8_t *data) const {
+    uint32_t value;
+    std::memcpy(&value, data, 4);
+    return swapped_ ? __builtin_bswap32(value) : value;
+  }
+  static uint16_t readBig16(const uint8_t *data) {
+    return data[0] << 8 | data[1];
+  }
+
+  bool udpPayload(std::vector<uint8_t> *payload);
+};
+
+inline bool PcapReader::open(std::string *error) {
+  uint8_t header[24];
+  if (!file_) {
+    *error = "cannot open";
+    return false;
+  }
+  if (!file_.read(reinterpret_cast<char *>(header), sizeof(header))) {
+    *error = "cannot read a pcap header";
+    return false;
+  }
+  uint32_t magic;
+  std::memcpy(&magic, header, 4);
+  swapped_ = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+  magic = read32(header);
+  if (magic != 0xa1b2c3d4 && magic != 0xa1b23c4d) {
+    *error = "not a pcap file (pcapng captures must be converted first)";
+    return false;
+  }
+  fraction_unit_ = magic == 0xa1b23c4d ? 1e-9 : 1e-6;
+  link_type_ = read32(header + 20);
+  if (link_type_ != 1 && link_type_ != 101 && link_type_ != 113) {
+    *error = "unsupported pcap link type " + std::to_string(link_type_);
+    return false;
+  }
+  return true;
+}
+
+inline bool PcapReader::next(std::vector<uint8_t> *payload, double *stamp,
+                             int /*timeout_ms*/) {
+  uint8_t header[16];
+  while (file_.read(reinterpret_cast<char *>(header), sizeof(header))) {
+    frame_.resize(read32(header + 8));
+    if (!file_.read(reinterpret_cast<char *>(frame_.data()), frame_.size()))
+      return false;
+    if (!udpPayload(payload)) continue;
+    *stamp = read32(header) + read32(header + 4) * fraction_unit_;
+    return true;
+  }
+  return false;
+}
+
+// False if the frame is not (the last fragment of) a datagram to the port
+inline bool PcapReader::udpPayload(std::vector<uint8_t> *payload) {
+  size_t offset = 0;
+  uint16_t ether_type = 0x0800;
+  if (link_type_ == 1) {
+    offset = 14;
+    ether_type = frame_.size() >= 14 ? readBig16(&frame_[12]) : 0;
+    while (ether_type == 0x8100 && frame_.size() >= offset + 4) {
+      ether_type = readBig16(&frame_[offset + 2]);  // VLAN tag
+      offset += 4;
+    }
+  } else if (link_type_ == 113) {
+    offset = 16;
+    ether_type = frame_.size() >= 16 ? readBig16(&frame_[14]) : 0;
+  }
+  if (ether_type != 0x0800 || frame_.size() < offset + 20) return false;
+
+  // IPv4, UDP only
+  const uint8_t *ip = &frame_[offset];
+  const size_t ip_header = (ip[0] & 0x0F) * 4;
+  const size_t ip_size = std::min<size_t>(readBig16(ip + 2),
+                                          frame_.size() - offset);
+  if (ip[0] >> 4 != 4 || ip[9] != 17 || ip_size < ip_header) return false;
+  const uint8_t *data = ip + ip_header;
+  size_t size = ip_size - ip_header;
+
+  const uint16_t flags = readBig16(ip + 6);
+  const bool more_fragments = flags & 0x2000;
+  const size_t fragment_offset = (flags & 0x1FFF) * 8;
+  if (more_fragments || fragment_offset > 0) {
+    Datagram &datagram = datagrams_[readBig16(ip + 4)];
+    if (datagram.data.size() < fragment_offset + size)
+      datagram.data.resize(fragment_offset + size);
+    std::memcpy(&datagram.data[fragment_offset], data, size);
+    datagram.received += size;
+    if (!more_fragments) datagram.size = fragment_offset + size;
+    if (datagram.size == 0 || datagram.received < datagram.size) {
+      // A datagram that lost a fragment is dropped with the next ones
+      if (datagrams_.size() > 64) datagrams_.erase(datagrams_.begin());
+      return false;
+    }
+    frame_.swap(datagram.data);
+    datagrams_.erase(readBig16(ip + 4));
+    data = frame_.data();
+    size = frame_.size();
+  }
+
+  if (size < 8) return false;
+  if (port_ != 0 && readBig16(data + 2) != port_) return false;
+  const size_t udp_size = std::min<size_t>(readBig16(data + 4), size);
+  if (udp_size < 8) return false;
+  payload->assign(data + 8, data + udp_size);
+  return true;
+}
+
+// The datagrams received on a UDP port of this host, stamped with the wall
+// clock on receipt
+class UdpReceiver : public PacketSource {
+ public:
+  explicit UdpReceiver(const uint16_t port) : port_(port) {}
+  ~UdpReceiver() {
+    if (socket_ >= 0) close(socket_);
+  }
+
+  bool open(std::string *error);
+  bool next(std::vector<uint8_t> *payload, double *stamp,
+            int timeout_ms) override;
+  bool recorded() const override { return false; }
+
+ private:
+  const uint16_t port_;
+  int socket_ = -1;
+};
+
+inline bool UdpReceiver::open(std::string *error) {
+  socket_ = socket(AF_INET, SOCK_DGRAM, 0);
+  const int reuse = 1;
+  // Room for a few scans, the default buffer overflows as soon as the
+  // thread is not scheduled for a few milliseconds
+  const int buffer_size = 16 << 20;
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(port_);
+  if (socket_ < 0 ||
+      setsockopt(socket_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) <
+          0 ||
+      bind(socket_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) <
+          0) {
+    *error = "cannot listen on UDP port " + std::to_string(port_) + ": " +
+             std::strerror(errno);
+    return false;
+  }
+  setsockopt(socket_, SOL_SOCKET, SO_RCVBUF, &buffer_size,
+             sizeof(buffer_size));
+  return true;
+}
+
+inline bool UdpReceiver::next(std::vector<uint8_t> *payload, double *stamp,
+                              const int timeout_ms) {
+  pollfd fd = {socket_, POLLIN, 0};
+  if (poll(&fd, 1, timeout_ms) <= 0) return false;
+  payload->resize(65536);
+  const ssize_t size = recv(socket_, payload->data(), payload->size(), 0);
+  if (size < 0) return false;
+  payload->resize(size);
+  *stamp = std::chrono::duration<double>(
+               std::chrono::system_clock::now().time_since_epoch())
+               .count();
+  return true;
+}
+
+// "udp" listens on the port, anything else is a pcap file of which only the
+// datagrams to the port are read. Null, with the error, if it cannot open.
+inline std::unique_ptr<PacketSource> openPacketSource(
+    const std::string &source, const uint16_t port, std::string *error) {
+  if (source == "udp") {
+    std::unique_ptr<UdpReceiver> receiver(new UdpReceiver(port));
+    if (!receiver->open(error)) return nullptr;
+    return std::move(receiver);
+  }
+  std::unique_ptr<PcapReader> reader(new PcapReader(source, port));
+  if (!reader->open(error)) {
+    *error = source + ": " + *error;
+    return nullptr;
+  }
+  return std::move(reader);
+}
+
+// Reads and decodes the packets on its own thread, and hands every full
+// scan to `handler` from that thread. A capture is replayed at replay_rate
+// times the speed it was recorded at (as fast as possible if 0), and the
+// scans are stamped with the wall clock time of their replay, as they would
+// have been live. The thread stops at the end of a capture.
+class PacketInput {
+ public:
+  typedef std::function<void(const PacketScan &scan)> ScanHandler;
+
+  PacketInput(std::unique_ptr<PacketSource> source,
+              std::unique_ptr<PacketDecoder> decoder, const double replay_rate,
+              const ScanHandler &handler)
+      : source_(std::move(source)),
+        decoder_(std::move(decoder)),
+        replay_rate_(replay_rate),
+        handler_(handler),
+        running_(true) {
+    thread_ = std::thread(&PacketInput::run, this);
+  }
+
+  ~PacketInput() {
+    running_ = false;
+    if (thread_.joinable()) thread_.join();
+  }
+
+  void setDualReturnEpsilon(const float epsilon) {
+    decoder_->setDualReturnEpsilon(epsilon);
+  }
+
+ private:
+  const std::unique_ptr<PacketSource> source_;
+  const std::unique_ptr<PacketDecoder> decoder_;
+  const double replay_rate_;
+  const ScanHandler handler_;
+  std::atomic<bool> running_;
+  std::thread thread_;
+
+  void run();
+};
+
+inline void PacketInput::run() {
+  using SystemClock = std::chrono::system_clock;
+  std::vector<uint8_t> payload;
+  double stamp, first_stamp = -1.0;
+  SystemClock::time_point start;
+  while (running_) {
+    // The timeout only bounds the wait for the destructor
+    if (!source_->next(&payload, &stamp, 100)) {
+      if (source_->recorded()) break;
+      continue;
+    }
+    const auto now = SystemClock::now();
+    if (first_stamp < 0.0) {
+      first_stamp = stamp;
+      start = now;
+    }
+    if (source_->recorded()) {
+      if (replay_rate_ > 0.0) {
+        std::this_thread::sleep_until(
+            start + std::chrono::duration_cast<SystemClock::duration>(
+                        std::chrono::duration<double>((stamp - first_stamp) /
+                                                      replay_rate_)));
+      }
+      stamp = std::chrono::duration<double>(
+                  SystemClock::now().time_since_epoch())
+                  .count();
+    }
+    if (decoder_->decode(payload.data(), payload.size(), stamp))
+      handler_(decoder_->takeScan());
+  }
+}
+
+// Every scan of a capture, for the offline tools
+inline std::vector<pcl::PointCloud<pcl::PointXYZ>::ConstPtr> loadPcapScans(
+    const std::string &path, const uint16_t port, PacketDecoder *decoder,
+    std::string *error) {
+  std::vector<pcl::PointCloud<pcl::PointXYZ>::ConstPtr> scans;
+  PcapReader reader(path, port);
+  if (!reader.open(error)) {
+    *error = path + ": " + *error;
+    return scans;
+  }
+  std::vector<uint8_t> payload;
+  double stamp;
+  while (reader.next(&payload, &stamp, 0)) {
+    if (decoder->decode(payload.data(), payload.size(), stamp))
+      scans.push_back(decoder->takeScan().cloud);
+  }
+  return scans;
+}
+
+}  // namespace lidar_obstacle_detector
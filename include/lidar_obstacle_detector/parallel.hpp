@@ -0,0 +1,107 @@
+/* parallel.hpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Implementation of the persistent worker pool used by the parallel stages
+
+**/
+
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace lidar_obstacle_detector {
+
+class WorkerPool {
+ public:
+  // num_threads counts the calling thread, which always takes a share
+  explicit WorkerPool(const int num_threads);
+  virtual ~WorkerPool();
+
+  int size() const { return threads_.size() + 1; }
+
+  // Splits [0, n) into size() contiguous chunks, calls fn(begin, end) for
+  // every chunk in parallel and waits for all of them. The split only
+  // depends on n and size(), so the results written per index are the same
+  // whatever the thread timing.
+  template <typename Function>
+  void parallelFor(const int n, const Function &fn);
+
+ private:
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable start_cv_;
+  std::condition_variable done_cv_;
+  std::function<void(int)> task_;
+  unsigned int generation_ = 0;
+  int pending_ = 0;
+  bool stop_ = false;
+
+  void work(const int worker);
+};
+
+inline WorkerPool::WorkerPool(const int num_threads) {
+  for (int i = 1; i < num_threads; ++i)
+    threads_.emplace_back(&WorkerPool::work, this, i);
+}
+
+inline WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  start_cv_.notify_all();
+  for (auto &thread : threads_) thread.join();
+}
+
+inline void WorkerPool::work(const int worker) {
+  unsigned int seen = 0;
+  while (true) {
+    std::function<void(int)> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      start_cv_.wait(lock, [&] { return stop_ || generation_ != seen; });
+      if (stop_) return;
+      seen = generation_;
+      task = task_;
+    }
+    task(worker);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--pending_ == 0) done_cv_.notify_one();
+    }
+  }
+}
+
+template <typename Function>
+void WorkerPool::parallelFor(const int n, const Function &fn) {
+  const int chunks = size();
+  const auto chunk = [&fn, n, chunks](const int i) {
+    const int begin = static_cast<long>(n) * i / chunks;
+    const int end = static_cast<long>(n) * (i + 1) / chunks;
+    if (begin < end) fn(begin, end);
+  };
+
+  if (threads_.empty() || n < 2) {
+    if (n > 0) fn(0, n);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    task_ = chunk;
+    pending_ = threads_.size();
+    generation_++;
+  }
+  start_cv_.notify_all();
+  chunk(0);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, [this] { return pending_ == 0; });
+}
+
+}  // namespace lidar_obstacle_detector
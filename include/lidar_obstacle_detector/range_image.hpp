@@ -0,0 +1,229 @@
+/* range_image.hpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Implementation of the fused range image ground segmentation & clustering
+
+**/
+
+#pragma once
+
+#include <pcl/point_cloud.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "lidar_obstacle_detector/huge_page_buffer.hpp"
+
+namespace lidar_obstacle_detector {
+
+struct RangeImageParams {
+  int rings = 64;
+  int columns = 1800;
+  float min_elevation = -25.0f;  // degrees, of the lowest ring
+  float max_elevation = 3.0f;    // degrees, of the highest ring
+  float sensor_height = 1.8f;    // above the ground
+  float ground_angle = 10.0f;    // degrees, steepest slope between ground
+  int neighbours = 2;            // pixels searched in each direction
+};
+
+// Ring and column of the points in a range image, from their elevation and
+// azimuth
+class RangeImageProjection {
+ public:
+  explicit RangeImageProjection(const RangeImageParams &params)
+      : rings_(std::max(params.rings, 2)),
+        columns_(std::max(params.columns, 8)),
+        min_elevation_(params.min_elevation * M_PI / 180.0f),
+        ring_step_((params.max_elevation - params.min_elevation) * M_PI /
+                   180.0f / (rings_ - 1)),
+        column_step_(2 * M_PI / columns_) {}
+
+  int rings() const { return rings_; }
+  int columns() const { return columns_; }
+
+  // False for the points above or below the rings
+  template <typename PointT>
+  bool project(const PointT &p, int *ring, int *column) const {
+    *ring = std::lround((std::atan2(p.z, std::hypot(p.x, p.y)) -
+                         min_elevation_) /
+                        ring_step_);
+    *column = azimuthColumn(p.x, p.y);
+    return *ring >= 0 && *ring < rings_;
+  }
+
+  // Column of the azimuth of (x, y)
+  int azimuthColumn(const float x, const float y) const {
+    return static_cast<int>((std::atan2(y, x) + M_PI) / column_step_) %
+           columns_;
+  }
+
+ private:
+  int rings_, columns_;
+  float min_elevation_, ring_step_, column_step_;
+};
+
+// Projects the points of a scan to a ring x column image, then labels the
+// ground and grows the obstacle components in one column major sweep. A
+// pixel's upper rows and previous columns are already labelled when it is
+// visited, so its non-ground neighbours there are joined with a union-find.
+template <typename PointT>
+class RangeImageSegmenter {
+ public:
+  enum { DROPPED = -2, GROUND = -1 };
+
+  RangeImageSegmenter()
+      : image_("range_image"),
+        range_("range_image_range"),
+        parent_("range_image_parent"),
+        point_pixel_("range_image_point_pixel") {}
+
+  // Points with keep[i] == 0 are left out. Afterwards label(i) is DROPPED,
+  // GROUND or the index of the point's component, numbered in sweep order.
+  void segment(const pcl::PointCloud<PointT> &cloud, const char *keep,
+               const RangeImageParams &params, const float ground_thresh,
+               const float cluster_tolerance);
+
+  int label(const int i) const { return labels_[i]; }
+  int numComponents() const { return num_components_; }
+
+ private:
+  HugePageBuffer<int> image_;   // point index of the nearest return, or -1
+  HugePageBuffer<float> range_;
+  HugePageBuffer<int> parent_;  // union-find, GROUND or -3 for empty pixels
+  HugePageBuffer<int> point_pixel_;
+  std::vector<int> labels_;
+  int num_components_ = 0;
+
+  int find(int pixel) {
+    while (parent_[pixel] != pixel)
+      pixel = parent_[pixel] = parent_[parent_[pixel]];
+    return pixel;
+  }
+};
+
+template <typename PointT>
+void RangeImageSegmenter<PointT>::segment(const pcl::PointCloud<PointT> &cloud,
+                                          const char *keep,
+                                          const RangeImageParams &params,
+                                          const float ground_thresh,
+                                          const float cluster_tolerance) {
+  const int EMPTY = -3;
+  const float TOLERANCE = 0.03f;  // of the slope test, for the range noise
+  const RangeImageProjection projection(params);
+  const int rings = projection.rings();
+  const int columns = projection.columns();
+  const int pixels = rings * columns;
+  const float max_slope = std::tan(params.ground_angle * M_PI / 180.0f);
+  const float tolerance2 = cluster_tolerance * cluster_tolerance;
+
+  // Projection, keeping the nearest return of every pixel. Pixels are
+  // stored column major, a column's rings are contiguous.
+  image_.assign(pixels, -1);
+  range_.resize(pixels);
+  point_pixel_.resize(cloud.size());
+  for (int i = 0; i < cloud.size(); ++i) {
+    point_pixel_[i] = -1;
+    if (!keep[i]) continue;
+    const PointT &p = cloud.points[i];
+    int ring, column;
+    if (!projection.project(p, &ring, &column)) continue;
+    const int pixel = column * rings + ring;
+    point_pixel_[i] = pixel;
+    const float range = p.x * p.x + p.y * p.y + p.z * p.z;
+    if (image_[pixel] < 0 || range < range_[pixel]) {
+      image_[pixel] = i;
+      range_[pixel] = range;
+    }
+  }
+
+  const auto close = [&](const int a, const int b) {
+    const PointT &p = cloud.points[image_[a]];
+    const PointT &q = cloud.points[image_[b]];
+    const float dx = p.x - q.x, dy = p.y - q.y, dz = p.z - q.z;
+    return dx * dx + dy * dy + dz * dz <= tolerance2;
+  };
+  const auto join = [&](const int a, const int b) {
+    if (parent_[b] < 0 || !close(a, b)) return;
+    const int root_a = find(a), root_b = find(b);
+    if (root_a != root_b) parent_[std::max(root_a, root_b)] =
+        std::min(root_a, root_b);
+  };
+
+  // The sweep: ground by the slope from the last ground return below in the
+  // same column, obstacles joined to their visited neighbours
+  const int span = std::max(params.neighbours, 1);
+  parent_.resize(pixels);
+  for (int column = 0; column < columns; ++column) {
+    int last_ground = -1;
+    for (int ring = 0; ring < rings; ++ring) {
+      const int pixel = column * rings + ring;
+      if (image_[pixel] < 0) {
+        parent_[pixel] = EMPTY;
+        continue;
+      }
+
+      const PointT &p = cloud.points[image_[pixel]];
+      bool ground;
+      if (last_ground < 0) {
+        ground = std::abs(p.z + params.sensor_height) < ground_thresh;
+      } else {
+        const PointT &q = cloud.points[image_[last_ground]];
+        const float rise = std::abs(p.z - q.z);
+        const float run = std::hypot(p.x, p.y) - std::hypot(q.x, q.y);
+        ground = rise <= max_slope * std::max(run, 0.0f) + TOLERANCE;
+      }
+      if (ground) {
+        parent_[pixel] = GROUND;
+        last_ground = pixel;
+        continue;
+      }
+
+      parent_[pixel] = pixel;
+      for (int r = std::max(ring - span, 0); r < ring; ++r)
+        join(pixel, column * rings + r);
+      for (int c = std::max(column - span, 0); c < column; ++c)
+        for (int r = std::max(ring - span, 0);
+             r <= std::min(ring + span, rings - 1); ++r)
+          join(pixel, c * rings + r);
+    }
+  }
+
+  // Close the seam between the last and the first columns
+  for (int column = 0; column < std::min(span, columns); ++column) {
+    for (int ring = 0; ring < rings; ++ring) {
+      const int pixel = column * rings + ring;
+      if (parent_[pixel] < 0) continue;
+      for (int c = columns - span + column; c < columns; ++c)
+        for (int r = std::max(ring - span, 0);
+             r <= std::min(ring + span, rings - 1); ++r)
+          join(pixel, c * rings + r);
+    }
+  }
+
+  // Components numbered in sweep order, then every point takes the label of
+  // its pixel (also the returns hidden behind the nearest one)
+  std::vector<int> component(pixels, -1);
+  num_components_ = 0;
+  for (int pixel = 0; pixel < pixels; ++pixel) {
+    if (parent_[pixel] < 0) continue;
+    const int root = find(pixel);
+    if (component[root] < 0) component[root] = num_components_++;
+    component[pixel] = component[root];
+  }
+  labels_.resize(cloud.size());
+  for (int i = 0; i < cloud.size(); ++i) {
+    const int pixel = point_pixel_[i];
+    if (pixel < 0)
+      labels_[i] = DROPPED;
+    else if (parent_[pixel] == GROUND)
+      labels_[i] = GROUND;
+    else if (parent_[pixel] == EMPTY)
+      labels_[i] = DROPPED;
+    else
+      labels_[i] = component[pixel];
+  }
+}
+
+}  // namespace lidar_obstacle_detector
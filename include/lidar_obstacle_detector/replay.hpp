@@ -0,0 +1,295 @@
+/* replay.hpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Offline replay of recorded frames through the detection & tracking pipeline
+
+**/
+
+#pragma once
+
+#include <dirent.h>
+#include <pcl/io/pcd_io.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "lidar_obstacle_detector/obstacle_detector.hpp"
+
+namespace lidar_obstacle_detector {
+
+// The pipeline parameters, defaults as in cfg/obstacle_detector.cfg
+struct PipelineParams {
+  int num_threads = 1;
+  int num_sectors = 1;  // more than one runs sectorDetection
+  float sector_overlap = 1.0f;
+  bool deterministic = false;
+  int detection_mode = DETECTION_EUCLIDEAN;
+  RangeImageParams range_image;
+  ScanLineRunParams scan_line_run;
+  float ground_cell_size = 1.0f;
+  float dual_return_epsilon = 0.0f;  // of the nodes' input conversion
+  bool use_pca_box = false;
+  bool use_tracking = true;
+  float voxel_grid_size = 0.2f;
+  Eigen::Vector4f roi_min = Eigen::Vector4f(-30, -30, -2.5, 1);
+  Eigen::Vector4f roi_max = Eigen::Vector4f(70, 30, 1, 1);
+  float ground_thresh = 0.3f;
+  int ransac_iterations = 30;
+  float cluster_thresh = 0.6f;
+  int cluster_min_size = 10;
+  int cluster_max_size = 5000;
+  float displacement_thresh = 1.0f;
+  float iou_thresh = 1.0f;
+};
+
+// Wall time of every stage of one frame, in milliseconds
+struct StageTimings {
+  double filter = 0.0;
+  double segment = 0.0;
+  double cluster = 0.0;
+  double boxes = 0.0;
+  double tracking = 0.0;
+  double total = 0.0;
+};
+
+// Runs the same stages as lidarPointsCallback, without ROS
+template <typename PointT>
+class ReplayPipeline {
+ public:
+  explicit ReplayPipeline(const PipelineParams &params)
+      : params_(params), obstacle_id_(0) {
+    obstacle_detector_.setNumThreads(params_.num_threads);
+    obstacle_detector_.setDeterministic(params_.deterministic);
+  }
+
+  std::vector<Box> process(
+      const typename pcl::PointCloud<PointT>::ConstPtr &cloud,
+      StageTimings *timings);
+
+ private:
+  PipelineParams params_;
+  int obstacle_id_;
+  std::vector<Box> prev_boxes_;
+  ObstacleDetector<PointT> obstacle_detector_;
+};
+
+template <typename PointT>
+std::vector<Box> ReplayPipeline<PointT>::process(
+    const typename pcl::PointCloud<PointT>::ConstPtr &cloud,
+    StageTimings *timings) {
+  using Clock = std::chrono::steady_clock;
+  const auto elapsed = [](const Clock::time_point &from,
+                          const Clock::time_point &to) {
+    return std::chrono::duration<double, std::milli>(to - from).count();
+  };
+
+  const auto start_time = Clock::now();
+  auto filter_time = start_time;
+  auto segment_time = start_time;
+  std::vector<typename pcl::PointCloud<PointT>::Ptr> cloud_clusters;
+  if (params_.detection_mode == DETECTION_RANGE_IMAGE) {
+    // The single pass modes are timed as clustering
+    std::pair<typename pcl::PointCloud<PointT>::Ptr,
+              typename pcl::PointCloud<PointT>::Ptr>
+        segmented_clouds;
+    cloud_clusters = obstacle_detector_.rangeImageDetection(
+        cloud, params_.roi_min, params_.roi_max, params_.range_image,
+        params_.ground_thresh, params_.cluster_thresh,
+        params_.cluster_min_size, params_.cluster_max_size,
+        &segmented_clouds);
+  } else if (params_.detection_mode == DETECTION_SCAN_LINE_RUN) {
+    std::pair<typename pcl::PointCloud<PointT>::Ptr,
+              typename pcl::PointCloud<PointT>::Ptr>
+        segmented_clouds;
+    cloud_clusters = obstacle_detector_.scanLineRunDetection(
+        cloud, params_.roi_min, params_.roi_max, params_.range_image,
+        params_.scan_line_run, params_.ground_thresh, params_.cluster_thresh,
+        params_.cluster_min_size, params_.cluster_max_size,
+        &segmented_clouds);
+  } else if (params_.detection_mode == DETECTION_VOXEL_GRID) {
+    std::pair<typename pcl::PointCloud<PointT>::Ptr,
+              typename pcl::PointCloud<PointT>::Ptr>
+        segmented_clouds;
+    cloud_clusters = obstacle_detector_.voxelGridDetection(
+        cloud, params_.voxel_grid_size, params_.roi_min, params_.roi_max,
+        params_.ground_thresh, params_.ground_cell_size,
+        params_.cluster_thresh, params_.cluster_min_size,
+        params_.cluster_max_size, &segmented_clouds);
+  } else if (params_.num_sectors > 1) {
+    // The sector stages run interleaved, they are all timed as clustering
+    std::pair<typename pcl::PointCloud<PointT>::Ptr,
+              typename pcl::PointCloud<PointT>::Ptr>
+        segmented_clouds;
+    cloud_clusters = obstacle_detector_.sectorDetection(
+        cloud, params_.voxel_grid_size, params_.roi_min, params_.roi_max,
+        params_.ransac_iterations, params_.ground_thresh,
+        params_.cluster_thresh, params_.cluster_min_size,
+        params_.cluster_max_size, params_.num_sectors, params_.sector_overlap,
+        &segmented_clouds);
+  } else {
+    auto filtered_cloud = obstacle_detector_.filterCloud(
+        cloud, params_.voxel_grid_size, params_.roi_min, params_.roi_max);
+    filter_time = Clock::now();
+
+    auto segmented_clouds = obstacle_detector_.segmentPlane(
+        filtered_cloud, params_.ransac_iterations, params_.ground_thresh);
+    segment_time = Clock::now();
+
+    cloud_clusters = obstacle_detector_.clustering(
+        segmented_clouds.first, params_.cluster_thresh,
+        params_.cluster_min_size, params_.cluster_max_size);
+  }
+  const auto cluster_time = Clock::now();
+
+  auto curr_boxes = obstacle_detector_.fitBoxes(
+      cloud_clusters, params_.use_pca_box, obstacle_id_);
+  obstacle_id_ = advanceBoxId(obstacle_id_, cloud_clusters.size());
+  const auto boxes_time = Clock::now();
+
+  if (params_.use_tracking)
+    obstacle_detector_.obstacleTracking(prev_boxes_, &curr_boxes,
+                                        params_.displacement_thresh,
+                                        params_.iou_thresh);
+  prev_boxes_ = curr_boxes;
+  const auto end_time = Clock::now();
+
+  if (timings) {
+    timings->filter = elapsed(start_time, filter_time);
+    timings->segment = elapsed(filter_time, segment_time);
+    timings->cluster = elapsed(segment_time, cluster_time);
+    timings->boxes = elapsed(cluster_time, boxes_time);
+    timings->tracking = elapsed(boxes_time, end_time);
+    timings->total = elapsed(start_time, end_time);
+  }
+
+  return curr_boxes;
+}
+
+// Load all the .pcd files of a directory, in file name order
+template <typename PointT>
+std::vector<typename pcl::PointCloud<PointT>::ConstPtr> loadPCDFrames(
+    const std::string &directory) {
+  std::vector<std::string> files;
+  if (DIR *dir = opendir(directory.c_str())) {
+    while (const dirent *entry = readdir(dir)) {
+      const std::string name = entry->d_name;
+      if (name.size() > 4 && name.compare(name.size() - 4, 4, ".pcd") == 0)
+        files.push_back(directory + "/" + name);
+    }
+    closedir(dir);
+  }
+  std::sort(files.begin(), files.end());
+
+  std::vector<typename pcl::PointCloud<PointT>::ConstPtr> frames;
+  for (auto &file : files) {
+    typename pcl::PointCloud<PointT>::Ptr cloud(new pcl::PointCloud<PointT>);
+    if (pcl::io::loadPCDFile<PointT>(file, *cloud) == -1) {
+      std::cerr << "Could not read " << file << std::endl;
+      continue;
+    }
+    frames.push_back(cloud);
+  }
+
+  return frames;
+}
+
+// A synthetic scan of roughly num_points points from a 64 ring lidar
+// mounted at 1.8 m, with a flat ground and num_objects box shaped obstacles.
+// The same seed always gives the same scan.
+template <typename PointT>
+typename pcl::PointCloud<PointT>::Ptr syntheticScan(const int num_points,
+                                                    const int num_objects = 40,
+                                                    const unsigned seed = 0) {
+  const int rings = 64;
+  const float sensor_height = 1.8f;
+  const float min_elevation = -25.0f * M_PI / 180.0f;
+  const float max_elevation = 3.0f * M_PI / 180.0f;
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+  std::normal_distribution<float> noise(0.0f, 0.02f);
+
+  // Obstacles: centre, half extents and height, on the ground
+  std::vector<Eigen::Vector4f> objects;
+  for (int i = 0; i < num_objects; ++i) {
+    const float range = 5.0f + 45.0f * uniform(rng);
+    const float angle = 2.0f * M_PI * uniform(rng);
+    const bool car = uniform(rng) < 0.5f;
+    objects.emplace_back(range * std::cos(angle), range * std::sin(angle),
+                         car ? 2.2f : 0.3f, car ? 1.5f : 1.8f);
+  }
+
+  // About 7 in 8 beams hit something, the others go to the sky
+  const int columns = std::max(1, num_points * 8 / 7 / rings);
+  typename pcl::PointCloud<PointT>::Ptr cloud(new pcl::PointCloud<PointT>);
+  cloud->points.reserve(rings * columns);
+  for (int c = 0; c < columns; ++c) {
+    const float azimuth = 2.0f * M_PI * c / columns;
+    const Eigen::Vector2f direction(std::cos(azimuth), std::sin(azimuth));
+    for (int r = 0; r < rings; ++r) {
+      const float elevation =
+          min_elevation + (max_elevation - min_elevation) * r / (rings - 1);
+      const float slope = std::tan(elevation);
+
+      // Nearest hit between the ground and the (square) obstacles
+      float range = elevation < 0 ? sensor_height / -slope : 120.0f;
+      for (auto &object : objects) {
+        const Eigen::Vector2f center = object.head<2>();
+        const float along = center.dot(direction);
+        if (along <= 0) continue;
+        const float across =
+            std::abs(center(0) * direction(1) - center(1) * direction(0));
+        if (across > object(2)) continue;
+        const float hit = along - object(2);
+        const float z = sensor_height + hit * slope;
+        if (hit > 0 && hit < range && z >= 0 && z <= object(3)) range = hit;
+      }
+      if (range >= 120.0f) continue;
+
+      range += noise(rng);
+      PointT point;
+      point.x = range * direction(0);
+      point.y = range * direction(1);
+      point.z = range * slope;
+      cloud->points.push_back(point);
+    }
+  }
+  cloud->width = cloud->points.size();
+  cloud->height = 1;
+  cloud->is_dense = true;
+
+  return cloud;
+}
+
+// Reference objects of a replay, one "frame,id,x,y,z" line per object
+struct ReferenceObject {
+  int frame;
+  int id;
+  Eigen::Vector3f position;
+};
+
+inline std::vector<ReferenceObject> loadReferenceObjects(
+    const std::string &file) {
+  std::vector<ReferenceObject> objects;
+  std::ifstream in(file);
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty() || line[0] == '#') continue;
+    std::replace(line.begin(), line.end(), ',', ' ');
+    std::istringstream fields(line);
+    ReferenceObject object;
+    if (fields >> object.frame >> object.id >> object.position(0) >>
+        object.position(1) >> object.position(2))
+      objects.push_back(object);
+  }
+
+  return objects;
+}
+
+}  // namespace lidar_obstacle_detector
@@ -0,0 +1,265 @@
+/* scan_line_run.hpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Implementation of the Ground Plane Fitting & Scan Line Run clustering
+
+**/
+
+#pragma once
+
+#include <pcl/point_cloud.h>
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "lidar_obstacle_detector/huge_page_buffer.hpp"
+#include "lidar_obstacle_detector/range_image.hpp"
+#include "lidar_obstacle_detector/simd_kernels.hpp"
+
+namespace lidar_obstacle_detector {
+
+struct ScanLineRunParams {
+  int segments = 3;            // of the ground plane fit, along x
+  int iterations = 3;          // plane refinements per segment
+  int seed_count = 20;         // lowest points averaged into the LPR
+  float seed_thresh = 0.4f;    // seeds are at most this above the LPR
+  float merge_thresh = 1.0f;   // between runs of neighbouring rings
+};
+
+// Zermas et al., "Fast segmentation of 3D point clouds: a paradigm on LiDAR
+// data for autonomous vehicle applications" (ICRA 2017). The ground is a
+// plane per longitudinal segment, fitted from the points near the segment's
+// lowest point representative (LPR). The remaining points of every ring are
+// split into runs of close consecutive points, and a run joins the labels
+// of the runs of the ring below it that it is close to.
+template <typename PointT>
+class ScanLineRun {
+ public:
+  enum { DROPPED = -2, GROUND = -1 };
+
+  ScanLineRun()
+      : image_("scan_line_image"),
+        run_("scan_line_run"),
+        point_pixel_("scan_line_point_pixel"),
+        segment_points_("scan_line_segment_points"),
+        distances_("scan_line_distances") {}
+
+  // Points with keep[i] == 0 are left out, the segments split [min_x, max_x].
+  // Afterwards label(i) is DROPPED, GROUND or the point's component.
+  void segment(const pcl::PointCloud<PointT> &cloud, const char *keep,
+               const RangeImageParams &image, const ScanLineRunParams &params,
+               const float min_x, const float max_x,
+               const float ground_thresh, const float run_thresh);
+
+  int label(const int i) const { return labels_[i]; }
+  int numComponents() const { return num_components_; }
+
+ private:
+  HugePageBuffer<int> image_;  // row (ring) major, nearest return or -1
+  HugePageBuffer<int> run_;    // run of every image pixel, or -1
+  HugePageBuffer<int> point_pixel_;
+  HugePageBuffer<float> segment_points_;  // {x, y, z, 1} of indices_
+  HugePageBuffer<float> distances_;       // to the plane, of indices_
+  std::vector<int> labels_;
+  std::vector<int> parent_;    // union-find of the runs
+  std::vector<int> indices_;
+  int num_components_ = 0;
+
+  int find(int run) {
+    while (parent_[run] != run) run = parent_[run] = parent_[parent_[run]];
+    return run;
+  }
+
+  void fitGround(const pcl::PointCloud<PointT> &cloud,
+                 const ScanLineRunParams &params, const float ground_thresh);
+};
+
+// GPF of the points in indices_, the ground points are labelled GROUND
+template <typename PointT>
+void ScanLineRun<PointT>::fitGround(const pcl::PointCloud<PointT> &cloud,
+                                    const ScanLineRunParams &params,
+                                    const float ground_thresh) {
+  if (indices_.size() < 3) return;
+
+  // LPR from the lowest points
+  const int count =
+      std::min<int>(std::max(params.seed_count, 1), indices_.size());
+  std::nth_element(indices_.begin(), indices_.begin() + count - 1,
+                   indices_.end(), [&cloud](const int a, const int b) {
+                     return cloud.points[a].z < cloud.points[b].z;
+                   });
+  float lpr = 0.0f;
+  for (int i = 0; i < count; ++i) lpr += cloud.points[indices_[i]].z;
+  lpr /= count;
+
+  std::vector<char> ground(indices_.size(), 0);
+  for (int i = 0; i < indices_.size(); ++i)
+    ground[i] = cloud.points[indices_[i]].z < lpr + params.seed_thresh;
+
+  // The segment's points packed once for the distance kernel
+  segment_points_.resize(4 * indices_.size());
+  distances_.resize(indices_.size());
+  for (int i = 0; i < indices_.size(); ++i) {
+    const PointT &p = cloud.points[indices_[i]];
+    float *packed = &segment_points_[4 * i];
+    packed[0] = p.x, packed[1] = p.y, packed[2] = p.z, packed[3] = 1.0f;
+  }
+
+  // Plane of the current ground points, the normal being the direction of
+  // least variance, then the points near it are the new ground
+  for (int iteration = 0; iteration < params.iterations; ++iteration) {
+    Eigen::Vector3f mean = Eigen::Vector3f::Zero();
+    int n = 0;
+    for (int i = 0; i < indices_.size(); ++i) {
+      if (!ground[i]) continue;
+      mean += cloud.points[indices_[i]].getVector3fMap();
+      n++;
+    }
+    if (n < 3) return;
+    mean /= n;
+    Eigen::Matrix3f covariance = Eigen::Matrix3f::Zero();
+    for (int i = 0; i < indices_.size(); ++i) {
+      if (!ground[i]) continue;
+      const Eigen::Vector3f offset =
+          cloud.points[indices_[i]].getVector3fMap() - mean;
+      covariance += offset * offset.transpose();
+    }
+    const Eigen::SelfAdjointEigenSolver<Eigen::Matrix3f> solver(covariance);
+    const Eigen::Vector3f normal = solver.eigenvectors().col(0);
+    const float plane[4] = {normal(0), normal(1), normal(2),
+                            -normal.dot(mean)};
+    simdKernels().planeDistances(segment_points_.data(), indices_.size(), 4,
+                                 plane, distances_.data());
+    for (int i = 0; i < indices_.size(); ++i)
+      ground[i] = distances_[i] < ground_thresh;
+  }
+  for (int i = 0; i < indices_.size(); ++i)
+    if (ground[i]) labels_[indices_[i]] = GROUND;
+}
+
+template <typename PointT>
+void ScanLineRun<PointT>::segment(const pcl::PointCloud<PointT> &cloud,
+                                  const char *keep,
+                                  const RangeImageParams &image,
+                                  const ScanLineRunParams &params,
+                                  const float min_x, const float max_x,
+                                  const float ground_thresh,
+                                  const float run_thresh) {
+  const RangeImageProjection projection(image);
+  const int rings = projection.rings();
+  const int columns = projection.columns();
+  const int span = std::max(image.neighbours, 1);
+
+  // Ring order: the nearest return of every pixel, rows being rings
+  image_.assign(rings * columns, -1);
+  point_pixel_.resize(cloud.size());
+  labels_.assign(cloud.size(), DROPPED);
+  for (int i = 0; i < cloud.size(); ++i) {
+    point_pixel_[i] = -1;
+    if (!keep[i]) continue;
+    const PointT &p = cloud.points[i];
+    int ring, column;
+    if (!projection.project(p, &ring, &column)) continue;
+    const int pixel = ring * columns + column;
+    point_pixel_[i] = pixel;
+    labels_[i] = 0;
+    const int nearest = image_[pixel];
+    if (nearest < 0 || p.getVector3fMap().squaredNorm() <
+                           cloud.points[nearest].getVector3fMap().squaredNorm())
+      image_[pixel] = i;
+  }
+
+  // GPF, one plane per segment along x
+  const int segments = std::max(params.segments, 1);
+  const float length = std::max(max_x - min_x, 1e-3f) / segments;
+  std::vector<std::vector<int>> segment_indices(segments);
+  for (int i = 0; i < cloud.size(); ++i) {
+    if (labels_[i] == DROPPED) continue;
+    const int s = (cloud.points[i].x - min_x) / length;
+    segment_indices[std::min(std::max(s, 0), segments - 1)].push_back(i);
+  }
+  for (auto &indices : segment_indices) {
+    indices_.swap(indices);
+    fitGround(cloud, params, ground_thresh);
+  }
+
+  // SLR: runs of close consecutive non-ground returns along every ring
+  const float run2 = run_thresh * run_thresh;
+  const float merge2 = params.merge_thresh * params.merge_thresh;
+  const auto distance2 = [&cloud](const int a, const int b) {
+    return (cloud.points[a].getVector3fMap() -
+            cloud.points[b].getVector3fMap())
+        .squaredNorm();
+  };
+  const auto obstacle = [this](const int point) {
+    return point >= 0 && labels_[point] != GROUND;
+  };
+  run_.assign(rings * columns, -1);
+  parent_.clear();
+  for (int ring = 0; ring < rings; ++ring) {
+    const int *row = &image_[ring * columns];
+    int *row_run = &run_[ring * columns];
+    int previous = -1;  // column of the last return of the ring
+    for (int column = 0; column < columns; ++column) {
+      const int point = row[column];
+      if (point < 0) continue;
+      if (obstacle(point)) {
+        if (previous >= 0 && obstacle(row[previous]) &&
+            distance2(point, row[previous]) < run2) {
+          row_run[column] = row_run[previous];
+        } else {
+          row_run[column] = parent_.size();
+          parent_.push_back(parent_.size());
+        }
+      }
+      previous = column;
+    }
+    // The ring closes on itself
+    int first = 0;
+    while (first < columns && row[first] < 0) ++first;
+    if (previous > first && obstacle(row[first]) && obstacle(row[previous]) &&
+        distance2(row[first], row[previous]) < run2) {
+      const int a = find(row_run[first]), b = find(row_run[previous]);
+      parent_[std::max(a, b)] = std::min(a, b);
+    }
+
+    // Merge with the runs of the ring below, through its nearby columns
+    if (ring == 0) continue;
+    const int *below = &image_[(ring - 1) * columns];
+    const int *below_run = &run_[(ring - 1) * columns];
+    for (int column = 0; column < columns; ++column) {
+      const int point = row[column];
+      if (!obstacle(point)) continue;
+      for (int offset = -span; offset <= span; ++offset) {
+        const int other = (column + offset + columns) % columns;
+        if (!obstacle(below[other]) ||
+            distance2(point, below[other]) >= merge2)
+          continue;
+        const int a = find(row_run[column]), b = find(below_run[other]);
+        parent_[std::max(a, b)] = std::min(a, b);
+      }
+    }
+  }
+
+  // Components in ring order; the hidden returns take their pixel's label
+  std::vector<int> component(parent_.size(), -1);
+  num_components_ = 0;
+  for (int run = 0; run < parent_.size(); ++run) {
+    const int root = find(run);
+    if (component[root] < 0) component[root] = num_components_++;
+    component[run] = component[root];
+  }
+  for (int i = 0; i < cloud.size(); ++i) {
+    if (point_pixel_[i] < 0) continue;
+    const int nearest = image_[point_pixel_[i]];
+    if (labels_[nearest] == GROUND)
+      labels_[i] = GROUND;
+    else
+      labels_[i] = component[run_[point_pixel_[i]]];
+  }
+}
+
+}  // namespace lidar_obstacle_detector
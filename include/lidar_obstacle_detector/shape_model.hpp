@@ -0,0 +1,349 @@
+/* shape_model.hpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Implementation of the per-track accumulated shape model
+
+**/
+
+#pragma once
+
+#include <pcl/point_cloud.h>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <tuple>
+#include <vector>
+
+#include "lidar_obstacle_detector/box.hpp"
+#include "lidar_obstacle_detector/huge_page_buffer.hpp"
+
+namespace lidar_obstacle_detector {
+
+struct ShapeModelParams {
+  float voxel_size = 0.1f;  // voxel edge length in the object frame
+  int max_voxels = 512;     // capacity of every track's voxel set
+  int max_age = 20;         // frames a voxel survives without being observed
+  int align_iterations = 2;  // translation-only alignment iterations
+};
+
+// A fixed-size pool of voxelised point sets, one per track, expressed in the
+// object frame. New cluster points are aligned to the accumulated set and the
+// stable extents of the set replace the noisy per-frame box dimensions.
+class ShapeModelPool {
+ public:
+  ShapeModelPool(const int num_slots, const ShapeModelParams &params);
+
+  // Fuse the cluster into the model of track box->id and overwrite the box
+  // position, dimension and orientation with the accumulated shape. The box
+  // is left untouched if the pool is full.
+  template <typename PointT>
+  void update(const pcl::PointCloud<PointT> &cluster, Box *box);
+
+  // Release the models of the tracks that are not in alive_boxes and start a
+  // new frame
+  void releaseStale(const std::vector<Box> &alive_boxes);
+
+ private:
+  struct Voxel {
+    int16_t x, y, z;
+    uint32_t last_seen;
+  };
+
+  struct Slot {
+    int id = -1;
+    int size = 0;
+    Eigen::Vector3f anchor;    // object frame origin in the sensor frame
+    Eigen::Vector3f motion;    // anchor displacement of the last update
+    Eigen::Vector3f last_min;  // extents of the last cluster (object frame)
+    Eigen::Vector3f last_max;
+    Eigen::Matrix3f rotation;  // object frame to sensor frame
+    float yaw = 0.0f;
+  };
+
+  ShapeModelParams params_;
+  int table_size_;
+  uint32_t frame_ = 0;
+  std::vector<Slot> slots_;
+  HugePageBuffer<Voxel> voxels_;  // num_slots * max_voxels
+  HugePageBuffer<int> table_;      // num_slots * table_size, -1 marks empty
+  std::vector<Eigen::Vector3f> scratch_;
+  std::vector<Voxel> added_;
+
+  int acquireSlot(const Box &box);
+  void rebuildTable(const int slot);
+  // Index of the voxel in the slot, -1 if absent or expired
+  int find(const int slot, const int x, const int y, const int z) const;
+  // Marks the voxels of the points in scratch_ seen and adds the new ones.
+  // If the slot overflows, the expired and then the least recently seen
+  // voxels make room, and the table is rebuilt once.
+  void insertPoints(const int slot);
+  bool expired(const Voxel &voxel) const {
+    return static_cast<int>(frame_ - voxel.last_seen) > params_.max_age;
+  }
+  size_t hash(const int x, const int y, const int z) const {
+    return (static_cast<size_t>(x) * 73856093u ^
+            static_cast<size_t>(y) * 19349663u ^
+            static_cast<size_t>(z) * 83492791u) &
+           (table_size_ - 1);
+  }
+  int key(const float v) const {
+    return static_cast<int>(std::floor(v / params_.voxel_size));
+  }
+};
+
+inline ShapeModelPool::ShapeModelPool(const int num_slots,
+                                      const ShapeModelParams &params)
+    : params_(params),
+      slots_(num_slots),
+      voxels_("shape_model_voxels"),
+      table_("shape_model_table") {
+  // Keep the hash table at most half full
+  table_size_ = 1;
+  while (table_size_ < 2 * params_.max_voxels) table_size_ <<= 1;
+  voxels_.resize(num_slots * params_.max_voxels);
+  table_.assign(num_slots * table_size_, -1);
+}
+
+inline int ShapeModelPool::acquireSlot(const Box &box) {
+  int free_slot = -1;
+  for (int i = 0; i < slots_.size(); ++i) {
+    if (slots_[i].id == box.id) return i;
+    if (slots_[i].id == -1 && free_slot == -1) free_slot = i;
+  }
+  if (free_slot == -1) return -1;
+
+  // Freeze the object frame orientation to the yaw of the first box
+  Slot &slot = slots_[free_slot];
+  const Eigen::Vector3f heading = box.quaternion * Eigen::Vector3f::UnitX();
+  slot.id = box.id;
+  slot.size = 0;
+  slot.anchor = box.position;
+  slot.yaw = std::atan2(heading(1), heading(0));
+  slot.rotation = Eigen::AngleAxisf(slot.yaw, Eigen::Vector3f::UnitZ());
+  std::fill(table_.begin() + free_slot * table_size_,
+            table_.begin() + (free_slot + 1) * table_size_, -1);
+  return free_slot;
+}
+
+inline int ShapeModelPool::find(const int slot, const int x, const int y,
+                                const int z) const {
+  const int *table = &table_[slot * table_size_];
+  const Voxel *voxels = &voxels_[slot * params_.max_voxels];
+  for (size_t h = hash(x, y, z);; h = (h + 1) & (table_size_ - 1)) {
+    const int index = table[h];
+    if (index == -1) return -1;
+    if (voxels[index].x == x && voxels[index].y == y && voxels[index].z == z)
+      return expired(voxels[index]) ? -1 : index;
+  }
+}
+
+inline void ShapeModelPool::insertPoints(const int slot) {
+  Voxel *voxels = &voxels_[slot * params_.max_voxels];
+  added_.clear();
+  for (const auto &p : scratch_) {
+    const int x = key(p(0)), y = key(p(1)), z = key(p(2));
+    const int found = find(slot, x, y, z);
+    if (found != -1)
+      voxels[found].last_seen = frame_;
+    else
+      added_.push_back({static_cast<int16_t>(x), static_cast<int16_t>(y),
+                        static_cast<int16_t>(z), frame_});
+  }
+  std::sort(added_.begin(), added_.end(), [](const Voxel &a, const Voxel &b) {
+    return std::tie(a.x, a.y, a.z) < std::tie(b.x, b.y, b.z);
+  });
+  added_.erase(std::unique(added_.begin(), added_.end(),
+                           [](const Voxel &a, const Voxel &b) {
+                             return a.x == b.x && a.y == b.y && a.z == b.z;
+                           }),
+               added_.end());
+  if (added_.size() > static_cast<size_t>(params_.max_voxels)) {
+    // More than fit: an even subset, spread over the cluster
+    const size_t stride = (added_.size() + params_.max_voxels - 1) /
+                          params_.max_voxels;
+    size_t kept = 0;
+    for (size_t i = 0; i < added_.size(); i += stride)
+      added_[kept++] = added_[i];
+    added_.resize(kept);
+  }
+
+  // Room for all of them: append to the table
+  int size = slots_[slot].size;
+  if (size + added_.size() <= static_cast<size_t>(params_.max_voxels) &&
+      std::none_of(voxels, voxels + size,
+                   [this](const Voxel &voxel) { return expired(voxel); })) {
+    int *table = &table_[slot * table_size_];
+    for (const auto &voxel : added_) {
+      size_t h = hash(voxel.x, voxel.y, voxel.z);
+      while (table[h] != -1) h = (h + 1) & (table_size_ - 1);
+      table[h] = size;
+      voxels[size++] = voxel;
+    }
+    slots_[slot].size = size;
+    return;
+  }
+
+  // Drop the expired voxels, then keep the most recently seen ones
+  size = std::remove_if(voxels, voxels + size,
+                        [this](const Voxel &voxel) { return expired(voxel); }) -
+         voxels;
+  const int keep = std::min<int>(size, params_.max_voxels - added_.size());
+  std::nth_element(voxels, voxels + keep, voxels + size,
+                   [](const Voxel &a, const Voxel &b) {
+                     return a.last_seen > b.last_seen;
+                   });
+  std::copy(added_.begin(), added_.end(), voxels + keep);
+  slots_[slot].size = keep + added_.size();
+  rebuildTable(slot);
+}
+
+inline void ShapeModelPool::rebuildTable(const int slot) {
+  int *table = &table_[slot * table_size_];
+  const Voxel *voxels = &voxels_[slot * params_.max_voxels];
+  std::fill(table, table + table_size_, -1);
+  for (int i = 0; i < slots_[slot].size; ++i) {
+    size_t h = hash(voxels[i].x, voxels[i].y, voxels[i].z);
+    while (table[h] != -1) h = (h + 1) & (table_size_ - 1);
+    table[h] = i;
+  }
+}
+
+template <typename PointT>
+void ShapeModelPool::update(const pcl::PointCloud<PointT> &cluster, Box *box) {
+  if (cluster.empty()) return;
+  const int index = acquireSlot(*box);
+  if (index == -1) return;
+  Slot &slot = slots_[index];
+
+  // Predict the object frame with the motion of the last update
+  const bool is_new = slot.size == 0;
+  const Eigen::Vector3f prev_anchor = slot.anchor;
+  if (!is_new) slot.anchor += slot.motion;
+
+  // Points in the object frame
+  const Eigen::Matrix3f to_object = slot.rotation.transpose();
+  scratch_.resize(cluster.size());
+  Eigen::Vector3f min_pt = Eigen::Vector3f::Constant(FLT_MAX);
+  Eigen::Vector3f max_pt = Eigen::Vector3f::Constant(-FLT_MAX);
+  for (size_t i = 0; i < cluster.size(); ++i) {
+    const auto &point = cluster.points[i];
+    scratch_[i] =
+        to_object * (Eigen::Vector3f(point.x, point.y, point.z) - slot.anchor);
+    min_pt = min_pt.cwiseMin(scratch_[i]);
+    max_pt = max_pt.cwiseMax(scratch_[i]);
+  }
+
+  // Coarse alignment: keep the shift (constant velocity, or snapping one of
+  // the footprint corners or the centre to where it was last frame) that
+  // lands the most points on accumulated voxels
+  if (!is_new) {
+    const Eigen::Vector3f center = 0.5f * (min_pt + max_pt);
+    const Eigen::Vector3f last_center = 0.5f * (slot.last_min + slot.last_max);
+    const Eigen::Vector3f candidates[] = {
+        Eigen::Vector3f::Zero(),
+        slot.last_min - min_pt,
+        slot.last_max - max_pt,
+        Eigen::Vector3f(slot.last_min(0) - min_pt(0),
+                        slot.last_max(1) - max_pt(1),
+                        slot.last_min(2) - min_pt(2)),
+        Eigen::Vector3f(slot.last_max(0) - max_pt(0),
+                        slot.last_min(1) - min_pt(1),
+                        slot.last_min(2) - min_pt(2)),
+        last_center - center};
+    Eigen::Vector3f best_shift = Eigen::Vector3f::Zero();
+    int best_score = -1;
+    for (const auto &shift : candidates) {
+      int score = 0;
+      for (const auto &p : scratch_) {
+        const Eigen::Vector3f q = p + shift;
+        if (find(index, key(q(0)), key(q(1)), key(q(2))) != -1) score++;
+      }
+      if (score > best_score) {
+        best_score = score;
+        best_shift = shift;
+      }
+    }
+    for (auto &p : scratch_) p += best_shift;
+    min_pt += best_shift;
+    max_pt += best_shift;
+    slot.anchor -= slot.rotation * best_shift;
+  }
+
+  // Refine the translation against the accumulated voxels, so that a change
+  // of the visible surfaces does not drag the object frame with it
+  for (int iter = 0; iter < params_.align_iterations && !is_new; ++iter) {
+    Eigen::Vector3f shift = Eigen::Vector3f::Zero();
+    int matched = 0;
+    for (const auto &p : scratch_) {
+      const int x = key(p(0)), y = key(p(1)), z = key(p(2));
+      float best = std::numeric_limits<float>::max();
+      Eigen::Vector3f best_delta;
+      for (int dx = -1; dx <= 1; ++dx) {
+        for (int dy = -1; dy <= 1; ++dy) {
+          for (int dz = -1; dz <= 1; ++dz) {
+            if (find(index, x + dx, y + dy, z + dz) == -1) continue;
+            const Eigen::Vector3f center =
+                (Eigen::Vector3f(x + dx, y + dy, z + dz) +
+                 Eigen::Vector3f::Constant(0.5f)) *
+                params_.voxel_size;
+            const Eigen::Vector3f delta = center - p;
+            if (delta.squaredNorm() < best) {
+              best = delta.squaredNorm();
+              best_delta = delta;
+            }
+          }
+        }
+      }
+      if (best == std::numeric_limits<float>::max()) continue;
+      shift += best_delta;
+      matched++;
+    }
+    if (matched == 0) break;
+    shift /= static_cast<float>(matched);
+    for (auto &p : scratch_) p += shift;
+    min_pt += shift;
+    max_pt += shift;
+    slot.anchor -= slot.rotation * shift;
+  }
+
+  insertPoints(index);
+  slot.motion = slot.anchor - prev_anchor;
+  slot.last_min = min_pt;
+  slot.last_max = max_pt;
+
+  // Stable extents of the accumulated voxels
+  const Voxel *voxels = &voxels_[index * params_.max_voxels];
+  Eigen::Vector3i min_key = Eigen::Vector3i::Constant(INT16_MAX);
+  Eigen::Vector3i max_key = Eigen::Vector3i::Constant(INT16_MIN);
+  for (int i = 0; i < slot.size; ++i) {
+    const Eigen::Vector3i k(voxels[i].x, voxels[i].y, voxels[i].z);
+    min_key = min_key.cwiseMin(k);
+    max_key = max_key.cwiseMax(k);
+  }
+  const Eigen::Vector3f min_extent =
+      min_key.cast<float>() * params_.voxel_size;
+  const Eigen::Vector3f max_extent =
+      (max_key + Eigen::Vector3i::Ones()).cast<float>() * params_.voxel_size;
+
+  box->dimension = max_extent - min_extent;
+  box->position =
+      slot.anchor + slot.rotation * (0.5f * (max_extent + min_extent));
+  box->quaternion = Eigen::Quaternionf(slot.rotation);
+}
+
+inline void ShapeModelPool::releaseStale(const std::vector<Box> &alive_boxes) {
+  for (auto &slot : slots_) {
+    if (slot.id == -1) continue;
+    const bool alive =
+        std::any_of(alive_boxes.begin(), alive_boxes.end(),
+                    [&slot](const Box &box) { return box.id == slot.id; });
+    if (!alive) slot.id = -1;
+  }
+  frame_++;
+}
+
+}  // namespace lidar_obstacle_detector
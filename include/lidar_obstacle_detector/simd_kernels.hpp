@@ -0,0 +1,394 @@
+/* simd_kernels.hpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Implementation of the point kernels for several instruction sets, with
+ * the instruction set picked at run time
+
+**/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LIDAR_OBSTACLE_DETECTOR_X86
+#endif
+
+namespace lidar_obstacle_detector {
+
+// Instruction sets the kernels are compiled for, from the slowest. The
+// package is built for the baseline of the architecture (no -march=native)
+// and the best level the CPU supports is used.
+enum SimdLevel {
+  SIMD_SCALAR = 0,
+  SIMD_SSE42 = 1,
+  SIMD_AVX2 = 2,
+  SIMD_AVX512 = 3,
+};
+
+// The kernels of one instruction set. Points are `stride` floats apart and
+// start with x, y, z (the layout of the PCL point types); the 4 floats at
+// the start of every point are read. Transforms are 3 x 4 row-major.
+struct SimdKernels {
+  int level;
+  const char *name;
+
+  // keep[i] = 1 if point i is inside [min, max], else 0
+  void (*cropBox)(const float *points, int n, int stride, const float *min,
+                  const float *max, char *keep);
+  // keep[i] = 0 if point i is inside [min, max]
+  void (*excludeBox)(const float *points, int n, int stride, const float *min,
+                     const float *max, char *keep);
+  // distances[i] = |a x + b y + c z + d| of the plane {a, b, c, d}
+  void (*planeDistances)(const float *points, int n, int stride,
+                         const float *plane, float *distances);
+  // Bounds of the points, +/-infinity if there are none
+  void (*minMax)(const float *points, int n, int stride, float *min,
+                 float *max);
+  // Bounds of the transformed points
+  void (*transformedMinMax)(const float *points, int n, int stride,
+                            const float *transform, float *min, float *max);
+  // The transformed points as {x, y, z, 1}
+  void (*transformPoints)(const float *points, int n, int stride,
+                          const float *transform, float *out);
+};
+
+namespace scalar {
+
+typedef float Vec;
+typedef bool Mask;
+const int WIDTH = 1;
+
+inline Vec set1(const float value) { return value; }
+inline void loadXYZ(const float *p, int, Vec *x, Vec *y, Vec *z) {
+  *x = p[0], *y = p[1], *z = p[2];
+}
+inline Vec add(const Vec a, const Vec b) { return a + b; }
+inline Vec mul(const Vec a, const Vec b) { return a * b; }
+inline Vec abs(const Vec a) { return std::abs(a); }
+inline Vec minimum(const Vec a, const Vec b) { return a < b ? a : b; }
+inline Vec maximum(const Vec a, const Vec b) { return a > b ? a : b; }
+inline float reduceMin(const Vec a) { return a; }
+inline float reduceMax(const Vec a) { return a; }
+inline Mask inside(const Vec v, const Vec lo, const Vec hi) {
+  return lo <= v && v <= hi;
+}
+inline Mask andMask(const Mask a, const Mask b) { return a && b; }
+inline void storeMask(const Mask m, char *keep) { *keep = m; }
+inline void clearMask(const Mask m, char *keep) {
+  if (m) *keep = 0;
+}
+inline void store(float *out, const Vec a) { *out = a; }
+inline void storeXYZ1(float *out, const Vec x, const Vec y, const Vec z) {
+  out[0] = x, out[1] = y, out[2] = z, out[3] = 1.0f;
+}
+
+#include "lidar_obstacle_detector/simd_kernels_impl.hpp"
+
+}  // namespace scalar
+
+#ifdef LIDAR_OBSTACLE_DETECTOR_X86
+
+// Every instruction set gets its own target region, so that its intrinsics
+// can be used without building the whole package for it
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("sse4.2"))), \
+                             apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+#endif
+
+namespace sse42 {
+
+typedef __m128 Vec;
+typedef __m128 Mask;
+const int WIDTH = 4;
+
+// Points p0..p3 (4 floats each) to their x, y, z (and w) vectors, within
+// every 128 bit lane. The same shuffles put them back.
+#define LIDAR_OBSTACLE_DETECTOR_TRANSPOSE(prefix, r0, r1, r2, r3)    \
+  {                                                                  \
+    const auto t0 = prefix##_unpacklo_ps(r0, r1);                    \
+    const auto t1 = prefix##_unpacklo_ps(r2, r3);                    \
+    const auto t2 = prefix##_unpackhi_ps(r0, r1);                    \
+    const auto t3 = prefix##_unpackhi_ps(r2, r3);                    \
+    r0 = prefix##_shuffle_ps(t0, t1, 0x44);                          \
+    r1 = prefix##_shuffle_ps(t0, t1, 0xEE);                          \
+    r2 = prefix##_shuffle_ps(t2, t3, 0x44);                          \
+    r3 = prefix##_shuffle_ps(t2, t3, 0xEE);                          \
+  }
+
+inline Vec set1(const float value) { return _mm_set1_ps(value); }
+inline void loadXYZ(const float *p, const int stride, Vec *x, Vec *y,
+                    Vec *z) {
+  __m128 r0 = _mm_loadu_ps(p), r1 = _mm_loadu_ps(p + stride);
+  __m128 r2 = _mm_loadu_ps(p + 2 * stride), r3 = _mm_loadu_ps(p + 3 * stride);
+  LIDAR_OBSTACLE_DETECTOR_TRANSPOSE(_mm, r0, r1, r2, r3);
+  *x = r0, *y = r1, *z = r2;
+}
+inline Vec add(const Vec a, const Vec b) { return _mm_add_ps(a, b); }
+inline Vec mul(const Vec a, const Vec b) { return _mm_mul_ps(a, b); }
+inline Vec abs(const Vec a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+inline Vec minimum(const Vec a, const Vec b) { return _mm_min_ps(a, b); }
+inline Vec maximum(const Vec a, const Vec b) { return _mm_max_ps(a, b); }
+inline float reduceMin(Vec a) {
+  a = _mm_min_ps(a, _mm_movehl_ps(a, a));
+  return _mm_cvtss_f32(_mm_min_ss(a, _mm_shuffle_ps(a, a, 1)));
+}
+inline float reduceMax(Vec a) {
+  a = _mm_max_ps(a, _mm_movehl_ps(a, a));
+  return _mm_cvtss_f32(_mm_max_ss(a, _mm_shuffle_ps(a, a, 1)));
+}
+inline Mask inside(const Vec v, const Vec lo, const Vec hi) {
+  return _mm_and_ps(_mm_cmple_ps(lo, v), _mm_cmple_ps(v, hi));
+}
+inline Mask andMask(const Mask a, const Mask b) { return _mm_and_ps(a, b); }
+inline void storeMask(const Mask m, char *keep) {
+  const int bits = _mm_movemask_ps(m);
+  for (int j = 0; j < WIDTH; ++j) keep[j] = (bits >> j) & 1;
+}
+inline void clearMask(const Mask m, char *keep) {
+  const int bits = _mm_movemask_ps(m);
+  for (int j = 0; j < WIDTH; ++j)
+    if ((bits >> j) & 1) keep[j] = 0;
+}
+inline void store(float *out, const Vec a) { _mm_storeu_ps(out, a); }
+inline void storeXYZ1(float *out, Vec x, Vec y, Vec z) {
+  Vec w = _mm_set1_ps(1.0f);
+  LIDAR_OBSTACLE_DETECTOR_TRANSPOSE(_mm, x, y, z, w);
+  _mm_storeu_ps(out, x), _mm_storeu_ps(out + 4, y);
+  _mm_storeu_ps(out + 8, z), _mm_storeu_ps(out + 12, w);
+}
+
+#include "lidar_obstacle_detector/simd_kernels_impl.hpp"
+
+}  // namespace sse42
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#pragma clang attribute push(__attribute__((target("avx2"))), \
+                             apply_to = function)
+#else
+#pragma GCC pop_options
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+
+namespace avx2 {
+
+typedef __m256 Vec;
+typedef __m256 Mask;
+const int WIDTH = 8;
+
+inline Vec set1(const float value) { return _mm256_set1_ps(value); }
+// Points 0..3 in the low lanes, 4..7 in the high ones
+inline void loadXYZ(const float *p, const int stride, Vec *x, Vec *y,
+                    Vec *z) {
+  __m256 r[4];
+  for (int k = 0; k < 4; ++k)
+    r[k] = _mm256_insertf128_ps(
+        _mm256_castps128_ps256(_mm_loadu_ps(p + k * stride)),
+        _mm_loadu_ps(p + (k + 4) * stride), 1);
+  LIDAR_OBSTACLE_DETECTOR_TRANSPOSE(_mm256, r[0], r[1], r[2], r[3]);
+  *x = r[0], *y = r[1], *z = r[2];
+}
+inline Vec add(const Vec a, const Vec b) { return _mm256_add_ps(a, b); }
+inline Vec mul(const Vec a, const Vec b) { return _mm256_mul_ps(a, b); }
+inline Vec abs(const Vec a) {
+  return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a);
+}
+inline Vec minimum(const Vec a, const Vec b) { return _mm256_min_ps(a, b); }
+inline Vec maximum(const Vec a, const Vec b) { return _mm256_max_ps(a, b); }
+inline float reduceMin(const Vec a) {
+  return sse42::reduceMin(
+      _mm_min_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1)));
+}
+inline float reduceMax(const Vec a) {
+  return sse42::reduceMax(
+      _mm_max_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1)));
+}
+inline Mask inside(const Vec v, const Vec lo, const Vec hi) {
+  return _mm256_and_ps(_mm256_cmp_ps(lo, v, _CMP_LE_OQ),
+                       _mm256_cmp_ps(v, hi, _CMP_LE_OQ));
+}
+inline Mask andMask(const Mask a, const Mask b) { return _mm256_and_ps(a, b); }
+inline void storeMask(const Mask m, char *keep) {
+  const int bits = _mm256_movemask_ps(m);
+  for (int j = 0; j < WIDTH; ++j) keep[j] = (bits >> j) & 1;
+}
+inline void clearMask(const Mask m, char *keep) {
+  const int bits = _mm256_movemask_ps(m);
+  for (int j = 0; j < WIDTH; ++j)
+    if ((bits >> j) & 1) keep[j] = 0;
+}
+inline void store(float *out, const Vec a) { _mm256_storeu_ps(out, a); }
+inline void storeXYZ1(float *out, Vec x, Vec y, Vec z) {
+  Vec w = _mm256_set1_ps(1.0f);
+  LIDAR_OBSTACLE_DETECTOR_TRANSPOSE(_mm256, x, y, z, w);
+  const __m256 r[4] = {x, y, z, w};
+  for (int k = 0; k < 4; ++k) {
+    _mm_storeu_ps(out + 4 * k, _mm256_castps256_ps128(r[k]));
+    _mm_storeu_ps(out + 4 * (k + 4), _mm256_extractf128_ps(r[k], 1));
+  }
+}
+
+#include "lidar_obstacle_detector/simd_kernels_impl.hpp"
+
+}  // namespace avx2
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#pragma clang attribute push(__attribute__((target("avx512f"))), \
+                             apply_to = function)
+#else
+#pragma GCC pop_options
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+// AVX-512 has FMAs, which must not fuse the products and sums (here or in
+// the inlined scalar tails) for the results to match the other instruction
+// sets bit for bit
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+namespace avx512 {
+
+typedef __m512 Vec;
+typedef __mmask16 Mask;
+const int WIDTH = 16;
+
+inline Vec set1(const float value) { return _mm512_set1_ps(value); }
+// Points k, k + 4, k + 8 and k + 12 in the lanes of r[k]
+inline void loadXYZ(const float *p, const int stride, Vec *x, Vec *y,
+                    Vec *z) {
+  __m512 r[4];
+  for (int k = 0; k < 4; ++k) {
+    r[k] = _mm512_broadcast_f32x4(_mm_loadu_ps(p + k * stride));
+    r[k] = _mm512_insertf32x4(r[k], _mm_loadu_ps(p + (k + 4) * stride), 1);
+    r[k] = _mm512_insertf32x4(r[k], _mm_loadu_ps(p + (k + 8) * stride), 2);
+    r[k] = _mm512_insertf32x4(r[k], _mm_loadu_ps(p + (k + 12) * stride), 3);
+  }
+  LIDAR_OBSTACLE_DETECTOR_TRANSPOSE(_mm512, r[0], r[1], r[2], r[3]);
+  *x = r[0], *y = r[1], *z = r[2];
+}
+inline Vec add(const Vec a, const Vec b) { return _mm512_add_ps(a, b); }
+inline Vec mul(const Vec a, const Vec b) { return _mm512_mul_ps(a, b); }
+inline Vec abs(const Vec a) { return _mm512_abs_ps(a); }
+inline Vec minimum(const Vec a, const Vec b) { return _mm512_min_ps(a, b); }
+inline Vec maximum(const Vec a, const Vec b) { return _mm512_max_ps(a, b); }
+inline float reduceMin(const Vec a) { return _mm512_reduce_min_ps(a); }
+inline float reduceMax(const Vec a) { return _mm512_reduce_max_ps(a); }
+inline Mask inside(const Vec v, const Vec lo, const Vec hi) {
+  return _mm512_cmp_ps_mask(lo, v, _CMP_LE_OQ) &
+         _mm512_cmp_ps_mask(v, hi, _CMP_LE_OQ);
+}
+inline Mask andMask(const Mask a, const Mask b) { return a & b; }
+inline void storeMask(const Mask m, char *keep) {
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(keep),
+                   _mm512_cvtepi32_epi8(_mm512_maskz_set1_epi32(m, 1)));
+}
+inline void clearMask(const Mask m, char *keep) {
+  const __m128i inside = _mm512_cvtepi32_epi8(_mm512_maskz_set1_epi32(m, -1));
+  const __m128i kept = _mm_loadu_si128(reinterpret_cast<__m128i *>(keep));
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(keep),
+                   _mm_andnot_si128(inside, kept));
+}
+inline void store(float *out, const Vec a) { _mm512_storeu_ps(out, a); }
+inline void storeXYZ1(float *out, Vec x, Vec y, Vec z) {
+  Vec w = _mm512_set1_ps(1.0f);
+  LIDAR_OBSTACLE_DETECTOR_TRANSPOSE(_mm512, x, y, z, w);
+  const __m512 r[4] = {x, y, z, w};
+  for (int k = 0; k < 4; ++k) {
+    _mm_storeu_ps(out + 4 * k, _mm512_castps512_ps128(r[k]));
+    _mm_storeu_ps(out + 4 * (k + 4), _mm512_extractf32x4_ps(r[k], 1));
+    _mm_storeu_ps(out + 4 * (k + 8), _mm512_extractf32x4_ps(r[k], 2));
+    _mm_storeu_ps(out + 4 * (k + 12), _mm512_extractf32x4_ps(r[k], 3));
+  }
+}
+
+#include "lidar_obstacle_detector/simd_kernels_impl.hpp"
+
+}  // namespace avx512
+
+#undef LIDAR_OBSTACLE_DETECTOR_TRANSPOSE
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+
+#endif  // LIDAR_OBSTACLE_DETECTOR_X86
+
+inline bool simdLevelSupported(const int level) {
+#ifdef LIDAR_OBSTACLE_DETECTOR_X86
+  __builtin_cpu_init();
+  switch (level) {
+    case SIMD_SCALAR:
+      return true;
+    case SIMD_SSE42:
+      return __builtin_cpu_supports("sse4.2");
+    case SIMD_AVX2:
+      return __builtin_cpu_supports("avx2");
+    case SIMD_AVX512:
+      return __builtin_cpu_supports("avx512f");
+  }
+  return false;
+#else
+  return level == SIMD_SCALAR;
+#endif
+}
+
+inline int bestSimdLevel() {
+  int level = SIMD_AVX512;
+  while (level > SIMD_SCALAR && !simdLevelSupported(level)) level--;
+  return level;
+}
+
+// The kernels of a level, which must be supported by the CPU
+inline const SimdKernels &simdKernels(const int level) {
+#define LIDAR_OBSTACLE_DETECTOR_KERNELS(isa, id, name)                   \
+  {                                                                     \
+    id, name, isa::cropBox, isa::excludeBox, isa::planeDistances,        \
+        isa::minMax, isa::transformedMinMax, isa::transformPoints        \
+  }
+  static const SimdKernels kernels[] = {
+      LIDAR_OBSTACLE_DETECTOR_KERNELS(scalar, SIMD_SCALAR, "scalar"),
+#ifdef LIDAR_OBSTACLE_DETECTOR_X86
+      LIDAR_OBSTACLE_DETECTOR_KERNELS(sse42, SIMD_SSE42, "sse4.2"),
+      LIDAR_OBSTACLE_DETECTOR_KERNELS(avx2, SIMD_AVX2, "avx2"),
+      LIDAR_OBSTACLE_DETECTOR_KERNELS(avx512, SIMD_AVX512, "avx512"),
+#endif
+  };
+#undef LIDAR_OBSTACLE_DETECTOR_KERNELS
+  const int count = sizeof(kernels) / sizeof(kernels[0]);
+  return kernels[std::min(std::max(level, 0), count - 1)];
+}
+
+inline std::atomic<int> &simdLevel() {
+  static std::atomic<int> level(bestSimdLevel());
+  return level;
+}
+
+// Caps the level of the kernels used from now on ("auto" for the best one)
+inline void setSimdLevel(const int level) {
+  simdLevel() = std::min(std::max(level, 0), bestSimdLevel());
+}
+
+inline int parseSimdLevel(const std::string &name) {
+  if (name == "scalar") return SIMD_SCALAR;
+  if (name == "sse4.2") return SIMD_SSE42;
+  if (name == "avx2") return SIMD_AVX2;
+  if (name == "avx512") return SIMD_AVX512;
+  return bestSimdLevel();
+}
+
+// The kernels of the current level
+inline const SimdKernels &simdKernels() { return simdKernels(simdLevel()); }
+
+}  // namespace lidar_obstacle_detector
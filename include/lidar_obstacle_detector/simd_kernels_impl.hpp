@@ -0,0 +1,145 @@
+/* simd_kernels_impl.hpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Implementation of the point kernels, once per instruction set
+
+**/
+
+// No include guard: simd_kernels.hpp includes this file once per instruction
+// set, inside that instruction set's namespace and target region, after
+// defining its Vec and Mask types, WIDTH and the operations used below. The
+// last (n % WIDTH) points go through the scalar kernels.
+
+inline void cropBox(const float *points, const int n, const int stride,
+                    const float *min, const float *max, char *keep) {
+  const Vec min_x = set1(min[0]), min_y = set1(min[1]), min_z = set1(min[2]);
+  const Vec max_x = set1(max[0]), max_y = set1(max[1]), max_z = set1(max[2]);
+  int i = 0;
+  for (; i + WIDTH <= n; i += WIDTH) {
+    Vec x, y, z;
+    loadXYZ(points + i * stride, stride, &x, &y, &z);
+    storeMask(andMask(andMask(inside(x, min_x, max_x), inside(y, min_y, max_y)),
+                      inside(z, min_z, max_z)),
+              keep + i);
+  }
+  if (i < n) scalar::cropBox(points + i * stride, n - i, stride, min, max,
+                             keep + i);
+}
+
+inline void excludeBox(const float *points, const int n, const int stride,
+                       const float *min, const float *max, char *keep) {
+  const Vec min_x = set1(min[0]), min_y = set1(min[1]), min_z = set1(min[2]);
+  const Vec max_x = set1(max[0]), max_y = set1(max[1]), max_z = set1(max[2]);
+  int i = 0;
+  for (; i + WIDTH <= n; i += WIDTH) {
+    Vec x, y, z;
+    loadXYZ(points + i * stride, stride, &x, &y, &z);
+    clearMask(andMask(andMask(inside(x, min_x, max_x), inside(y, min_y, max_y)),
+                      inside(z, min_z, max_z)),
+              keep + i);
+  }
+  if (i < n) scalar::excludeBox(points + i * stride, n - i, stride, min, max,
+                                keep + i);
+}
+
+inline void planeDistances(const float *points, const int n, const int stride,
+                           const float *plane, float *distances) {
+  const Vec a = set1(plane[0]), b = set1(plane[1]), c = set1(plane[2]);
+  const Vec d = set1(plane[3]);
+  int i = 0;
+  for (; i + WIDTH <= n; i += WIDTH) {
+    Vec x, y, z;
+    loadXYZ(points + i * stride, stride, &x, &y, &z);
+    store(distances + i,
+          abs(add(add(add(mul(a, x), mul(b, y)), mul(c, z)), d)));
+  }
+  if (i < n) scalar::planeDistances(points + i * stride, n - i, stride, plane,
+                                    distances + i);
+}
+
+inline void minMax(const float *points, const int n, const int stride,
+                   float *min, float *max) {
+  Vec min_x = set1(INFINITY), min_y = min_x, min_z = min_x;
+  Vec max_x = set1(-INFINITY), max_y = max_x, max_z = max_x;
+  int i = 0;
+  for (; i + WIDTH <= n; i += WIDTH) {
+    Vec x, y, z;
+    loadXYZ(points + i * stride, stride, &x, &y, &z);
+    min_x = minimum(min_x, x), min_y = minimum(min_y, y);
+    min_z = minimum(min_z, z);
+    max_x = maximum(max_x, x), max_y = maximum(max_y, y);
+    max_z = maximum(max_z, z);
+  }
+  min[0] = reduceMin(min_x), min[1] = reduceMin(min_y);
+  min[2] = reduceMin(min_z);
+  max[0] = reduceMax(max_x), max[1] = reduceMax(max_y);
+  max[2] = reduceMax(max_z);
+  if (i < n) {
+    float tail_min[3], tail_max[3];
+    scalar::minMax(points + i * stride, n - i, stride, tail_min, tail_max);
+    for (int axis = 0; axis < 3; ++axis) {
+      min[axis] = std::min(min[axis], tail_min[axis]);
+      max[axis] = std::max(max[axis], tail_max[axis]);
+    }
+  }
+}
+
+// Row r of the transformed point is
+// ((m[4r] x + m[4r + 1] y) + m[4r + 2] z) + m[4r + 3]
+#define LIDAR_OBSTACLE_DETECTOR_TRANSFORM(x, y, z, m, row)              \
+  add(add(add(mul(m[4 * row], x), mul(m[4 * row + 1], y)),             \
+          mul(m[4 * row + 2], z)),                                     \
+      m[4 * row + 3])
+
+inline void transformedMinMax(const float *points, const int n,
+                              const int stride, const float *transform,
+                              float *min, float *max) {
+  Vec m[12];
+  for (int k = 0; k < 12; ++k) m[k] = set1(transform[k]);
+  Vec min_x = set1(INFINITY), min_y = min_x, min_z = min_x;
+  Vec max_x = set1(-INFINITY), max_y = max_x, max_z = max_x;
+  int i = 0;
+  for (; i + WIDTH <= n; i += WIDTH) {
+    Vec x, y, z;
+    loadXYZ(points + i * stride, stride, &x, &y, &z);
+    const Vec tx = LIDAR_OBSTACLE_DETECTOR_TRANSFORM(x, y, z, m, 0);
+    const Vec ty = LIDAR_OBSTACLE_DETECTOR_TRANSFORM(x, y, z, m, 1);
+    const Vec tz = LIDAR_OBSTACLE_DETECTOR_TRANSFORM(x, y, z, m, 2);
+    min_x = minimum(min_x, tx), min_y = minimum(min_y, ty);
+    min_z = minimum(min_z, tz);
+    max_x = maximum(max_x, tx), max_y = maximum(max_y, ty);
+    max_z = maximum(max_z, tz);
+  }
+  min[0] = reduceMin(min_x), min[1] = reduceMin(min_y);
+  min[2] = reduceMin(min_z);
+  max[0] = reduceMax(max_x), max[1] = reduceMax(max_y);
+  max[2] = reduceMax(max_z);
+  if (i < n) {
+    float tail_min[3], tail_max[3];
+    scalar::transformedMinMax(points + i * stride, n - i, stride, transform,
+                              tail_min, tail_max);
+    for (int axis = 0; axis < 3; ++axis) {
+      min[axis] = std::min(min[axis], tail_min[axis]);
+      max[axis] = std::max(max[axis], tail_max[axis]);
+    }
+  }
+}
+
+inline void transformPoints(const float *points, const int n, const int stride,
+                            const float *transform, float *out) {
+  Vec m[12];
+  for (int k = 0; k < 12; ++k) m[k] = set1(transform[k]);
+  int i = 0;
+  for (; i + WIDTH <= n; i += WIDTH) {
+    Vec x, y, z;
+    loadXYZ(points + i * stride, stride, &x, &y, &z);
+    storeXYZ1(out + 4 * i, LIDAR_OBSTACLE_DETECTOR_TRANSFORM(x, y, z, m, 0),
+              LIDAR_OBSTACLE_DETECTOR_TRANSFORM(x, y, z, m, 1),
+              LIDAR_OBSTACLE_DETECTOR_TRANSFORM(x, y, z, m, 2));
+  }
+  if (i < n) scalar::transformPoints(points + i * stride, n - i, stride,
+                                     transform, out + 4 * i);
+}
+
+#undef LIDAR_OBSTACLE_DETECTOR_TRANSFORM
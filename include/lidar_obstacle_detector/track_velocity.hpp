@@ -0,0 +1,133 @@
+/* track_velocity.hpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Implementation of the per-track velocity estimation by 2D scan matching
+
+**/
+
+#pragma once
+
+#include <pcl/point_cloud.h>
+
+#include <Eigen/Geometry>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "lidar_obstacle_detector/box.hpp"
+
+namespace lidar_obstacle_detector {
+
+struct VelocityParams {
+  int max_iterations = 10;          // ICP iteration cap per track
+  float max_correspondence = 0.5f;  // metres between matched points
+  int max_points = 256;             // kept per cluster, evenly strided
+  int min_correspondences = 10;     // fewer and the estimate is dropped
+};
+
+// The x-y points of the previous frame's cluster of every track
+struct TrackPoints {
+  std::unordered_map<int, std::vector<Eigen::Vector2f>> points;  // by id
+  bool fixed = false;  // in the fixed frame, else in the sensor frame
+};
+
+// At most max_points of the cluster, moved by transform and projected to
+// the x-y plane
+template <typename PointT>
+std::vector<Eigen::Vector2f> trackPoints(const pcl::PointCloud<PointT> &cluster,
+                                         const int max_points,
+                                         const Eigen::Affine3f &transform) {
+  const size_t stride =
+      std::max<size_t>(1, (cluster.size() + max_points - 1) / max_points);
+  std::vector<Eigen::Vector2f> points;
+  points.reserve(cluster.size() / stride + 1);
+  for (size_t i = 0; i < cluster.size(); i += stride)
+    points.push_back(
+        (transform * cluster.points[i].getVector3fMap()).template head<2>());
+  return points;
+}
+
+// Moves the boxes by their velocity over dt, so that they can be gated
+// against the next frame with tighter thresholds
+inline void predictBoxes(const double dt, std::vector<Box> *boxes) {
+  for (auto &box : *boxes) {
+    if (!box.velocity_valid) continue;
+    box.position += box.velocity * dt;
+    if (box.track_filtered) box.track_position += box.velocity * dt;
+  }
+}
+
+// Point-to-point ICP in the x-y plane: the rigid motion taking source onto
+// target, starting from *motion. Correspondences are searched in a grid of
+// max_correspondence cells over the target. Returns false if too few points
+// could be matched.
+inline bool icp2D(const std::vector<Eigen::Vector2f> &source,
+                  const std::vector<Eigen::Vector2f> &target,
+                  const VelocityParams &params, Eigen::Isometry2f *motion) {
+  const float cell_size = std::max(params.max_correspondence, 0.01f);
+  const auto cell = [cell_size](const float value) {
+    return static_cast<int64_t>(std::floor(value / cell_size));
+  };
+  const auto key = [](const int64_t x, const int64_t y) {
+    return ((x + (1 << 30)) << 32) | (y + (1 << 30));
+  };
+  std::unordered_map<int64_t, std::vector<int>> grid;
+  for (int i = 0; i < target.size(); ++i)
+    grid[key(cell(target[i](0)), cell(target[i](1)))].push_back(i);
+
+  const float max_distance2 =
+      params.max_correspondence * params.max_correspondence;
+  int matched = 0;
+  for (int iteration = 0; iteration < params.max_iterations; ++iteration) {
+    // Centroids and cross covariance of the matched pairs
+    Eigen::Vector2f source_sum = Eigen::Vector2f::Zero();
+    Eigen::Vector2f target_sum = Eigen::Vector2f::Zero();
+    Eigen::Matrix2f cross = Eigen::Matrix2f::Zero();
+    matched = 0;
+    for (auto &point : source) {
+      const Eigen::Vector2f moved = *motion * point;
+      int best = -1;
+      float best_distance2 = max_distance2;
+      for (int64_t x = cell(moved(0)) - 1; x <= cell(moved(0)) + 1; ++x) {
+        for (int64_t y = cell(moved(1)) - 1; y <= cell(moved(1)) + 1; ++y) {
+          const auto found = grid.find(key(x, y));
+          if (found == grid.end()) continue;
+          for (int t : found->second) {
+            const float distance2 = (target[t] - moved).squaredNorm();
+            if (distance2 < best_distance2) {
+              best = t;
+              best_distance2 = distance2;
+            }
+          }
+        }
+      }
+      if (best < 0) continue;
+      source_sum += moved;
+      target_sum += target[best];
+      cross += moved * target[best].transpose();
+      matched++;
+    }
+    if (matched < params.min_correspondences) return false;
+
+    // Closed form 2D rigid alignment of the pairs
+    const Eigen::Vector2f source_mean = source_sum / matched;
+    const Eigen::Vector2f target_mean = target_sum / matched;
+    cross -= matched * source_mean * target_mean.transpose();
+    const float angle =
+        std::atan2(cross(0, 1) - cross(1, 0), cross(0, 0) + cross(1, 1));
+    const Eigen::Rotation2Df rotation(angle);
+    Eigen::Isometry2f step = Eigen::Isometry2f::Identity();
+    step.linear() = rotation.toRotationMatrix();
+    step.translation() = target_mean - rotation * source_mean;
+    *motion = step * *motion;
+
+    if (step.translation().norm() < 1e-3f && std::abs(angle) < 1e-4f) break;
+  }
+
+  return matched >= params.min_correspondences;
+}
+
+}  // namespace lidar_obstacle_detector
@@ -0,0 +1,321 @@
+/* voxel_summary.hpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Implementation of the per-voxel summary shared by the voxel grid stages
+
+**/
+
+#pragma once
+
+#include <pcl/point_cloud.h>
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "lidar_obstacle_detector/huge_page_buffer.hpp"
+
+namespace lidar_obstacle_detector {
+
+// Open addressing table from 64 bit keys to dense indices (linear probing)
+class VoxelIndex {
+ public:
+  explicit VoxelIndex(const std::string &name) : slots_(name) {}
+
+  // Empties the table, sized for `capacity` keys. It grows past that.
+  void reset(const size_t capacity) {
+    size_t slots = 16;
+    shift_ = 60;
+    while (slots < 2 * capacity) {
+      slots <<= 1;
+      shift_--;
+    }
+    mask_ = slots - 1;
+    size_ = 0;
+    slots_.assign(slots, Slot{0, -1});
+  }
+
+  // Index of the key, or -1
+  int find(const int64_t key) const {
+    for (size_t s = hash(key);; s = (s + 1) & mask_) {
+      if (slots_[s].index < 0 || slots_[s].key == key) return slots_[s].index;
+    }
+  }
+
+  // Index of the key, which gets `index` if it is new
+  int insert(const int64_t key, const int index) {
+    for (size_t s = hash(key);; s = (s + 1) & mask_) {
+      if (slots_[s].index < 0) {
+        slots_[s] = Slot{key, index};
+        if (2 * ++size_ > mask_ + 1) grow();
+        return index;
+      }
+      if (slots_[s].key == key) return slots_[s].index;
+    }
+  }
+
+ private:
+  struct Slot {
+    int64_t key;
+    int index;
+  };
+  HugePageBuffer<Slot> slots_;
+  size_t mask_ = 0;
+  size_t size_ = 0;
+  int shift_ = 60;
+
+  void grow() {
+    const std::vector<Slot> slots(slots_.begin(), slots_.end());
+    reset(slots.size());
+    for (auto &slot : slots) {
+      if (slot.index >= 0) insert(slot.key, slot.index);
+    }
+  }
+
+  // Fibonacci hashing, the high bits of the product mix all the key's bits
+  size_t hash(const int64_t key) const {
+    return static_cast<uint64_t>(key) * 0x9E3779B97F4A7C15ull >> shift_;
+  }
+};
+
+// What the voxel grid filter knows about every occupied voxel, kept so that
+// the ground classification and the clustering work on the voxels instead of
+// rebuilding a spatial structure (RANSAC, k-d tree) over the points. The
+// voxels are numbered in the order the points first hit them.
+template <typename PointT>
+class VoxelSummary {
+ public:
+  enum { GROUND = -1 };
+
+  struct Voxel {
+    int64_t key;
+    int x, y, z;    // cell
+    int count;      // points
+    int first;      // index of the first point, for the non-xyz fields
+    float min_z, max_z;
+    Eigen::Vector3f centroid;
+  };
+
+  VoxelSummary()
+      : voxels_("voxel_summary"),
+        index_("voxel_summary_index"),
+        columns_("voxel_summary_columns"),
+        obstacles_("voxel_summary_obstacles"),
+        parent_("voxel_summary_parent") {}
+
+  void build(const pcl::PointCloud<PointT> &cloud, const float voxel_size);
+
+  // Keeps the voxels with keep[i] != 0, in order
+  void compact(const char *keep);
+
+  // One point per voxel at its centroid, the other fields from its first
+  // point, as pcl::VoxelGrid gives for xyz
+  void centroids(const pcl::PointCloud<PointT> &cloud,
+                 pcl::PointCloud<PointT> *output) const;
+
+  // A voxel is ground if its centroid is within ground_thresh of the lowest
+  // point of the cell_size x cell_size columns around its own
+  void classifyGround(const float ground_thresh, const float cell_size);
+
+  // Components of the non-ground voxels whose centroids are within
+  // `tolerance`, numbered in voxel order (after classifyGround)
+  void cluster(const float tolerance);
+
+  size_t size() const { return voxels_.size(); }
+  const Voxel &voxel(const int i) const { return voxels_[i]; }
+  float voxelSize() const { return voxel_size_; }
+
+  // Index of the voxel of a cell, or -1
+  int find(const int x, const int y, const int z) const {
+    return index_.find(key(x, y, z));
+  }
+
+  // GROUND or the component of voxel i, after cluster()
+  int label(const int i) const { return labels_[i]; }
+  int numComponents() const { return num_components_; }
+
+ private:
+  HugePageBuffer<Voxel> voxels_;
+  VoxelIndex index_;
+  VoxelIndex columns_;    // of the ground cells
+  VoxelIndex obstacles_;  // of the non-ground voxels
+  HugePageBuffer<int> parent_;
+  std::vector<int> labels_;
+  std::vector<float> column_min_;
+  float voxel_size_ = 1.0f;
+  int num_components_ = 0;
+
+  static int64_t key(const int64_t x, const int64_t y, const int64_t z) {
+    return ((x + (1 << 20)) << 42) | ((y + (1 << 20)) << 21) | (z + (1 << 20));
+  }
+
+  int root(int voxel) {
+    while (parent_[voxel] != voxel)
+      voxel = parent_[voxel] = parent_[parent_[voxel]];
+    return voxel;
+  }
+};
+
+template <typename PointT>
+void VoxelSummary<PointT>::build(const pcl::PointCloud<PointT> &cloud,
+                                 const float voxel_size) {
+  voxel_size_ = std::max(voxel_size, 0.01f);
+  const float inverse = 1.0f / voxel_size_;
+  // Sized for as many voxels as the last frame had
+  index_.reset(voxels_.size());
+  voxels_.resize(cloud.size());
+  int count = 0;
+  for (int i = 0; i < cloud.size(); ++i) {
+    const PointT &p = cloud.points[i];
+    if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z))
+      continue;
+    const int x = std::floor(p.x * inverse);
+    const int y = std::floor(p.y * inverse);
+    const int z = std::floor(p.z * inverse);
+    const int64_t voxel_key = key(x, y, z);
+    const int v = index_.insert(voxel_key, count);
+    if (v == count)
+      voxels_[count++] = Voxel{voxel_key, x, y, z, 0, i, p.z, p.z,
+                               Eigen::Vector3f::Zero()};
+    Voxel &voxel = voxels_[v];
+    voxel.count++;
+    voxel.min_z = std::min(voxel.min_z, p.z);
+    voxel.max_z = std::max(voxel.max_z, p.z);
+    voxel.centroid += p.getVector3fMap();
+  }
+  voxels_.resize(count);
+  for (auto &voxel : voxels_) voxel.centroid /= voxel.count;
+}
+
+template <typename PointT>
+void VoxelSummary<PointT>::compact(const char *keep) {
+  int count = 0;
+  for (int v = 0; v < voxels_.size(); ++v) {
+    if (keep[v]) voxels_[count++] = voxels_[v];
+  }
+  voxels_.resize(count);
+  index_.reset(count);
+  for (int v = 0; v < count; ++v) index_.insert(voxels_[v].key, v);
+}
+
+template <typename PointT>
+void VoxelSummary<PointT>::centroids(const pcl::PointCloud<PointT> &cloud,
+                                     pcl::PointCloud<PointT> *output) const {
+  output->points.resize(voxels_.size());
+  for (int v = 0; v < voxels_.size(); ++v) {
+    PointT &p = output->points[v];
+    p = cloud.points[voxels_[v].first];
+    p.x = voxels_[v].centroid(0);
+    p.y = voxels_[v].centroid(1);
+    p.z = voxels_[v].centroid(2);
+  }
+  output->width = output->points.size();
+  output->height = 1;
+  output->is_dense = true;
+}
+
+template <typename PointT>
+void VoxelSummary<PointT>::classifyGround(const float ground_thresh,
+                                          const float cell_size) {
+  // Lowest point of every ground cell
+  const float inverse = 1.0f / std::max(cell_size, voxel_size_);
+  const auto cell = [inverse](const float value) {
+    return static_cast<int>(std::floor(value * inverse));
+  };
+  columns_.reset(voxels_.size());
+  column_min_.clear();
+  for (auto &voxel : voxels_) {
+    const int c = columns_.insert(
+        key(cell(voxel.centroid(0)), cell(voxel.centroid(1)), 0),
+        column_min_.size());
+    if (c == column_min_.size())
+      column_min_.push_back(voxel.min_z);
+    else
+      column_min_[c] = std::min(column_min_[c], voxel.min_z);
+  }
+
+  labels_.assign(voxels_.size(), 0);
+  for (int v = 0; v < voxels_.size(); ++v) {
+    const int x = cell(voxels_[v].centroid(0));
+    const int y = cell(voxels_[v].centroid(1));
+    float lowest = std::numeric_limits<float>::max();
+    for (int dx = -1; dx <= 1; ++dx) {
+      for (int dy = -1; dy <= 1; ++dy) {
+        const int c = columns_.find(key(x + dx, y + dy, 0));
+        if (c >= 0) lowest = std::min(lowest, column_min_[c]);
+      }
+    }
+    if (voxels_[v].centroid(2) - lowest < ground_thresh) labels_[v] = GROUND;
+  }
+}
+
+template <typename PointT>
+void VoxelSummary<PointT>::cluster(const float tolerance) {
+  const int reach = std::max(1, static_cast<int>(std::ceil(
+                                    tolerance / voxel_size_)));
+  const float tolerance2 = tolerance * tolerance;
+
+  // The obstacle voxels get their own, much smaller, index
+  parent_.resize(voxels_.size());
+  obstacles_.reset(voxels_.size() - std::count(labels_.begin(), labels_.end(),
+                                               static_cast<int>(GROUND)));
+  for (int v = 0; v < voxels_.size(); ++v) {
+    parent_[v] = v;
+    if (labels_[v] != GROUND) obstacles_.insert(voxels_[v].key, v);
+  }
+
+  // Every pair is visited once, from the voxel with the larger cell. The
+  // cells too far from the centroid for any of their points to be close to
+  // it are not looked up.
+  std::vector<float> gaps(3 * (2 * reach + 1));
+  for (int v = 0; v < voxels_.size(); ++v) {
+    if (labels_[v] == GROUND) continue;
+    const Voxel &voxel = voxels_[v];
+    const int cell[3] = {voxel.x, voxel.y, voxel.z};
+    float *gap[3];
+    for (int axis = 0; axis < 3; ++axis) {
+      gap[axis] = &gaps[axis * (2 * reach + 1) + reach];
+      const float low = voxel.centroid(axis) - cell[axis] * voxel_size_;
+      const float high = voxel_size_ - low;
+      for (int d = 1; d <= reach; ++d) {
+        const float below = low + (d - 1) * voxel_size_;
+        const float above = high + (d - 1) * voxel_size_;
+        gap[axis][-d] = below * below;
+        gap[axis][d] = above * above;
+      }
+      gap[axis][0] = 0.0f;
+    }
+    for (int dx = -reach; dx <= 0; ++dx) {
+      for (int dy = -reach; dy <= (dx < 0 ? reach : 0); ++dy) {
+        if (gap[0][dx] + gap[1][dy] > tolerance2) continue;
+        for (int dz = -reach; dz <= (dx < 0 || dy < 0 ? reach : -1); ++dz) {
+          if (gap[0][dx] + gap[1][dy] + gap[2][dz] > tolerance2) continue;
+          const int other =
+              obstacles_.find(key(voxel.x + dx, voxel.y + dy, voxel.z + dz));
+          if (other < 0 ||
+              (voxels_[other].centroid - voxel.centroid).squaredNorm() >
+                  tolerance2)
+            continue;
+          const int a = root(v), b = root(other);
+          parent_[std::max(a, b)] = std::min(a, b);
+        }
+      }
+    }
+  }
+
+  std::vector<int> component(voxels_.size(), -1);
+  num_components_ = 0;
+  for (int v = 0; v < voxels_.size(); ++v) {
+    if (labels_[v] == GROUND) continue;
+    const int r = root(v);
+    if (component[r] < 0) component[r] = num_components_++;
+    labels_[v] = component[r];
+  }
+}
+
+}  // namespace lidar_obstacle_detector
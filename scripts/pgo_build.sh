@@ -0,0 +1,21 @@
+#!/bin/bash
+# Profile-guided release build of the package: an instrumented build, the
+# training workload, then the optimised build in the same directory.
+# Usage: scripts/pgo_build.sh [build dir] [extra cmake arguments...]
+# e.g.   scripts/pgo_build.sh build_pgo -DPGO_TRAINING_PCD=$HOME/frames
+set -e
+
+SOURCE_DIR=$(cd "$(dirname "$0")/.." && pwd)
+BUILD_DIR=$(realpath -m "${1:-$SOURCE_DIR/build_pgo}")
+shift || true
+JOBS=$(nproc)
+
+cmake -S "$SOURCE_DIR" -B "$BUILD_DIR" -DCMAKE_BUILD_TYPE=Release -DPGO=GENERATE "$@"
+cmake --build "$BUILD_DIR" -j "$JOBS"
+cmake --build "$BUILD_DIR" --target pgo_training
+
+# New compile flags, every object is rebuilt with the profile
+cmake -S "$SOURCE_DIR" -B "$BUILD_DIR" -DPGO=USE
+cmake --build "$BUILD_DIR" -j "$JOBS"
+
+echo "PGO build ready, source $BUILD_DIR/devel/setup.bash to use it"
@@ -0,0 +1,303 @@
+/* auto_tuner.cpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Offline latency-budgeted parameter tuner over replayed frames
+
+**/
+
+#include <pcl/point_types.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lidar_obstacle_detector/replay.hpp"
+
+namespace lidar_obstacle_detector {
+
+// Centre distance below which a detection matches a reference object
+const float MATCH_DISTANCE = 1.0f;
+
+struct TuningResult {
+  PipelineParams params;
+  StageTimings p50;
+  StageTimings p99;
+  float precision = 0.0f;
+  float recall = 0.0f;
+  float continuity = 0.0f;  // share of reference links keeping the same id
+  float quality = 0.0f;
+  bool pareto = false;
+  // Total p99 (ms) of a re-timing with no other replay, -1 if not re-timed.
+  // The other latencies are all measured under the load of the workers.
+  double p99_alone = -1.0;
+};
+
+double percentile(std::vector<double> values, const double p) {
+  if (values.empty()) return 0.0;
+  const size_t n = std::min(values.size() - 1,
+                            static_cast<size_t>(p * values.size()));
+  std::nth_element(values.begin(), values.begin() + n, values.end());
+  return values[n];
+}
+
+StageTimings percentile(const std::vector<StageTimings> &timings,
+                        const double p) {
+  std::vector<double> filter, segment, cluster, boxes, tracking, total;
+  for (auto &t : timings) {
+    filter.push_back(t.filter);
+    segment.push_back(t.segment);
+    cluster.push_back(t.cluster);
+    boxes.push_back(t.boxes);
+    tracking.push_back(t.tracking);
+    total.push_back(t.total);
+  }
+  StageTimings result;
+  result.filter = percentile(filter, p);
+  result.segment = percentile(segment, p);
+  result.cluster = percentile(cluster, p);
+  result.boxes = percentile(boxes, p);
+  result.tracking = percentile(tracking, p);
+  result.total = percentile(total, p);
+  return result;
+}
+
+// Replay all the frames with one configuration and score it against the
+// reference objects
+TuningResult evaluate(
+    const PipelineParams &params,
+    const std::vector<pcl::PointCloud<pcl::PointXYZ>::ConstPtr> &frames,
+    const std::vector<ReferenceObject> &reference) {
+  ReplayPipeline<pcl::PointXYZ> pipeline(params);
+  std::vector<StageTimings> timings(frames.size());
+  std::vector<std::vector<Box>> detections(frames.size());
+  for (size_t f = 0; f < frames.size(); ++f)
+    detections[f] = pipeline.process(frames[f], &timings[f]);
+
+  // Greedy nearest matching of every reference object to a detection
+  int true_positives = 0, detected = 0;
+  std::vector<int> matched_id(reference.size(), -1);
+  for (size_t f = 0; f < frames.size(); ++f) {
+    detected += detections[f].size();
+    std::vector<bool> taken(detections[f].size(), false);
+    for (size_t r = 0; r < reference.size(); ++r) {
+      if (reference[r].frame != static_cast<int>(f)) continue;
+      int best = -1;
+      float best_dis = MATCH_DISTANCE;
+      for (size_t d = 0; d < detections[f].size(); ++d) {
+        const float dis =
+            (detections[f][d].position - reference[r].position).norm();
+        if (!taken[d] && dis < best_dis) {
+          best_dis = dis;
+          best = d;
+        }
+      }
+      if (best == -1) continue;
+      taken[best] = true;
+      matched_id[r] = detections[f][best].id;
+      true_positives++;
+    }
+  }
+
+  // A reference object seen in two consecutive frames should keep its id
+  int links = 0, kept = 0;
+  for (size_t a = 0; a < reference.size(); ++a) {
+    for (size_t b = 0; b < reference.size(); ++b) {
+      if (reference[b].id != reference[a].id ||
+          reference[b].frame != reference[a].frame + 1)
+        continue;
+      if (matched_id[a] == -1 || matched_id[b] == -1) continue;
+      links++;
+      if (matched_id[a] == matched_id[b]) kept++;
+    }
+  }
+
+  TuningResult result;
+  result.params = params;
+  result.p50 = percentile(timings, 0.5);
+  result.p99 = percentile(timings, 0.99);
+  result.precision = detected > 0 ? true_positives / float(detected) : 0.0f;
+  result.recall =
+      reference.empty() ? 0.0f : true_positives / float(reference.size());
+  result.continuity = links > 0 ? kept / float(links) : 0.0f;
+  const float f1 =
+      result.precision + result.recall > 0.0f
+          ? 2 * result.precision * result.recall /
+                (result.precision + result.recall)
+          : 0.0f;
+  result.quality = 0.7f * f1 + 0.3f * result.continuity;
+  return result;
+}
+
+// Without ground truth, the output of the finest configuration is the
+// reference the cheaper ones are compared with
+std::vector<ReferenceObject> referenceFromReplay(
+    const std::vector<pcl::PointCloud<pcl::PointXYZ>::ConstPtr> &frames) {
+  PipelineParams params;
+  params.voxel_grid_size = 0.1f;
+  params.ransac_iterations = 100;
+
+  std::vector<ReferenceObject> reference;
+  ReplayPipeline<pcl::PointXYZ> pipeline(params);
+  for (size_t f = 0; f < frames.size(); ++f) {
+    for (auto &box : pipeline.process(frames[f], nullptr))
+      reference.push_back({static_cast<int>(f), box.id, box.position});
+  }
+  return reference;
+}
+
+// Over the latencies of the sweep, which were all measured under the same
+// load
+void markParetoFront(std::vector<TuningResult> *results) {
+  for (auto &a : *results) {
+    a.pareto = std::none_of(
+        results->begin(), results->end(), [&a](const TuningResult &b) {
+          return b.p99.total <= a.p99.total && b.quality >= a.quality &&
+                 (b.p99.total < a.p99.total || b.quality > a.quality);
+        });
+  }
+}
+
+void writeResults(const std::vector<TuningResult> &results,
+                  const std::string &file) {
+  std::ofstream out(file);
+  out << "voxel_grid_size,cluster_threshold,ransac_iterations,use_pca_box,"
+         "p50_total_ms,p99_total_ms,p99_filter_ms,p99_segment_ms,"
+         "p99_cluster_ms,p99_boxes_ms,p99_tracking_ms,precision,recall,"
+         "continuity,quality,pareto,p99_alone_total_ms\n";
+  for (auto &r : results) {
+    out << r.params.voxel_grid_size << "," << r.params.cluster_thresh << ","
+        << r.params.ransac_iterations << "," << r.params.use_pca_box << ","
+        << r.p50.total << "," << r.p99.total << "," << r.p99.filter << ","
+        << r.p99.segment << "," << r.p99.cluster << "," << r.p99.boxes << ","
+        << r.p99.tracking << "," << r.precision << "," << r.recall << ","
+        << r.continuity << "," << r.quality << "," << r.pareto << ",";
+    if (r.p99_alone >= 0.0) out << r.p99_alone;
+    out << "\n";
+  }
+}
+
+}  // namespace lidar_obstacle_detector
+
+int main(int argc, char **argv) {
+  using namespace lidar_obstacle_detector;
+
+  if (argc < 2) {
+    std::cerr << "Usage: auto_tuner <pcd_directory> [budget_ms] [threads] "
+                 "[output_csv] [reference_csv]"
+              << std::endl;
+    return 1;
+  }
+  const std::string directory = argv[1];
+  const double budget_ms = argc > 2 ? std::atof(argv[2]) : 50.0;
+  const int num_threads =
+      argc > 3 ? std::atoi(argv[3])
+               : std::max(1u, std::thread::hardware_concurrency() / 2);
+  const std::string output = argc > 4 ? argv[4] : "auto_tuner.csv";
+
+  const auto frames = loadPCDFrames<pcl::PointXYZ>(directory);
+  if (frames.empty()) {
+    std::cerr << "No frames found in " << directory << std::endl;
+    return 1;
+  }
+  const auto reference =
+      argc > 5 ? loadReferenceObjects(argv[5]) : referenceFromReplay(frames);
+  std::cout << "Replaying " << frames.size() << " frames against "
+            << reference.size() << " reference objects" << std::endl;
+
+  // The parameter space
+  std::vector<PipelineParams> space;
+  for (float voxel_grid_size : {0.1f, 0.15f, 0.2f, 0.3f, 0.4f}) {
+    for (float cluster_thresh : {0.4f, 0.6f, 0.8f, 1.0f}) {
+      for (int ransac_iterations : {15, 30, 60}) {
+        for (bool use_pca_box : {false, true}) {
+          PipelineParams params;
+          params.voxel_grid_size = voxel_grid_size;
+          params.cluster_thresh = cluster_thresh;
+          params.ransac_iterations = ransac_iterations;
+          params.use_pca_box = use_pca_box;
+          space.push_back(params);
+        }
+      }
+    }
+  }
+
+  // Every worker pulls the next configuration until the space is exhausted
+  std::vector<TuningResult> results(space.size());
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> workers;
+  for (int t = 0; t < num_threads; ++t) {
+    workers.emplace_back([&]() {
+      for (size_t i = next++; i < space.size(); i = next++)
+        results[i] = evaluate(space[i], frames, reference);
+    });
+  }
+  for (auto &worker : workers) worker.join();
+
+  // The latencies above are inflated by the other workers, evenly enough to
+  // compare the configurations with each other but not with the budget.
+  // Re-time the configurations alone, best quality first, until one meets
+  // the budget: that one is recommended.
+  std::vector<size_t> by_quality(results.size());
+  for (size_t i = 0; i < results.size(); ++i) {
+    by_quality[i] = i;
+    if (num_threads == 1) results[i].p99_alone = results[i].p99.total;
+  }
+  std::stable_sort(by_quality.begin(), by_quality.end(),
+                   [&results](const size_t a, const size_t b) {
+                     return results[a].quality > results[b].quality;
+                   });
+  const TuningResult *recommended = nullptr;
+  for (size_t i : by_quality) {
+    if (results[i].p99_alone < 0.0)
+      results[i].p99_alone = evaluate(space[i], frames, reference).p99.total;
+    if (results[i].p99_alone <= budget_ms) {
+      recommended = &results[i];
+      break;
+    }
+  }
+
+  markParetoFront(&results);
+  writeResults(results, output);
+
+  std::cout << "Pareto front (p99 latency"
+            << (num_threads > 1 ? " under the load of all the workers" : "")
+            << " vs quality):" << std::endl;
+  for (auto &r : results) {
+    if (r.pareto)
+      std::cout << std::fixed << std::setprecision(3) << "  p99 "
+                << r.p99.total << " ms, quality " << r.quality
+                << " (voxel_grid_size " << r.params.voxel_grid_size
+                << ", cluster_threshold " << r.params.cluster_thresh
+                << ", ransac_iterations " << r.params.ransac_iterations
+                << ", use_pca_box " << r.params.use_pca_box << ")"
+                << std::endl;
+  }
+
+  if (!recommended) {
+    std::cout << "No configuration meets the p99 budget of " << budget_ms
+              << " ms" << std::endl;
+    return 2;
+  }
+  std::cout << "Recommended configuration for a p99 budget of " << budget_ms
+            << " ms (p99 " << recommended->p99_alone << " ms alone):"
+            << std::endl
+            << "voxel_grid_size: " << recommended->params.voxel_grid_size
+            << std::endl
+            << "cluster_threshold: " << recommended->params.cluster_thresh
+            << std::endl
+            << "use_pca_box: "
+            << (recommended->params.use_pca_box ? "true" : "false")
+            << std::endl
+            << "ransac_iterations: " << recommended->params.ransac_iterations
+            << std::endl;
+  std::cout << "All results written to " << output << std::endl;
+
+  return 0;
+}
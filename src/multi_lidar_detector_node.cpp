@@ -0,0 +1,328 @@
+/* multi_lidar_detector_node.cpp
+
+ * Copyright (C) 2021 SS47816
+
+ * ROS Node running one detector per LiDAR and fusing them at object level
+
+**/
+
+#include <autoware_msgs/DetectedObjectArray.h>
+#include <dynamic_reconfigure/server.h>
+#include <jsk_recognition_msgs/BoundingBox.h>
+#include <jsk_recognition_msgs/BoundingBoxArray.h>
+#include <lidar_obstacle_detector/obstacle_detectorConfig.h>
+#include <pcl_conversions/pcl_conversions.h>
+#include <pcl_ros/point_cloud.h>
+#include <ros/console.h>
+#include <ros/ros.h>
+#include <tf2_ros/transform_listener.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "lidar_obstacle_detector/asset_reloader.hpp"
+#include "lidar_obstacle_detector/dual_return.hpp"
+#include "lidar_obstacle_detector/object_fusion.hpp"
+#include "lidar_obstacle_detector/object_messages.hpp"
+#include "lidar_obstacle_detector/obstacle_detector.hpp"
+#include "lidar_obstacle_detector/replay.hpp"
+
+namespace lidar_obstacle_detector {
+
+// Detection parameters, shared by the detectors of all the sensors
+PipelineParams PARAMS;
+std::mutex PARAMS_MUTEX;
+
+// Dynamic parameter server callback function
+void dynamicParamCallback(
+    const lidar_obstacle_detector::obstacle_detectorConfig &config,
+    uint32_t level) {
+  std::lock_guard<std::mutex> lock(PARAMS_MUTEX);
+  PARAMS.num_threads = config.num_threads;
+  PARAMS.use_pca_box = config.use_pca_box;
+  PARAMS.use_tracking = config.use_tracking;
+  PARAMS.voxel_grid_size = config.voxel_grid_size;
+  PARAMS.roi_max =
+      Eigen::Vector4f(config.roi_max_x, config.roi_max_y, config.roi_max_z, 1);
+  PARAMS.roi_min =
+      Eigen::Vector4f(config.roi_min_x, config.roi_min_y, config.roi_min_z, 1);
+  PARAMS.ground_thresh = config.ground_threshold;
+  PARAMS.ransac_iterations = config.ransac_iterations;
+  PARAMS.cluster_thresh = config.cluster_threshold;
+  PARAMS.cluster_max_size = config.cluster_max_size;
+  PARAMS.cluster_min_size = config.cluster_min_size;
+  PARAMS.displacement_thresh = config.displacement_threshold;
+  PARAMS.iou_thresh = config.iou_threshold;
+  PARAMS.deterministic = config.deterministic;
+  PARAMS.detection_mode = config.detection_mode;
+  PARAMS.range_image.rings = config.range_image_rings;
+  PARAMS.range_image.columns = config.range_image_columns;
+  PARAMS.range_image.min_elevation = config.range_image_min_elevation;
+  PARAMS.range_image.max_elevation = config.range_image_max_elevation;
+  PARAMS.range_image.sensor_height = config.sensor_height;
+  PARAMS.range_image.ground_angle = config.ground_angle;
+  PARAMS.scan_line_run.segments = config.gpf_segments;
+  PARAMS.scan_line_run.iterations = config.gpf_iterations;
+  PARAMS.scan_line_run.seed_count = config.gpf_seed_count;
+  PARAMS.scan_line_run.seed_thresh = config.gpf_seed_threshold;
+  PARAMS.scan_line_run.merge_thresh = config.slr_merge_threshold;
+  PARAMS.ground_cell_size = config.ground_cell_size;
+  PARAMS.dual_return_epsilon = config.dual_return_epsilon;
+}
+
+class MultiLidarDetectorNode {
+ public:
+  MultiLidarDetectorNode();
+  virtual ~MultiLidarDetectorNode() {}
+
+  int numSensors() const { return sensors_.size(); }
+
+ private:
+  // One detector per sensor. The callbacks of different sensors run in
+  // parallel and only share the latest boxes, under the sensor's mutex.
+  struct Sensor {
+    ros::Subscriber subscriber;
+    ObstacleDetector<pcl::PointXYZ> detector;
+    DualReturnFilter dual_return_filter;
+    std::unique_ptr<AssetReloader> asset_reloader;
+    std::mutex mutex;
+    std::vector<Box> boxes;  // in the sensor frame
+    Eigen::Affine3f to_target;
+    ros::Time stamp;
+    bool valid = false;
+  };
+  std::vector<std::unique_ptr<Sensor>> sensors_;
+
+  // Fusion and tracking state, only used from the first sensor's callback
+  int obstacle_id_;
+  std::vector<Box> prev_boxes_;
+  ObstacleDetector<pcl::PointXYZ> tracker_;
+  ObjectFusion fusion_;
+  ObjectMessages object_messages_;  // reused from frame to frame
+  double max_sensor_delay_;
+  std::string bbox_target_frame_;
+
+  ros::NodeHandle nh;
+  tf2_ros::Buffer tf2_buffer;
+  tf2_ros::TransformListener tf2_listener;
+  dynamic_reconfigure::Server<lidar_obstacle_detector::obstacle_detectorConfig>
+      server;
+  dynamic_reconfigure::Server<
+      lidar_obstacle_detector::obstacle_detectorConfig>::CallbackType f;
+
+  ros::Publisher pub_jsk_bboxes;
+  ros::Publisher pub_autoware_objects;
+
+  void lidarPointsCallback(
+      const sensor_msgs::PointCloud2::ConstPtr &lidar_points,
+      const int sensor);
+  void fuseAndPublish(const std_msgs::Header &header);
+};
+
+MultiLidarDetectorNode::MultiLidarDetectorNode() : tf2_listener(tf2_buffer) {
+  ros::NodeHandle private_nh("~");
+
+  std::vector<std::string> lidar_points_topics;
+  std::string jsk_bboxes_topic;
+  std::string autoware_objects_topic;
+
+  ROS_ASSERT(private_nh.getParam("lidar_points_topics", lidar_points_topics));
+  ROS_ASSERT(private_nh.getParam("jsk_bboxes_topic", jsk_bboxes_topic));
+  ROS_ASSERT(
+      private_nh.getParam("autoware_objects_topic", autoware_objects_topic));
+  ROS_ASSERT(private_nh.getParam("bbox_target_frame", bbox_target_frame_));
+  ROS_ASSERT(!lidar_points_topics.empty());
+
+  // The other sensors' boxes are fused with the first sensor's frames if
+  // they are at most max_sensor_delay seconds apart
+  FusionParams fusion_params;
+  private_nh.param("max_sensor_delay", max_sensor_delay_, 0.1);
+  private_nh.param("fusion_cell_size", fusion_params.cell_size, 2.0f);
+  private_nh.param("fusion_merge_distance", fusion_params.merge_distance,
+                   0.5f);
+  private_nh.param("fusion_merge_overlap", fusion_params.merge_overlap, 0.1f);
+  fusion_ = ObjectFusion(fusion_params);
+
+  // Optional assets file per sensor, in the order of the topics, since the
+  // exclusion boxes and the mask are in the sensor frame. An empty path, or
+  // a missing entry, keeps the default assets.
+  std::vector<std::string> assets_files;
+  double assets_poll_period;
+  private_nh.param("assets_files", assets_files, std::vector<std::string>());
+  private_nh.param("assets_poll_period", assets_poll_period, 1.0);
+
+  pub_jsk_bboxes =
+      nh.advertise<jsk_recognition_msgs::BoundingBoxArray>(jsk_bboxes_topic, 1);
+  pub_autoware_objects = nh.advertise<autoware_msgs::DetectedObjectArray>(
+      autoware_objects_topic, 1);
+
+  // Dynamic Parameter Server & Function
+  f = boost::bind(&dynamicParamCallback, _1, _2);
+  server.setCallback(f);
+
+  obstacle_id_ = 0;
+  for (int i = 0; i < lidar_points_topics.size(); ++i) {
+    sensors_.emplace_back(new Sensor);
+    if (i < assets_files.size() && !assets_files[i].empty()) {
+      sensors_.back()->asset_reloader.reset(new AssetReloader(
+          assets_files[i], assets_poll_period,
+          [](const std::string &message, const bool error) {
+            if (error)
+              ROS_ERROR("%s", message.c_str());
+            else
+              ROS_INFO("%s", message.c_str());
+          }));
+    }
+    sensors_.back()->subscriber = nh.subscribe<sensor_msgs::PointCloud2>(
+        lidar_points_topics[i], 1,
+        [this, i](const sensor_msgs::PointCloud2::ConstPtr &lidar_points) {
+          lidarPointsCallback(lidar_points, i);
+        });
+  }
+}
+
+void MultiLidarDetectorNode::lidarPointsCallback(
+    const sensor_msgs::PointCloud2::ConstPtr &lidar_points, const int sensor) {
+  const auto start_time = std::chrono::steady_clock::now();
+  PipelineParams params;
+  {
+    std::lock_guard<std::mutex> lock(PARAMS_MUTEX);
+    params = PARAMS;
+  }
+
+  pcl::PointCloud<pcl::PointXYZ>::Ptr raw_cloud(
+      new pcl::PointCloud<pcl::PointXYZ>);
+  Sensor &current = *sensors_[sensor];
+  if (params.dual_return_epsilon > 0)
+    current.dual_return_filter.convert(
+        *lidar_points, params.dual_return_epsilon, raw_cloud.get());
+  else
+    pcl::fromROSMsg(*lidar_points, *raw_cloud);
+
+  // Detect in the sensor frame, the ids are given after fusion
+  current.detector.setNumThreads(params.num_threads);
+  current.detector.setDeterministic(params.deterministic);
+  if (current.asset_reloader)
+    current.detector.setAssets(current.asset_reloader->current());
+  std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr> cloud_clusters;
+  std::pair<pcl::PointCloud<pcl::PointXYZ>::Ptr,
+            pcl::PointCloud<pcl::PointXYZ>::Ptr>
+      segmented_clouds;
+  if (params.detection_mode == DETECTION_RANGE_IMAGE) {
+    cloud_clusters = current.detector.rangeImageDetection(
+        raw_cloud, params.roi_min, params.roi_max, params.range_image,
+        params.ground_thresh, params.cluster_thresh, params.cluster_min_size,
+        params.cluster_max_size, &segmented_clouds);
+  } else if (params.detection_mode == DETECTION_SCAN_LINE_RUN) {
+    cloud_clusters = current.detector.scanLineRunDetection(
+        raw_cloud, params.roi_min, params.roi_max, params.range_image,
+        params.scan_line_run, params.ground_thresh, params.cluster_thresh,
+        params.cluster_min_size, params.cluster_max_size, &segmented_clouds);
+  } else if (params.detection_mode == DETECTION_VOXEL_GRID) {
+    cloud_clusters = current.detector.voxelGridDetection(
+        raw_cloud, params.voxel_grid_size, params.roi_min, params.roi_max,
+        params.ground_thresh, params.ground_cell_size, params.cluster_thresh,
+        params.cluster_min_size, params.cluster_max_size, &segmented_clouds);
+  } else {
+    auto filtered_cloud = current.detector.filterCloud(
+        raw_cloud, params.voxel_grid_size, params.roi_min, params.roi_max);
+    segmented_clouds = current.detector.segmentPlane(
+        filtered_cloud, params.ransac_iterations, params.ground_thresh);
+    cloud_clusters = current.detector.clustering(
+        segmented_clouds.first, params.cluster_thresh,
+        params.cluster_min_size, params.cluster_max_size);
+  }
+  auto boxes =
+      current.detector.fitBoxes(cloud_clusters, params.use_pca_box, 0);
+
+  geometry_msgs::TransformStamped transform_stamped;
+  try {
+    transform_stamped = tf2_buffer.lookupTransform(
+        bbox_target_frame_, lidar_points->header.frame_id, ros::Time(0));
+  } catch (tf2::TransformException &ex) {
+    ROS_WARN("%s", ex.what());
+    return;
+  }
+  const auto &t = transform_stamped.transform;
+  const Eigen::Affine3f to_target =
+      Eigen::Translation3f(t.translation.x, t.translation.y, t.translation.z) *
+      Eigen::Quaternionf(t.rotation.w, t.rotation.x, t.rotation.y,
+                         t.rotation.z);
+  const int num_boxes = boxes.size();
+  {
+    std::lock_guard<std::mutex> lock(current.mutex);
+    current.boxes.swap(boxes);
+    current.to_target = to_target;
+    current.stamp = lidar_points->header.stamp;
+    current.valid = true;
+  }
+
+  const auto end_time = std::chrono::steady_clock::now();
+  ROS_DEBUG("Sensor %d found %d boxes in %.3f second", sensor, num_boxes,
+            std::chrono::duration<double>(end_time - start_time).count());
+
+  // The first sensor drives the fused output
+  if (sensor == 0) fuseAndPublish(lidar_points->header);
+}
+
+void MultiLidarDetectorNode::fuseAndPublish(const std_msgs::Header &header) {
+  PipelineParams params;
+  {
+    std::lock_guard<std::mutex> lock(PARAMS_MUTEX);
+    params = PARAMS;
+  }
+
+  fusion_.clear();
+  int fused_sensors = 0;
+  for (auto &sensor : sensors_) {
+    std::lock_guard<std::mutex> lock(sensor->mutex);
+    if (!sensor->valid ||
+        std::abs((sensor->stamp - header.stamp).toSec()) > max_sensor_delay_)
+      continue;
+    fusion_.addSensor(sensor->boxes, sensor->to_target);
+    fused_sensors++;
+  }
+  auto curr_boxes = fusion_.fuse(obstacle_id_);
+  obstacle_id_ = advanceBoxId(obstacle_id_, curr_boxes.size());
+
+  // A single tracker over the fused objects
+  if (params.use_tracking)
+    tracker_.obstacleTracking(prev_boxes_, &curr_boxes,
+                              params.displacement_thresh, params.iou_thresh);
+
+  auto bbox_header = header;
+  bbox_header.frame_id = bbox_target_frame_;
+  object_messages_.reset(bbox_header, curr_boxes.size());
+  for (size_t i = 0; i < curr_boxes.size(); ++i) {
+    const Box &box = curr_boxes[i];
+    geometry_msgs::Pose pose;
+    pose.position.x = box.position(0);
+    pose.position.y = box.position(1);
+    pose.position.z = box.position(2);
+    pose.orientation.w = box.quaternion.w();
+    pose.orientation.x = box.quaternion.x();
+    pose.orientation.y = box.quaternion.y();
+    pose.orientation.z = box.quaternion.z();
+    object_messages_.set(i, box, pose, box.velocity);
+  }
+  pub_jsk_bboxes.publish(object_messages_.jsk());
+  pub_autoware_objects.publish(object_messages_.autoware());
+
+  ROS_INFO("The multi_lidar_detector_node fused %d sensors into %d obstacles",
+           fused_sensors, static_cast<int>(curr_boxes.size()));
+  prev_boxes_.swap(curr_boxes);
+}
+
+}  // namespace lidar_obstacle_detector
+
+int main(int argc, char **argv) {
+  ros::init(argc, argv, "multi_lidar_detector_node");
+  lidar_obstacle_detector::MultiLidarDetectorNode multi_lidar_detector_node;
+  // One thread per sensor, so that the sensors are processed in parallel
+  ros::AsyncSpinner spinner(multi_lidar_detector_node.numSensors());
+  spinner.start();
+  ros::waitForShutdown();
+  return 0;
+}
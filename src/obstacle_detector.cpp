@@ -0,0 +1,15 @@
+/* obstacle_detector.cpp
+
+ * Copyright (C) 2021 SS47816
+
+ * The detection pipeline for the point type of the nodes and the tools
+
+**/
+
+#include "lidar_obstacle_detector/obstacle_detector.hpp"
+
+namespace lidar_obstacle_detector {
+
+template class ObstacleDetector<pcl::PointXYZ>;
+
+}  // namespace lidar_obstacle_detector
@@ -7,31 +7,85 @@
 **/
 
 #include <autoware_msgs/DetectedObjectArray.h>
+#include <boost/make_shared.hpp>
 #include <dynamic_reconfigure/server.h>
 #include <geometry_msgs/PoseStamped.h>
 #include <jsk_recognition_msgs/BoundingBox.h>
 #include <jsk_recognition_msgs/BoundingBoxArray.h>
 #include <lidar_obstacle_detector/obstacle_detectorConfig.h>
 #include <pcl_conversions/pcl_conversions.h>
+#include <pcl_msgs/ModelCoefficients.h>
 #include <pcl_ros/point_cloud.h>
+#include <ros/callback_queue.h>
+#include <ros/callback_queue_interface.h>
 #include <ros/console.h>
 #include <ros/ros.h>
 #include <tf2_geometry_msgs/tf2_geometry_msgs.h>
 #include <tf2_ros/transform_listener.h>
 
+#include "lidar_obstacle_detector/asset_reloader.hpp"
+#include "lidar_obstacle_detector/cloud_transform.hpp"
+#include "lidar_obstacle_detector/debug_clouds.hpp"
+#include "lidar_obstacle_detector/dual_return.hpp"
+#include "lidar_obstacle_detector/huge_page_buffer.hpp"
+#include "lidar_obstacle_detector/latest_job_worker.hpp"
+#include "lidar_obstacle_detector/metrics.hpp"
+#include "lidar_obstacle_detector/motion_segmentation.hpp"
+#include "lidar_obstacle_detector/object_fusion.hpp"
+#include "lidar_obstacle_detector/object_messages.hpp"
+#include "lidar_obstacle_detector/object_predictor.hpp"
 #include "lidar_obstacle_detector/obstacle_detector.hpp"
+#include "lidar_obstacle_detector/packet_source.hpp"
+#include "lidar_obstacle_detector/shape_model.hpp"
+#include "lidar_obstacle_detector/simd_kernels.hpp"
 
 namespace lidar_obstacle_detector {
 
 // Pointcloud Filtering Parameters
 bool USE_PCA_BOX;
 bool USE_TRACKING;
+int NUM_THREADS;
+int NUM_SECTORS;
+float SECTOR_OVERLAP;
+bool DETERMINISTIC;
+int DETECTION_MODE;
+RangeImageParams RANGE_IMAGE_PARAMS;
+ScanLineRunParams SCAN_LINE_RUN_PARAMS;
+float GROUND_CELL_SIZE;
+float DUAL_RETURN_EPSILON;
+float DEBUG_CLOUD_RATE;
+int DEBUG_CLOUD_MAX_POINTS;
+bool DEBUG_CLOUDS_ASYNC;
+int GROUND_OUTPUT;
+float GROUND_GRID_SIZE;
 float VOXEL_GRID_SIZE;
 Eigen::Vector4f ROI_MAX_POINT, ROI_MIN_POINT;
 float GROUND_THRESH;
+int RANSAC_ITERATIONS;
 float CLUSTER_THRESH;
 int CLUSTER_MAX_SIZE, CLUSTER_MIN_SIZE;
 float DISPLACEMENT_THRESH, IOU_THRESH;
+bool USE_JPDA;
+JPDAParams JPDA_PARAMS;
+bool USE_SHAPE_MODEL;
+bool USE_MOTION_SEGMENTATION;
+bool USE_VELOCITY;
+VelocityParams VELOCITY_PARAMS;
+MotionParams MOTION_PARAMS;
+
+// Runs a function on the thread that spins the queue it is added to
+class FunctionCallback : public ros::CallbackInterface {
+ public:
+  explicit FunctionCallback(const std::function<void()> &function)
+      : function_(function) {}
+  CallResult call() override {
+    function_();
+    return Success;
+  }
+
+ private:
+  const std::function<void()> function_;
+};
 
 class ObstacleDetectorNode {
  public:
@@ -39,10 +93,54 @@ class ObstacleDetectorNode {
   virtual ~ObstacleDetectorNode() {}
 
  private:
-  size_t obstacle_id_;
+  int obstacle_id_;
   std::string bbox_target_frame_, bbox_source_frame_;
+  bool clouds_in_target_frame_;
+  ros::Time last_debug_clouds_stamp_;
   std::vector<Box> prev_boxes_, curr_boxes_;
+  std::vector<Box> static_boxes_;
+  std::string fixed_frame_;
+  ros::Duration fixed_frame_timeout_;
+  OccupancyHistory<pcl::PointXYZ> occupancy_history_;
+  StaticTracker static_tracker_;
+  TrackPoints track_points_;
+  Eigen::Affine3f prev_to_fixed_;
+  bool prev_to_fixed_valid_ = false;
+  ros::Time last_objects_stamp_;
   std::shared_ptr<ObstacleDetector<pcl::PointXYZ>> obstacle_detector;
+  std::shared_ptr<ShapeModelPool> shape_models_;
+  std::unique_ptr<AssetReloader> asset_reloader_;
+  DualReturnFilter dual_return_filter_;
+
+  // Metrics, served in the OpenMetrics format if metrics_port is set
+  MetricsRegistry metrics_;
+  std::unique_ptr<MetricsServer> metrics_server_;
+  Counter *frames_processed_, *frames_dropped_, *dual_returns_dropped_,
+      *debug_clouds_skipped_;
+  Histogram *filter_latency_, *segment_latency_, *cluster_latency_,
+      *clouds_latency_, *boxes_latency_, *tracking_latency_,
+      *objects_latency_, *total_latency_, *sectors_latency_,
+      *range_image_latency_, *scan_line_run_latency_, *voxel_grid_latency_;
+  Histogram *clusters_per_frame_, *tracks_per_frame_,
+      *static_clusters_per_frame_;
+  Histogram *transport_latency_, *queue_latency_, *processing_latency_,
+      *publish_latency_, *end_to_end_latency_;
+  double publish_seconds_;
+
+  // The last scan decoded from the packets, waiting for the spinner
+  std::string packet_frame_id_;
+  std::mutex packet_scan_mutex_;
+  PacketScan packet_scan_ = {nullptr, 0.0, 0};
+  ros::Time packet_scan_receipt_;
+  uint32_t packet_seq_;
+
+  // The last cloud of the topic, waiting for the spinner. The subscriber
+  // has its own queue and spinner thread, which only take the clouds in, so
+  // that the clouds replaced before they were processed can be counted.
+  std::mutex topic_cloud_mutex_;
+  ros::MessageEvent<sensor_msgs::PointCloud2 const> topic_cloud_;
+  bool topic_cloud_queued_ = false;
+  ros::CallbackQueue topic_queue_;
 
   ros::NodeHandle nh;
   tf2_ros::Buffer tf2_buffer;
@@ -55,24 +153,43 @@ class ObstacleDetectorNode {
   ros::Subscriber sub_lidar_points;
   ros::Publisher pub_cloud_ground;
   ros::Publisher pub_cloud_clusters;
+  ros::Publisher pub_ground_plane;
   ros::Publisher pub_jsk_bboxes;
   ros::Publisher pub_autoware_objects;
+  ros::Publisher pub_predicted_objects;
+  // Output messages reused from frame to frame, the predicted ones are only
+  // filled by the predictor's thread
+  ObjectMessages object_messages_, predicted_messages_;
+  // Destroyed before the publishers, their threads publish
+  std::unique_ptr<ObjectPredictor> object_predictor_;
+  std::unique_ptr<LatestJobWorker> debug_cloud_worker_;
+  std::unique_ptr<PacketInput> packet_input_;
+  std::unique_ptr<ros::AsyncSpinner> topic_spinner_;
 
+  void queueTopicCloud(
+      const ros::MessageEvent<sensor_msgs::PointCloud2 const> &event);
+  void topicCloudCallback();
   void lidarPointsCallback(
-      const sensor_msgs::PointCloud2::ConstPtr &lidar_points);
+      const ros::MessageEvent<sensor_msgs::PointCloud2 const> &event);
+  void queuePacketScan(const PacketScan &scan);
+  void packetScanCallback();
+  void detect(const pcl::PointCloud<pcl::PointXYZ>::Ptr &raw_cloud,
+              const std_msgs::Header &pointcloud_header,
+              const ros::Time &receipt_time, const ros::Time &callback_time,
+              const std::chrono::steady_clock::time_point &start_time);
+  void registerMetrics();
+  bool debugCloudsDue(const std_msgs::Header &header);
   void publishClouds(
-      const std::pair<pcl::PointCloud<pcl::PointXYZ>::Ptr,
-                      pcl::PointCloud<pcl::PointXYZ>::Ptr> &&segmented_clouds,
-      const std_msgs::Header &header);
-  jsk_recognition_msgs::BoundingBox transformJskBbox(
-      const Box &box, const std_msgs::Header &header,
-      const geometry_msgs::Pose &pose_transformed);
-  autoware_msgs::DetectedObject transformAutowareObject(
-      const Box &box, const std_msgs::Header &header,
-      const geometry_msgs::Pose &pose_transformed);
+      const std::pair<pcl::PointCloud<pcl::PointXYZ>::ConstPtr,
+                      pcl::PointCloud<pcl::PointXYZ>::ConstPtr>
+          &segmented_clouds,
+      const std_msgs::Header &header, const DebugCloudParams &params);
   void publishDetectedObjects(
       std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr> &&cloud_clusters,
       const std_msgs::Header &header);
+  void publishPredictedObjects(const double stamp,
+                               const TrackSnapshot &snapshot,
+                               const std::vector<Box> &predicted);
 };
 
 // Dynamic parameter server callback function
@@ -82,17 +199,57 @@ void dynamicParamCallback(
   // Pointcloud Filtering Parameters
   USE_PCA_BOX = config.use_pca_box;
   USE_TRACKING = config.use_tracking;
+  NUM_THREADS = config.num_threads;
+  NUM_SECTORS = config.num_sectors;
+  SECTOR_OVERLAP = config.sector_overlap;
+  DETERMINISTIC = config.deterministic;
+  DETECTION_MODE = config.detection_mode;
+  RANGE_IMAGE_PARAMS.rings = config.range_image_rings;
+  RANGE_IMAGE_PARAMS.columns = config.range_image_columns;
+  RANGE_IMAGE_PARAMS.min_elevation = config.range_image_min_elevation;
+  RANGE_IMAGE_PARAMS.max_elevation = config.range_image_max_elevation;
+  RANGE_IMAGE_PARAMS.sensor_height = config.sensor_height;
+  RANGE_IMAGE_PARAMS.ground_angle = config.ground_angle;
+  SCAN_LINE_RUN_PARAMS.segments = config.gpf_segments;
+  SCAN_LINE_RUN_PARAMS.iterations = config.gpf_iterations;
+  SCAN_LINE_RUN_PARAMS.seed_count = config.gpf_seed_count;
+  SCAN_LINE_RUN_PARAMS.seed_thresh = config.gpf_seed_threshold;
+  SCAN_LINE_RUN_PARAMS.merge_thresh = config.slr_merge_threshold;
+  GROUND_CELL_SIZE = config.ground_cell_size;
+  DUAL_RETURN_EPSILON = config.dual_return_epsilon;
+  DEBUG_CLOUD_RATE = config.debug_cloud_rate;
+  DEBUG_CLOUD_MAX_POINTS = config.debug_cloud_max_points;
+  DEBUG_CLOUDS_ASYNC = config.debug_clouds_async;
+  GROUND_OUTPUT = config.ground_output;
+  GROUND_GRID_SIZE = config.ground_grid_size;
   VOXEL_GRID_SIZE = config.voxel_grid_size;
   ROI_MAX_POINT =
       Eigen::Vector4f(config.roi_max_x, config.roi_max_y, config.roi_max_z, 1);
   ROI_MIN_POINT =
       Eigen::Vector4f(config.roi_min_x, config.roi_min_y, config.roi_min_z, 1);
   GROUND_THRESH = config.ground_threshold;
+  RANSAC_ITERATIONS = config.ransac_iterations;
   CLUSTER_THRESH = config.cluster_threshold;
   CLUSTER_MAX_SIZE = config.cluster_max_size;
   CLUSTER_MIN_SIZE = config.cluster_min_size;
   DISPLACEMENT_THRESH = config.displacement_threshold;
   IOU_THRESH = config.iou_threshold;
+  USE_JPDA = config.use_jpda;
+  JPDA_PARAMS.detection_prob = config.jpda_detection_prob;
+  JPDA_PARAMS.clutter_density = config.jpda_clutter_density;
+  JPDA_PARAMS.gate_sigma = config.jpda_gate_sigma;
+  JPDA_PARAMS.max_hypotheses = config.jpda_max_hypotheses;
+  USE_SHAPE_MODEL = config.use_shape_model;
+  USE_MOTION_SEGMENTATION = config.use_motion_segmentation;
+  MOTION_PARAMS.voxel_size = config.motion_voxel_size;
+  MOTION_PARAMS.history_frames = config.motion_history_frames;
+  MOTION_PARAMS.static_hits = config.motion_static_hits;
+  MOTION_PARAMS.static_ratio = config.motion_static_ratio;
+  MOTION_PARAMS.hold_frames = config.motion_hold_frames;
+  MOTION_PARAMS.static_missed_frames = config.motion_static_missed_frames;
+  USE_VELOCITY = config.use_velocity;
+  VELOCITY_PARAMS.max_iterations = config.icp_iterations;
+  VELOCITY_PARAMS.max_correspondence = config.icp_max_correspondence;
 }
 
 ObstacleDetectorNode::ObstacleDetectorNode() : tf2_listener(tf2_buffer) {
@@ -112,134 +269,670 @@ ObstacleDetectorNode::ObstacleDetectorNode() : tf2_listener(tf2_buffer) {
       private_nh.getParam("autoware_objects_topic", autoware_objects_topic));
   ROS_ASSERT(private_nh.getParam("bbox_target_frame", bbox_target_frame_));
 
-  sub_lidar_points = nh.subscribe(
-      lidar_points_topic, 1, &ObstacleDetectorNode::lidarPointsCallback, this);
+  // Only published when the ground_output dynamic parameter is "plane"
+  std::string ground_plane_topic;
+  private_nh.param<std::string>("ground_plane_topic", ground_plane_topic,
+                                cloud_ground_topic + "_plane");
+
+  int shape_model_slots;
+  ShapeModelParams shape_model_params;
+  private_nh.param("shape_model_slots", shape_model_slots, 256);
+  private_nh.param("shape_model_voxel_size", shape_model_params.voxel_size,
+                   0.1f);
+  private_nh.param("shape_model_max_voxels", shape_model_params.max_voxels,
+                   512);
+  private_nh.param("shape_model_max_age", shape_model_params.max_age, 20);
+
+  // Objects predicted to the current time between the scans, at
+  // prediction_rate Hz (0 disables them), from the velocities of the tracks
+  std::string predicted_objects_topic;
+  double prediction_rate, prediction_max_horizon;
+  private_nh.param<std::string>("predicted_objects_topic",
+                                predicted_objects_topic,
+                                autoware_objects_topic + "_predicted");
+  private_nh.param("prediction_rate", prediction_rate, 0.0);
+  private_nh.param("prediction_max_horizon", prediction_max_horizon, 0.5);
+
+  // World fixed frame of the motion segmentation's occupancy history, and
+  // how long to wait for its transform at the time of a scan
+  double fixed_frame_timeout;
+  private_nh.param<std::string>("fixed_frame", fixed_frame_, "odom");
+  private_nh.param("fixed_frame_timeout", fixed_frame_timeout, 0.05);
+  fixed_frame_timeout_ = ros::Duration(fixed_frame_timeout);
+
+  // Publish the ground and obstacle clouds in bbox_target_frame as well
+  private_nh.param("clouds_in_target_frame", clouds_in_target_frame_, false);
+
+  int metrics_port;
+  private_nh.param("metrics_port", metrics_port, 0);
+
+  // Exclusion boxes and ROI mask, reloaded in the background when the file
+  // changes. Without a file only the car roof is excluded.
+  std::string assets_file;
+  double assets_poll_period;
+  private_nh.param<std::string>("assets_file", assets_file, "");
+  private_nh.param("assets_poll_period", assets_poll_period, 1.0);
+
+  // Backing of the large reusable buffers: "off", "thp" or "hugetlb"
+  std::string huge_pages;
+  private_nh.param<std::string>("huge_pages", huge_pages, "off");
+  setHugePageMode(parseHugePageMode(huge_pages));
+  if (hugePageMode() == HUGE_PAGES_THP && !transparentHugePagesEnabled())
+    ROS_WARN("Transparent huge pages are disabled, buffers may use 4 KB pages");
+
+  // Instruction set of the point kernels: "auto" (the best the CPU has),
+  // "scalar", "sse4.2", "avx2" or "avx512"
+  std::string simd_level;
+  private_nh.param<std::string>("simd_level", simd_level, "auto");
+  setSimdLevel(parseSimdLevel(simd_level));
+  ROS_INFO("Point kernels: %s", simdKernels().name);
+
+  // Raw packets decoded in the node instead of the clouds of a driver:
+  // packet_source is a pcap file or "udp", sensor_model "velodyne" (with the
+  // VeloView XML calibration) or "ouster" (with the sensor metadata JSON)
+  std::string packet_source, sensor_model, calibration_file;
+  int packet_port;
+  double packet_replay_rate;
+  private_nh.param<std::string>("packet_source", packet_source, "");
+  private_nh.param<std::string>("sensor_model", sensor_model, "velodyne");
+  private_nh.param<std::string>("calibration_file", calibration_file, "");
+  private_nh.param("packet_port", packet_port,
+                   sensor_model == "ouster" ? 7502 : 2368);
+  private_nh.param("packet_replay_rate", packet_replay_rate, 1.0);
+  private_nh.param<std::string>("packet_frame_id", packet_frame_id_,
+                                sensor_model == "ouster" ? "os_sensor"
+                                                         : "velodyne");
+  packet_seq_ = 0;
+
+  if (packet_source.empty()) {
+    ros::NodeHandle topic_nh;
+    topic_nh.setCallbackQueue(&topic_queue_);
+    sub_lidar_points = topic_nh.subscribe(
+        lidar_points_topic, 1, &ObstacleDetectorNode::queueTopicCloud, this);
+  }
   pub_cloud_ground =
       nh.advertise<sensor_msgs::PointCloud2>(cloud_ground_topic, 1);
   pub_cloud_clusters =
       nh.advertise<sensor_msgs::PointCloud2>(cloud_clusters_topic, 1);
+  pub_ground_plane =
+      nh.advertise<pcl_msgs::ModelCoefficients>(ground_plane_topic, 1);
   pub_jsk_bboxes =
       nh.advertise<jsk_recognition_msgs::BoundingBoxArray>(jsk_bboxes_topic, 1);
   pub_autoware_objects = nh.advertise<autoware_msgs::DetectedObjectArray>(
       autoware_objects_topic, 1);
+  if (prediction_rate > 0) {
+    pub_predicted_objects = nh.advertise<autoware_msgs::DetectedObjectArray>(
+        predicted_objects_topic, 1);
+    object_predictor_.reset(new ObjectPredictor(
+        prediction_rate, prediction_max_horizon,
+        [] { return ros::Time::now().toSec(); },
+        [this](const double stamp, const TrackSnapshot &snapshot,
+               const std::vector<Box> &predicted) {
+          publishPredictedObjects(stamp, snapshot, predicted);
+        }));
+  }
 
   // Dynamic Parameter Server & Function
   f = boost::bind(&dynamicParamCallback, _1, _2);
   server.setCallback(f);
+  if (object_predictor_ && !(USE_TRACKING && USE_VELOCITY))
+    ROS_WARN(
+        "prediction_rate is set without use_tracking and use_velocity: the "
+        "predicted objects only follow the ego motion");
+
+  // The debug clouds of debug_clouds_async, niced below the detection
+  debug_cloud_worker_.reset(new LatestJobWorker(10));
 
   // Create point processor
   obstacle_detector = std::make_shared<ObstacleDetector<pcl::PointXYZ>>();
   obstacle_id_ = 0;
+  if (!assets_file.empty()) {
+    asset_reloader_.reset(new AssetReloader(
+        assets_file, assets_poll_period,
+        [](const std::string &message, const bool error) {
+          if (error)
+            ROS_ERROR("%s", message.c_str());
+          else
+            ROS_INFO("%s", message.c_str());
+        }));
+  }
+
+  // Preallocate the shape models of all the tracks
+  shape_models_ =
+      std::make_shared<ShapeModelPool>(shape_model_slots, shape_model_params);
+
+  registerMetrics();
+  if (metrics_port > 0) {
+    metrics_server_.reset(new MetricsServer(metrics_, metrics_port));
+    ROS_INFO("Serving OpenMetrics on 127.0.0.1:%d/metrics", metrics_port);
+  }
+
+  // Started last, its thread hands the scans over to the spinner
+  if (!packet_source.empty()) {
+    std::string error;
+    auto decoder = loadPacketDecoder(sensor_model, calibration_file, &error);
+    auto source = decoder ? openPacketSource(packet_source, packet_port, &error)
+                          : nullptr;
+    if (!source) {
+      ROS_ERROR("Cannot read the lidar packets: %s", error.c_str());
+      ros::shutdown();
+      return;
+    }
+    packet_input_.reset(new PacketInput(
+        std::move(source), std::move(decoder), packet_replay_rate,
+        [this](const PacketScan &scan) { queuePacketScan(scan); }));
+    ROS_INFO("Decoding %s packets from %s, port %d", sensor_model.c_str(),
+             packet_source.c_str(), packet_port);
+  } else {
+    topic_spinner_.reset(new ros::AsyncSpinner(1, &topic_queue_));
+    topic_spinner_->start();
+  }
+}
+
+void ObstacleDetectorNode::registerMetrics() {
+  const std::string prefix = "lidar_obstacle_detector_";
+  const std::vector<double> latency_buckets = {
+      0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0};
+  const std::vector<double> count_buckets = {0,  1,   2,   5,   10,  20,
+                                             50, 100, 200, 500, 1000};
+
+  frames_processed_ =
+      metrics_.counter(prefix + "frames_processed", "Frames processed");
+  frames_dropped_ = metrics_.counter(
+      prefix + "frames_dropped",
+      "Input scans replaced in the queue before they were processed");
+  dual_returns_dropped_ = metrics_.counter(
+      prefix + "dual_returns_dropped",
+      "Second returns dropped as duplicates of the first return");
+  debug_clouds_skipped_ = metrics_.counter(
+      prefix + "debug_clouds_skipped",
+      "Debug clouds replaced by a newer frame before they were published");
+
+  const std::string latency_name = prefix + "stage_latency_seconds";
+  const std::string latency_help = "Latency of each pipeline stage";
+  filter_latency_ = metrics_.histogram(latency_name, latency_help,
+                                       latency_buckets, "stage=\"filter\"");
+  segment_latency_ = metrics_.histogram(latency_name, latency_help,
+                                        latency_buckets, "stage=\"segment\"");
+  cluster_latency_ = metrics_.histogram(latency_name, latency_help,
+                                        latency_buckets, "stage=\"cluster\"");
+  clouds_latency_ = metrics_.histogram(
+      latency_name, latency_help, latency_buckets, "stage=\"publish_clouds\"");
+  boxes_latency_ = metrics_.histogram(latency_name, latency_help,
+                                      latency_buckets, "stage=\"boxes\"");
+  tracking_latency_ = metrics_.histogram(
+      latency_name, latency_help, latency_buckets, "stage=\"tracking\"");
+  objects_latency_ =
+      metrics_.histogram(latency_name, latency_help, latency_buckets,
+                         "stage=\"publish_objects\"");
+  total_latency_ = metrics_.histogram(latency_name, latency_help,
+                                      latency_buckets, "stage=\"total\"");
+  sectors_latency_ = metrics_.histogram(latency_name, latency_help,
+                                        latency_buckets, "stage=\"sectors\"");
+  range_image_latency_ = metrics_.histogram(
+      latency_name, latency_help, latency_buckets, "stage=\"range_image\"");
+  scan_line_run_latency_ = metrics_.histogram(
+      latency_name, latency_help, latency_buckets, "stage=\"scan_line_run\"");
+  voxel_grid_latency_ = metrics_.histogram(
+      latency_name, latency_help, latency_buckets, "stage=\"voxel_grid\"");
+
+  clusters_per_frame_ = metrics_.histogram(
+      prefix + "clusters_per_frame", "Clusters found per frame", count_buckets);
+  tracks_per_frame_ =
+      metrics_.histogram(prefix + "tracks_per_frame",
+                         "Tracked obstacles per frame", count_buckets);
+  static_clusters_per_frame_ = metrics_.histogram(
+      prefix + "static_clusters_per_frame",
+      "Clusters labelled static by the motion segmentation", count_buckets);
+
+  // Where the time between the sensor stamp and the publication goes:
+  // transport (scan, driver and network, up to the receipt by the
+  // subscriber), queue (waiting for the callback), processing and publish
+  const std::vector<double> end_to_end_buckets = {
+      0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.15, 0.2, 0.3, 0.5, 1.0};
+  const std::string end_to_end_name = prefix + "end_to_end_latency_seconds";
+  const std::string end_to_end_help =
+      "Latency from the sensor header stamp to the publication, by component";
+  transport_latency_ =
+      metrics_.histogram(end_to_end_name, end_to_end_help, end_to_end_buckets,
+                         "component=\"transport\"");
+  queue_latency_ =
+      metrics_.histogram(end_to_end_name, end_to_end_help, end_to_end_buckets,
+                         "component=\"queue\"");
+  processing_latency_ =
+      metrics_.histogram(end_to_end_name, end_to_end_help, end_to_end_buckets,
+                         "component=\"processing\"");
+  publish_latency_ =
+      metrics_.histogram(end_to_end_name, end_to_end_help, end_to_end_buckets,
+                         "component=\"publish\"");
+  end_to_end_latency_ =
+      metrics_.histogram(end_to_end_name, end_to_end_help, end_to_end_buckets,
+                         "component=\"total\"");
+
+  // Size and page backing (0 off, 1 thp, 2 hugetlb) of the reusable buffers
+  // alive at the time of the scrape, buffers come and go with the detectors
+  metrics_.gaugeFamily(
+      prefix + "buffer_bytes", "Capacity of the reusable buffers", [] {
+        MetricsRegistry::GaugeSamples samples;
+        for (auto &info : HugePageBufferRegistry::instance().snapshot())
+          samples.emplace_back("buffer=\"" + info.name + "\"", info.bytes);
+        return samples;
+      });
+  metrics_.gaugeFamily(
+      prefix + "buffer_huge_pages", "Page backing of the reusable buffers",
+      [] {
+        MetricsRegistry::GaugeSamples samples;
+        for (auto &info : HugePageBufferRegistry::instance().snapshot())
+          samples.emplace_back("buffer=\"" + info.name + "\"", info.backing);
+        return samples;
+      });
+}
+
+// Seconds elapsed since the given time point, which is then moved to now
+double lap(std::chrono::steady_clock::time_point *since) {
+  const auto now = std::chrono::steady_clock::now();
+  const double seconds = std::chrono::duration<double>(now - *since).count();
+  *since = now;
+  return seconds;
+}
+
+// From the subscriber's spinner: only the latest cloud waits for the main
+// spinner, like the subscriber queue of one message, but the clouds it
+// replaces are counted
+void ObstacleDetectorNode::queueTopicCloud(
+    const ros::MessageEvent<sensor_msgs::PointCloud2 const> &event) {
+  bool queued;
+  {
+    std::lock_guard<std::mutex> lock(topic_cloud_mutex_);
+    queued = topic_cloud_queued_;
+    topic_cloud_ = event;
+    topic_cloud_queued_ = true;
+  }
+  if (queued) {
+    frames_dropped_->inc();
+    return;
+  }
+  nh.getCallbackQueue()->addCallback(boost::make_shared<FunctionCallback>(
+      [this] { topicCloudCallback(); }));
+}
+
+void ObstacleDetectorNode::topicCloudCallback() {
+  ros::MessageEvent<sensor_msgs::PointCloud2 const> event;
+  {
+    std::lock_guard<std::mutex> lock(topic_cloud_mutex_);
+    if (!topic_cloud_queued_) return;
+    event = topic_cloud_;
+    topic_cloud_ = ros::MessageEvent<sensor_msgs::PointCloud2 const>();
+    topic_cloud_queued_ = false;
+  }
+  lidarPointsCallback(event);
 }
 
 void ObstacleDetectorNode::lidarPointsCallback(
-    const sensor_msgs::PointCloud2::ConstPtr &lidar_points) {
+    const ros::MessageEvent<sensor_msgs::PointCloud2 const> &event) {
   ROS_DEBUG("lidar points recieved");
+  const ros::Time callback_time = ros::Time::now();
+  const ros::Time receipt_time = event.getReceiptTime();
+  const auto &lidar_points = event.getConstMessage();
   // Time the whole process
   const auto start_time = std::chrono::steady_clock::now();
-  const auto pointcloud_header = lidar_points->header;
-  bbox_source_frame_ = lidar_points->header.frame_id;
+  const auto &pointcloud_header = lidar_points->header;
 
   pcl::PointCloud<pcl::PointXYZ>::Ptr raw_cloud(
       new pcl::PointCloud<pcl::PointXYZ>);
-  pcl::fromROSMsg(*lidar_points, *raw_cloud);
+  if (DUAL_RETURN_EPSILON > 0) {
+    // The second returns close to their first return are dropped before
+    // any other stage
+    dual_return_filter_.convert(*lidar_points, DUAL_RETURN_EPSILON,
+                                raw_cloud.get());
+    dual_returns_dropped_->inc(dual_return_filter_.dropped());
+    if (!dual_return_filter_.paired()) {
+      ROS_WARN_ONCE(
+          "dual_return_epsilon is set but the scans have no ring and time "
+          "(or azimuth) fields to pair the returns, they are kept");
+    }
+  } else {
+    pcl::fromROSMsg(*lidar_points, *raw_cloud);
+  }
+  detect(raw_cloud, pointcloud_header, receipt_time, callback_time,
+         start_time);
+}
 
-  // Downsampleing, ROI, and removing the car roof
-  auto filtered_cloud = obstacle_detector->filterCloud(
-      raw_cloud, VOXEL_GRID_SIZE, ROI_MIN_POINT, ROI_MAX_POINT);
+// From the packet thread: only the latest scan waits for the spinner, like
+// the subscriber queue of one message
+void ObstacleDetectorNode::queuePacketScan(const PacketScan &scan) {
+  bool queued;
+  {
+    std::lock_guard<std::mutex> lock(packet_scan_mutex_);
+    queued = static_cast<bool>(packet_scan_.cloud);
+    packet_scan_ = scan;
+    packet_scan_receipt_ = ros::Time::now();
+  }
+  if (queued) {
+    frames_dropped_->inc();
+    return;
+  }
+  nh.getCallbackQueue()->addCallback(boost::make_shared<FunctionCallback>(
+      [this] { packetScanCallback(); }));
+}
 
-  // Segment the groud plane and obstacles
-  auto segmented_clouds =
-      obstacle_detector->segmentPlane(filtered_cloud, 30, GROUND_THRESH);
+void ObstacleDetectorNode::packetScanCallback() {
+  const ros::Time callback_time = ros::Time::now();
+  const auto start_time = std::chrono::steady_clock::now();
+  PacketScan scan;
+  ros::Time receipt_time;
+  {
+    std::lock_guard<std::mutex> lock(packet_scan_mutex_);
+    scan = packet_scan_;
+    receipt_time = packet_scan_receipt_;
+    packet_scan_.cloud.reset();
+  }
+  if (!scan.cloud) return;
+  dual_returns_dropped_->inc(scan.dual_returns_dropped);
+  // Applies from the next scans, the decoder is ahead of the detection
+  packet_input_->setDualReturnEpsilon(DUAL_RETURN_EPSILON);
+
+  std_msgs::Header pointcloud_header;
+  pointcloud_header.seq = packet_seq_++;
+  pointcloud_header.stamp = ros::Time(scan.stamp);
+  pointcloud_header.frame_id = packet_frame_id_;
+  pcl_conversions::toPCL(pointcloud_header, scan.cloud->header);
+  detect(scan.cloud, pointcloud_header, receipt_time, callback_time,
+         start_time);
+}
+
+void ObstacleDetectorNode::detect(
+    const pcl::PointCloud<pcl::PointXYZ>::Ptr &raw_cloud,
+    const std_msgs::Header &pointcloud_header, const ros::Time &receipt_time,
+    const ros::Time &callback_time,
+    const std::chrono::steady_clock::time_point &start_time) {
+  auto stage_time = start_time;
+  publish_seconds_ = 0.0;
+  bbox_source_frame_ = pointcloud_header.frame_id;
+
+  obstacle_detector->setNumThreads(NUM_THREADS);
+  obstacle_detector->setDeterministic(DETERMINISTIC);
+  // The assets are only swapped between frames
+  if (asset_reloader_) obstacle_detector->setAssets(asset_reloader_->current());
+
+  std::pair<pcl::PointCloud<pcl::PointXYZ>::Ptr,
+            pcl::PointCloud<pcl::PointXYZ>::Ptr>
+      segmented_clouds;
+  std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr> cloud_clusters;
+  if (DETECTION_MODE == DETECTION_RANGE_IMAGE) {
+    // Ground and clusters from one sweep over the range image of the scan
+    cloud_clusters = obstacle_detector->rangeImageDetection(
+        raw_cloud, ROI_MIN_POINT, ROI_MAX_POINT, RANGE_IMAGE_PARAMS,
+        GROUND_THRESH, CLUSTER_THRESH, CLUSTER_MIN_SIZE, CLUSTER_MAX_SIZE,
+        &segmented_clouds);
+    range_image_latency_->observe(lap(&stage_time));
+  } else if (DETECTION_MODE == DETECTION_SCAN_LINE_RUN) {
+    // Ground planes per segment, then the runs of every ring
+    cloud_clusters = obstacle_detector->scanLineRunDetection(
+        raw_cloud, ROI_MIN_POINT, ROI_MAX_POINT, RANGE_IMAGE_PARAMS,
+        SCAN_LINE_RUN_PARAMS, GROUND_THRESH, CLUSTER_THRESH, CLUSTER_MIN_SIZE,
+        CLUSTER_MAX_SIZE, &segmented_clouds);
+    scan_line_run_latency_->observe(lap(&stage_time));
+  } else if (DETECTION_MODE == DETECTION_VOXEL_GRID) {
+    // Ground and clusters from the voxels of the filter, no RANSAC or k-d tree
+    cloud_clusters = obstacle_detector->voxelGridDetection(
+        raw_cloud, VOXEL_GRID_SIZE, ROI_MIN_POINT, ROI_MAX_POINT,
+        GROUND_THRESH, GROUND_CELL_SIZE, CLUSTER_THRESH, CLUSTER_MIN_SIZE,
+        CLUSTER_MAX_SIZE, &segmented_clouds);
+    voxel_grid_latency_->observe(lap(&stage_time));
+  } else if (NUM_SECTORS > 1) {
+    // Filter, segment and cluster every angular sector on its own worker
+    cloud_clusters = obstacle_detector->sectorDetection(
+        raw_cloud, VOXEL_GRID_SIZE, ROI_MIN_POINT, ROI_MAX_POINT,
+        RANSAC_ITERATIONS, GROUND_THRESH, CLUSTER_THRESH, CLUSTER_MIN_SIZE,
+        CLUSTER_MAX_SIZE, NUM_SECTORS, SECTOR_OVERLAP, &segmented_clouds);
+    sectors_latency_->observe(lap(&stage_time));
+  } else {
+    // Downsampleing, ROI, and removing the car roof
+    auto filtered_cloud = obstacle_detector->filterCloud(
+        raw_cloud, VOXEL_GRID_SIZE, ROI_MIN_POINT, ROI_MAX_POINT);
+    filter_latency_->observe(lap(&stage_time));
 
-  // Cluster objects
-  auto cloud_clusters =
-      obstacle_detector->clustering(segmented_clouds.first, CLUSTER_THRESH,
-                                    CLUSTER_MIN_SIZE, CLUSTER_MAX_SIZE);
+    // Segment the groud plane and obstacles
+    segmented_clouds = obstacle_detector->segmentPlane(
+        filtered_cloud, RANSAC_ITERATIONS, GROUND_THRESH);
+    segment_latency_->observe(lap(&stage_time));
 
-  // Publish ground cloud and obstacle cloud
-  publishClouds(std::move(segmented_clouds), pointcloud_header);
+    // Cluster objects
+    cloud_clusters =
+        obstacle_detector->clustering(segmented_clouds.first, CLUSTER_THRESH,
+                                      CLUSTER_MIN_SIZE, CLUSTER_MAX_SIZE);
+    cluster_latency_->observe(lap(&stage_time));
+  }
+  clusters_per_frame_->observe(cloud_clusters.size());
+
+  // Publish ground cloud and obstacle cloud, before the obstacles or, in
+  // async mode, after them from the low priority worker. The clouds are not
+  // modified after detection, so the worker shares them without a copy.
+  const std::pair<pcl::PointCloud<pcl::PointXYZ>::ConstPtr,
+                  pcl::PointCloud<pcl::PointXYZ>::ConstPtr>
+      debug_clouds(segmented_clouds.first, segmented_clouds.second);
+  const DebugCloudParams debug_cloud_params = {
+      GROUND_OUTPUT, GROUND_GRID_SIZE, DEBUG_CLOUD_MAX_POINTS};
+  const bool clouds_due = debugCloudsDue(pointcloud_header);
+  if (clouds_due && !DEBUG_CLOUDS_ASYNC) {
+    publishClouds(debug_clouds, pointcloud_header, debug_cloud_params);
+    const double clouds_seconds = lap(&stage_time);
+    clouds_latency_->observe(clouds_seconds);
+    publish_seconds_ += clouds_seconds;
+  }
   // Publish Obstacles
   publishDetectedObjects(std::move(cloud_clusters), pointcloud_header);
+  if (clouds_due && DEBUG_CLOUDS_ASYNC) {
+    const bool queued = debug_cloud_worker_->submit(
+        [this, debug_clouds, pointcloud_header, debug_cloud_params] {
+          auto clouds_time = std::chrono::steady_clock::now();
+          publishClouds(debug_clouds, pointcloud_header, debug_cloud_params);
+          clouds_latency_->observe(lap(&clouds_time));
+        });
+    if (!queued) debug_clouds_skipped_->inc();
+  }
 
   // Time the whole process
   const auto end_time = std::chrono::steady_clock::now();
   const auto elapsed_time =
       std::chrono::duration_cast<std::chrono::milliseconds>(end_time -
                                                             start_time);
+  total_latency_->observe(
+      std::chrono::duration<double>(end_time - start_time).count());
+  frames_processed_->inc();
+
+  // Sensor clocks that run ahead would give negative transport times
+  const ros::Time publish_time = ros::Time::now();
+  const double transport = (receipt_time - pointcloud_header.stamp).toSec();
+  const double queue = (callback_time - receipt_time).toSec();
+  const double callback = (publish_time - callback_time).toSec();
+  transport_latency_->observe(std::max(0.0, transport));
+  queue_latency_->observe(std::max(0.0, queue));
+  processing_latency_->observe(std::max(0.0, callback - publish_seconds_));
+  publish_latency_->observe(publish_seconds_);
+  end_to_end_latency_->observe(
+      std::max(0.0, (publish_time - pointcloud_header.stamp).toSec()));
+  ROS_DEBUG(
+      "Latency: transport %.4f s, queue %.4f s, processing %.4f s, publish "
+      "%.4f s",
+      transport, queue, callback - publish_seconds_, publish_seconds_);
   ROS_INFO("The obstacle_detector_node found %d obstacles in %.3f second",
-           static_cast<int>(prev_boxes_.size()),
+           static_cast<int>(prev_boxes_.size() + static_boxes_.size()),
            static_cast<float>(elapsed_time.count() / 1000.0));
 }
 
-void ObstacleDetectorNode::publishClouds(
-    const std::pair<pcl::PointCloud<pcl::PointXYZ>::Ptr,
-                    pcl::PointCloud<pcl::PointXYZ>::Ptr> &&segmented_clouds,
-    const std_msgs::Header &header) {
-  sensor_msgs::PointCloud2::Ptr ground_cloud(new sensor_msgs::PointCloud2);
-  pcl::toROSMsg(*(segmented_clouds.second), *ground_cloud);
-  ground_cloud->header = header;
-
-  sensor_msgs::PointCloud2::Ptr obstacle_cloud(new sensor_msgs::PointCloud2);
-  pcl::toROSMsg(*(segmented_clouds.first), *obstacle_cloud);
-  obstacle_cloud->header = header;
-
-  pub_cloud_ground.publish(std::move(ground_cloud));
-  pub_cloud_clusters.publish(std::move(obstacle_cloud));
+bool ObstacleDetectorNode::debugCloudsDue(const std_msgs::Header &header) {
+  // The clouds are for visualisation only: throttle them to debug_cloud_rate
+  // (a stamp going backwards, e.g. a looping bag, restarts the throttle)
+  if (DEBUG_CLOUD_RATE > 0) {
+    const double since = (header.stamp - last_debug_clouds_stamp_).toSec();
+    if (since >= 0 && since < 1.0 / DEBUG_CLOUD_RATE) return false;
+  }
+  last_debug_clouds_stamp_ = header.stamp;
+  return true;
 }
 
-jsk_recognition_msgs::BoundingBox ObstacleDetectorNode::transformJskBbox(
-    const Box &box, const std_msgs::Header &header,
-    const geometry_msgs::Pose &pose_transformed) {
-  jsk_recognition_msgs::BoundingBox jsk_bbox;
-  jsk_bbox.header = header;
-  jsk_bbox.pose = pose_transformed;
-  jsk_bbox.dimensions.x = box.dimension(0);
-  jsk_bbox.dimensions.y = box.dimension(1);
-  jsk_bbox.dimensions.z = box.dimension(2);
-  jsk_bbox.value = 1.0f;
-  jsk_bbox.label = box.id;
-
-  return std::move(jsk_bbox);
-}
+// Only reads the clouds, the params and the members set at construction,
+// so that it can run on the debug cloud worker
+void ObstacleDetectorNode::publishClouds(
+    const std::pair<pcl::PointCloud<pcl::PointXYZ>::ConstPtr,
+                    pcl::PointCloud<pcl::PointXYZ>::ConstPtr>
+        &segmented_clouds,
+    const std_msgs::Header &header, const DebugCloudParams &params) {
+  // Transform the clouds once here rather than in every consumer, falling
+  // back to the lidar frame like the boxes do
+  std_msgs::Header cloud_header = header;
+  Eigen::Affine3f affine = Eigen::Affine3f::Identity();
+  bool transformed = false;
+  if (clouds_in_target_frame_) {
+    try {
+      const auto transform = tf2_buffer.lookupTransform(
+          bbox_target_frame_, header.frame_id, ros::Time(0));
+      const auto &t = transform.transform;
+      affine = Eigen::Translation3f(t.translation.x, t.translation.y,
+                                    t.translation.z) *
+               Eigen::Quaternionf(t.rotation.w, t.rotation.x, t.rotation.y,
+                                  t.rotation.z);
+      cloud_header.frame_id = bbox_target_frame_;
+      transformed = true;
+    } catch (tf2::TransformException &ex) {
+      ROS_WARN("%s", ex.what());
+    }
+  }
+  const auto publish =
+      [&](const pcl::PointCloud<pcl::PointXYZ>::ConstPtr &cloud,
+          const ros::Publisher &publisher) {
+        sensor_msgs::PointCloud2::Ptr msg(new sensor_msgs::PointCloud2);
+        if (transformed)
+          toROSMsgTransformed(*cloud, affine, &*msg);
+        else
+          pcl::toROSMsg(*cloud, *msg);
+        msg->header = cloud_header;
+        publisher.publish(std::move(msg));
+      };
 
-autoware_msgs::DetectedObject ObstacleDetectorNode::transformAutowareObject(
-    const Box &box, const std_msgs::Header &header,
-    const geometry_msgs::Pose &pose_transformed) {
-  autoware_msgs::DetectedObject autoware_object;
-  autoware_object.header = header;
-  autoware_object.id = box.id;
-  autoware_object.label = "unknown";
-  autoware_object.score = 1.0f;
-  autoware_object.pose = pose_transformed;
-  autoware_object.pose_reliable = true;
-  autoware_object.dimensions.x = box.dimension(0);
-  autoware_object.dimensions.y = box.dimension(1);
-  autoware_object.dimensions.z = box.dimension(2);
-  autoware_object.valid = true;
-
-  return std::move(autoware_object);
+  // Nothing is converted for the outputs nobody listens to
+  if (params.ground_output == GROUND_PLANE) {
+    if (pub_ground_plane.getNumSubscribers() > 0) {
+      // n' = R n and d' = d - n'.t in the output frame
+      Eigen::Vector4f plane = fitGroundPlane(*segmented_clouds.second);
+      plane.head<3>() = affine.linear() * plane.head<3>();
+      plane(3) -= plane.head<3>().dot(affine.translation());
+      pcl_msgs::ModelCoefficients coefficients;
+      coefficients.header = cloud_header;
+      coefficients.values.assign(plane.data(), plane.data() + 4);
+      pub_ground_plane.publish(coefficients);
+    }
+  } else if (pub_cloud_ground.getNumSubscribers() > 0) {
+    if (params.ground_output == GROUND_HEIGHT_GRID)
+      publish(heightGrid(*segmented_clouds.second, params.ground_grid_size),
+              pub_cloud_ground);
+    else
+      publish(decimate<pcl::PointXYZ>(segmented_clouds.second,
+                                      params.max_points),
+              pub_cloud_ground);
+  }
+  if (pub_cloud_clusters.getNumSubscribers() > 0)
+    publish(decimate<pcl::PointXYZ>(segmented_clouds.first, params.max_points),
+            pub_cloud_clusters);
 }
 
 void ObstacleDetectorNode::publishDetectedObjects(
     std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr> &&cloud_clusters,
     const std_msgs::Header &header) {
-  for (auto &cluster : cloud_clusters) {
-    // Create Bounding Boxes
-    Box box =
-        USE_PCA_BOX
-            ? obstacle_detector->pcaBoundingBox(cluster, obstacle_id_)
-            : obstacle_detector->axisAlignedBoundingBox(cluster, obstacle_id_);
-
-    obstacle_id_ = (obstacle_id_ < SIZE_MAX) ? ++obstacle_id_ : 0;
-    curr_boxes_.emplace_back(box);
+  auto stage_time = std::chrono::steady_clock::now();
+  // The pose of the sensor in the fixed frame at the time of the scan, which
+  // cancels out the ego motion. The wait for a late transform is bounded,
+  // the scan then goes without it.
+  Eigen::Affine3f to_fixed = Eigen::Affine3f::Identity();
+  bool to_fixed_valid = false;
+  if (USE_MOTION_SEGMENTATION || USE_VELOCITY || object_predictor_) {
+    try {
+      const auto transform = tf2_buffer.lookupTransform(
+          fixed_frame_, header.frame_id, header.stamp, fixed_frame_timeout_);
+      const auto &t = transform.transform;
+      to_fixed = Eigen::Translation3f(t.translation.x, t.translation.y,
+                                      t.translation.z) *
+                 Eigen::Quaternionf(t.rotation.w, t.rotation.x, t.rotation.y,
+                                    t.rotation.z);
+      to_fixed_valid = true;
+    } catch (tf2::TransformException &ex) {
+      ROS_WARN_THROTTLE(1.0, "%s", ex.what());
+    }
   }
 
-  // Re-assign Box ids based on tracking result
+  // Label the clusters static or dynamic from the occupancy history of the
+  // fixed frame
+  std::vector<char> is_static;
+  if (USE_MOTION_SEGMENTATION && to_fixed_valid) {
+    occupancy_history_.setParams(MOTION_PARAMS);
+    is_static = occupancy_history_.update(cloud_clusters, to_fixed);
+  }
+  std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr> static_clusters;
+  if (!is_static.empty()) {
+    std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr> dynamic_clusters;
+    for (size_t i = 0; i < cloud_clusters.size(); ++i)
+      (is_static[i] ? static_clusters : dynamic_clusters)
+          .push_back(std::move(cloud_clusters[i]));
+    cloud_clusters.swap(dynamic_clusters);
+  }
+  static_clusters_per_frame_->observe(static_clusters.size());
+
+  // Create Bounding Boxes (the shape model still needs unflattened clusters)
+  curr_boxes_ = obstacle_detector->fitBoxes(cloud_clusters, USE_PCA_BOX,
+                                            obstacle_id_, USE_SHAPE_MODEL);
+  obstacle_id_ = advanceBoxId(obstacle_id_, cloud_clusters.size());
+  // The static objects take the cheap path: axis aligned boxes, which keep
+  // the ids of the nearest static boxes of the last frame
+  static_boxes_ =
+      obstacle_detector->fitBoxes(static_clusters, false, obstacle_id_);
+  obstacle_id_ = advanceBoxId(obstacle_id_, static_clusters.size());
   if (USE_TRACKING)
+    static_tracker_.assignIds(&static_boxes_, to_fixed, DISPLACEMENT_THRESH,
+                              MOTION_PARAMS.static_missed_frames);
+  boxes_latency_->observe(lap(&stage_time));
+
+  // With velocities the previous boxes are first predicted to this frame.
+  // Those relative to the ground are moved to this sensor pose first.
+  const double dt = (header.stamp - last_objects_stamp_).toSec();
+  last_objects_stamp_ = header.stamp;
+  if (USE_VELOCITY && dt > 0) {
+    if (to_fixed_valid && prev_to_fixed_valid_) {
+      const Eigen::Affine3f ego_motion = to_fixed.inverse() * prev_to_fixed_;
+      for (auto &box : prev_boxes_) {
+        if (box.velocity_reliable) box = transformBox(box, ego_motion);
+      }
+    }
+    predictBoxes(dt, &prev_boxes_);
+  }
+  prev_to_fixed_ = to_fixed;
+  prev_to_fixed_valid_ = to_fixed_valid;
+
+  // Re-assign Box ids based on tracking result, of the dynamic objects only
+  if (USE_TRACKING && USE_JPDA)
+    obstacle_detector->obstacleTrackingJPDA(prev_boxes_, &curr_boxes_,
+                                            DISPLACEMENT_THRESH, IOU_THRESH,
+                                            JPDA_PARAMS);
+  else if (USE_TRACKING)
     obstacle_detector->obstacleTracking(prev_boxes_, &curr_boxes_,
                                         DISPLACEMENT_THRESH, IOU_THRESH);
 
+  // Scan match the clusters of the tracks against their last ones
+  if (USE_TRACKING && USE_VELOCITY)
+    obstacle_detector->estimateVelocities(
+        cloud_clusters, dt, VELOCITY_PARAMS,
+        to_fixed_valid ? &to_fixed : nullptr, &track_points_, &curr_boxes_);
+
+  // Replace the per-frame box dimensions by the accumulated track shapes
+  if (USE_SHAPE_MODEL) {
+    for (size_t i = 0; i < curr_boxes_.size(); ++i)
+      shape_models_->update(*cloud_clusters[i], &curr_boxes_[i]);
+    shape_models_->releaseStale(curr_boxes_);
+  }
+  tracking_latency_->observe(lap(&stage_time));
+  tracks_per_frame_->observe(curr_boxes_.size() + static_boxes_.size());
+
   // Lookup for frame transform between the lidar frame and the target frame
   auto bbox_header = header;
   bbox_header.frame_id = bbox_target_frame_;
@@ -263,15 +956,26 @@ void ObstacleDetectorNode::publishDetectedObjects(
     }
   }
 
-  // Construct Bounding Boxes from the clusters
-  jsk_recognition_msgs::BoundingBoxArray jsk_bboxes;
-  jsk_bboxes.header = bbox_header;
-  autoware_msgs::DetectedObjectArray autoware_objects;
-  autoware_objects.header = bbox_header;
-
-  // Transform boxes from lidar frame to base_link frame, and convert to jsk and
-  // autoware msg formats
-  for (auto &box : curr_boxes_) {
+  // Transform boxes from lidar frame to base_link frame, and fill the reused
+  // jsk and autoware messages in place
+  const auto &rotation = transform_stamped.transform.rotation;
+  const Eigen::Quaternionf velocity_rotation(rotation.w, rotation.x,
+                                             rotation.y, rotation.z);
+  curr_boxes_.insert(curr_boxes_.end(), static_boxes_.begin(),
+                     static_boxes_.end());
+  object_messages_.reset(bbox_header, curr_boxes_.size());
+  // The predictor gets the tracks in the fixed frame, where the objects
+  // without a ground velocity stay put while the sensor moves. Without the
+  // pose of this scan nothing is predicted.
+  std::shared_ptr<TrackSnapshot> snapshot;
+  if (object_predictor_ && to_fixed_valid) {
+    snapshot = std::make_shared<TrackSnapshot>();
+    snapshot->stamp = header.stamp.toSec();
+    snapshot->frame_id = fixed_frame_;
+    snapshot->boxes.reserve(curr_boxes_.size());
+  }
+  for (size_t i = 0; i < curr_boxes_.size(); ++i) {
+    const Box &box = curr_boxes_[i];
     geometry_msgs::Pose pose, pose_transformed;
     pose.position.x = box.position(0);
     pose.position.y = box.position(1);
@@ -282,19 +986,64 @@ void ObstacleDetectorNode::publishDetectedObjects(
     pose.orientation.z = box.quaternion.z();
     tf2::doTransform(pose, pose_transformed, transform_stamped);
 
-    jsk_bboxes.boxes.emplace_back(
-        transformJskBbox(box, bbox_header, pose_transformed));
-    autoware_objects.objects.emplace_back(
-        transformAutowareObject(box, bbox_header, pose_transformed));
+    object_messages_.set(i, box, pose_transformed,
+                         velocity_rotation * box.velocity);
+    if (snapshot) {
+      snapshot->boxes.push_back(transformBox(box, to_fixed));
+      snapshot->boxes.back().velocity_valid = box.velocity_reliable;
+    }
   }
-  pub_jsk_bboxes.publish(std::move(jsk_bboxes));
-  pub_autoware_objects.publish(std::move(autoware_objects));
+  pub_jsk_bboxes.publish(object_messages_.jsk());
+  pub_autoware_objects.publish(object_messages_.autoware());
+  if (object_predictor_) object_predictor_->update(snapshot);
+  const double objects_seconds = lap(&stage_time);
+  objects_latency_->observe(objects_seconds);
+  publish_seconds_ += objects_seconds;
 
-  // Update previous bounding boxes
+  // Update previous bounding boxes, the static ones are tracked apart
+  curr_boxes_.resize(curr_boxes_.size() - static_boxes_.size());
   prev_boxes_.swap(curr_boxes_);
   curr_boxes_.clear();
 }
 
+// From the predictor's thread: the tracks of the last scan, moved to stamp
+// in the fixed frame, then to the latest pose of the output frame
+void ObstacleDetectorNode::publishPredictedObjects(
+    const double stamp, const TrackSnapshot &snapshot,
+    const std::vector<Box> &predicted) {
+  Eigen::Affine3f to_output;
+  try {
+    const auto transform = tf2_buffer.lookupTransform(
+        bbox_target_frame_, snapshot.frame_id, ros::Time(0));
+    const auto &t = transform.transform;
+    to_output = Eigen::Translation3f(t.translation.x, t.translation.y,
+                                     t.translation.z) *
+                Eigen::Quaternionf(t.rotation.w, t.rotation.x, t.rotation.y,
+                                   t.rotation.z);
+  } catch (tf2::TransformException &ex) {
+    ROS_WARN_THROTTLE(1.0, "%s", ex.what());
+    return;
+  }
+
+  std_msgs::Header header;
+  header.stamp = ros::Time(stamp);
+  header.frame_id = bbox_target_frame_;
+  predicted_messages_.reset(header, predicted.size());
+  for (size_t i = 0; i < predicted.size(); ++i) {
+    const Box box = transformBox(predicted[i], to_output);
+    geometry_msgs::Pose pose;
+    pose.position.x = box.position(0);
+    pose.position.y = box.position(1);
+    pose.position.z = box.position(2);
+    pose.orientation.w = box.quaternion.w();
+    pose.orientation.x = box.quaternion.x();
+    pose.orientation.y = box.quaternion.y();
+    pose.orientation.z = box.quaternion.z();
+    predicted_messages_.set(i, box, pose, box.velocity);
+  }
+  pub_predicted_objects.publish(predicted_messages_.autoware());
+}
+
 }  // namespace lidar_obstacle_detector
 
 int main(int argc, char **argv) {
@@ -0,0 +1,302 @@
+/* scaling_benchmark.cpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Thread-count and scene-size scaling study of the detection pipeline
+
+**/
+
+#include <pcl/point_types.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lidar_obstacle_detector/packet_source.hpp"
+#include "lidar_obstacle_detector/replay.hpp"
+
+namespace lidar_obstacle_detector {
+
+const char *STAGES[] = {"filter", "segment", "cluster",
+                        "boxes",  "tracking", "total"};
+
+double stageTime(const StageTimings &t, const int stage) {
+  const double times[] = {t.filter, t.segment,  t.cluster,
+                          t.boxes,  t.tracking, t.total};
+  return times[stage];
+}
+
+struct Measurement {
+  int points;
+  int threads;
+  StageTimings mean;  // ms per frame
+};
+
+std::vector<int> parseList(const std::string &text) {
+  std::vector<int> values;
+  std::stringstream stream(text);
+  std::string item;
+  while (std::getline(stream, item, ','))
+    values.push_back(std::atoi(item.c_str()));
+  return values;
+}
+
+// Mean stage timings of replaying the frames `repeat` times, after a warm-up
+// pass that is not measured
+StageTimings measure(
+    const std::vector<pcl::PointCloud<pcl::PointXYZ>::ConstPtr> &frames,
+    const PipelineParams &base, const int num_threads, const int repeat) {
+  PipelineParams params = base;
+  params.num_threads = num_threads;
+  ReplayPipeline<pcl::PointXYZ> pipeline(params);
+  for (auto &frame : frames) pipeline.process(frame, nullptr);
+
+  StageTimings sum;
+  for (int r = 0; r < repeat; ++r) {
+    for (auto &frame : frames) {
+      StageTimings t;
+      pipeline.process(frame, &t);
+      sum.filter += t.filter;
+      sum.segment += t.segment;
+      sum.cluster += t.cluster;
+      sum.boxes += t.boxes;
+      sum.tracking += t.tracking;
+      sum.total += t.total;
+    }
+  }
+
+  const double n = repeat * frames.size();
+  sum.filter /= n;
+  sum.segment /= n;
+  sum.cluster /= n;
+  sum.boxes /= n;
+  sum.tracking /= n;
+  sum.total /= n;
+  return sum;
+}
+
+// Replays the frames in deterministic mode with every thread count, and
+// checks that the boxes are bit-identical to those of the single thread run
+bool checkDeterminism(
+    const std::vector<pcl::PointCloud<pcl::PointXYZ>::ConstPtr> &frames,
+    const std::vector<int> &threads, const PipelineParams &base) {
+  const auto replay = [&](const int num_threads) {
+    PipelineParams params = base;
+    params.num_threads = num_threads;
+    params.deterministic = true;
+    ReplayPipeline<pcl::PointXYZ> pipeline(params);
+    std::vector<std::vector<Box>> boxes;
+    for (auto &frame : frames)
+      boxes.push_back(pipeline.process(frame, nullptr));
+    return boxes;
+  };
+  const auto same = [](const Box &a, const Box &b) {
+    return a.id == b.id && a.position == b.position &&
+           a.dimension == b.dimension &&
+           a.quaternion.coeffs() == b.quaternion.coeffs();
+  };
+
+  const auto reference = replay(1);
+  bool deterministic = true;
+  for (int num_threads : threads) {
+    if (num_threads == 1) continue;
+    const auto boxes = replay(num_threads);
+    for (size_t f = 0; f < frames.size(); ++f) {
+      const bool equal =
+          boxes[f].size() == reference[f].size() &&
+          std::equal(boxes[f].begin(), boxes[f].end(), reference[f].begin(),
+                     same);
+      if (equal) continue;
+      std::cerr << "Frame " << f << " differs with " << num_threads
+                << " threads (" << boxes[f].size() << " boxes instead of "
+                << reference[f].size() << ")" << std::endl;
+      deterministic = false;
+    }
+  }
+
+  return deterministic;
+}
+
+// Throughput, speedup and efficiency of every stage relative to the single
+// thread run of the same input size
+void writeReport(const std::vector<Measurement> &measurements,
+                 const std::string &csv_file, const std::string &json_file) {
+  std::ofstream csv(csv_file);
+  std::ofstream json(json_file);
+  csv << "points,threads,stage,ms_per_frame,frames_per_second,speedup,"
+         "efficiency\n";
+  json << "[\n";
+  bool first = true;
+  for (auto &m : measurements) {
+    const auto baseline =
+        std::find_if(measurements.begin(), measurements.end(),
+                     [&m](const Measurement &b) {
+                       return b.points == m.points && b.threads == 1;
+                     });
+    for (int s = 0; s < 6; ++s) {
+      const double ms = stageTime(m.mean, s);
+      const double base =
+          baseline != measurements.end() ? stageTime(baseline->mean, s) : ms;
+      const double fps = ms > 0 ? 1000.0 / ms : 0.0;
+      const double speedup = ms > 0 ? base / ms : 0.0;
+      const double efficiency = speedup / m.threads;
+      csv << m.points << "," << m.threads << "," << STAGES[s] << "," << ms
+          << "," << fps << "," << speedup << "," << efficiency << "\n";
+      json << (first ? "" : ",\n") << "  {\"points\": " << m.points
+           << ", \"threads\": " << m.threads << ", \"stage\": \"" << STAGES[s]
+           << "\", \"ms_per_frame\": " << ms
+           << ", \"frames_per_second\": " << fps
+           << ", \"speedup\": " << speedup
+           << ", \"efficiency\": " << efficiency << "}";
+      first = false;
+    }
+  }
+  json << "\n]\n";
+}
+
+}  // namespace lidar_obstacle_detector
+
+int main(int argc, char **argv) {
+  using namespace lidar_obstacle_detector;
+
+  // Options: --pcd <dir> replays recorded frames (the point count is then the
+  // mean of the frames), --pcap <file> the scans of a raw packet capture
+  // (with --model and --calibration, as in the node), otherwise synthetic
+  // scans of --sizes points are used
+  std::string pcd_directory;
+  std::string pcap_file, sensor_model = "velodyne", calibration_file;
+  int packet_port = -1;
+  std::vector<int> sizes = {30000, 60000, 120000, 250000};
+  std::vector<int> threads;
+  for (int t = 1; t <= static_cast<int>(std::thread::hardware_concurrency());
+       t *= 2)
+    threads.push_back(t);
+  int repeat = 5;
+  int num_frames = 5;
+  PipelineParams params;
+  bool check_determinism = false;
+  std::string csv_file = "scaling.csv";
+  std::string json_file = "scaling.json";
+  for (int i = 1; i < argc; i += 2) {
+    const std::string option = argv[i];
+    if (option == "--check-determinism") {
+      check_determinism = true;
+      --i;
+      continue;
+    }
+    const std::string value = i + 1 < argc ? argv[i + 1] : "";
+    if (option == "--pcd") {
+      pcd_directory = value;
+    } else if (option == "--pcap") {
+      pcap_file = value;
+    } else if (option == "--model") {
+      sensor_model = value;
+    } else if (option == "--calibration") {
+      calibration_file = value;
+    } else if (option == "--port") {
+      packet_port = std::atoi(value.c_str());
+    } else if (option == "--sizes") {
+      sizes = parseList(value);
+    } else if (option == "--threads") {
+      threads = parseList(value);
+    } else if (option == "--repeat") {
+      repeat = std::atoi(value.c_str());
+    } else if (option == "--frames") {
+      num_frames = std::atoi(value.c_str());
+    } else if (option == "--sectors") {
+      params.num_sectors = std::atoi(value.c_str());
+    } else if (option == "--mode" && parseDetectionMode(value) >= 0) {
+      params.detection_mode = parseDetectionMode(value);
+    } else if (option == "--csv") {
+      csv_file = value;
+    } else if (option == "--json") {
+      json_file = value;
+    } else {
+      std::cerr << "Usage: scaling_benchmark [--pcd dir] "
+                   "[--pcap file --model velodyne|ouster --calibration file "
+                   "[--port n]] [--sizes n,n,...] "
+                   "[--threads n,n,...] [--repeat n] [--frames n] "
+                   "[--sectors n] "
+                   "[--mode euclidean|range_image|scan_line_run|voxel_grid] "
+                   "[--csv file] [--json file] [--check-determinism]"
+                << std::endl;
+      return 1;
+    }
+  }
+
+  // The inputs, one set of frames per scene size
+  std::vector<std::vector<pcl::PointCloud<pcl::PointXYZ>::ConstPtr>> inputs;
+  if (!pcd_directory.empty()) {
+    inputs.push_back(loadPCDFrames<pcl::PointXYZ>(pcd_directory));
+    if (inputs.back().empty()) {
+      std::cerr << "No frames found in " << pcd_directory << std::endl;
+      return 1;
+    }
+  } else if (!pcap_file.empty()) {
+    std::string error;
+    auto decoder = loadPacketDecoder(sensor_model, calibration_file, &error);
+    if (packet_port < 0) packet_port = sensor_model == "ouster" ? 7502 : 2368;
+    if (decoder) {
+      inputs.push_back(
+          loadPcapScans(pcap_file, packet_port, decoder.get(), &error));
+    }
+    if (inputs.empty() || inputs.back().empty()) {
+      std::cerr << (error.empty() ? "No scans found in " + pcap_file : error)
+                << std::endl;
+      return 1;
+    }
+  } else {
+    for (int size : sizes) {
+      inputs.emplace_back();
+      for (int f = 0; f < num_frames; ++f)
+        inputs.back().push_back(syntheticScan<pcl::PointXYZ>(size, 40, f));
+    }
+  }
+
+  // Single thread first, it is the baseline of the speedups
+  std::sort(threads.begin(), threads.end());
+  if (threads.empty() || threads.front() != 1)
+    threads.insert(threads.begin(), 1);
+
+  // Only check that the output does not depend on the thread count
+  if (check_determinism) {
+    bool deterministic = true;
+    for (auto &frames : inputs)
+      deterministic &= checkDeterminism(frames, threads, params);
+    std::cout << (deterministic ? "Output is identical with all thread counts"
+                                : "Output depends on the thread count")
+              << std::endl;
+    return deterministic ? 0 : 1;
+  }
+
+  std::vector<Measurement> measurements;
+  for (auto &frames : inputs) {
+    size_t points = 0;
+    for (auto &frame : frames) points += frame->size();
+    points /= frames.size();
+
+    for (int num_threads : threads) {
+      Measurement m;
+      m.points = points;
+      m.threads = num_threads;
+      m.mean = measure(frames, params, num_threads, repeat);
+      measurements.push_back(m);
+      std::cout << points << " points, " << num_threads << " threads: "
+                << m.mean.total << " ms per frame (filter " << m.mean.filter
+                << ", segment " << m.mean.segment << ", cluster "
+                << m.mean.cluster << ", boxes " << m.mean.boxes
+                << ", tracking " << m.mean.tracking << ")" << std::endl;
+    }
+  }
+
+  writeReport(measurements, csv_file, json_file);
+  std::cout << "Report written to " << csv_file << " and " << json_file
+            << std::endl;
+
+  return 0;
+}
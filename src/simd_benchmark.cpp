@@ -0,0 +1,147 @@
+/* simd_benchmark.cpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Throughput of the point kernels with every instruction set of the CPU
+
+**/
+
+#include <pcl/point_types.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "lidar_obstacle_detector/replay.hpp"
+#include "lidar_obstacle_detector/simd_kernels.hpp"
+
+namespace lidar_obstacle_detector {
+
+const char *KERNELS[] = {"crop_box",        "exclude_box",
+                         "plane_distances", "min_max",
+                         "transformed_min_max", "transform_points"};
+const int NUM_KERNELS = 6;
+
+// Inputs of the kernels and the buffers of their results
+struct KernelRun {
+  const float *points;
+  int n;
+  float min[3] = {-30.0f, -10.0f, -2.5f};
+  float max[3] = {30.0f, 10.0f, 1.0f};
+  float plane[4] = {0.02f, -0.01f, 0.9997f, 1.8f};
+  float transform[12] = {0.8f, -0.6f, 0.0f, 1.5f, 0.6f, 0.8f,
+                         0.0f, -0.5f, 0.0f, 0.0f, 1.0f, 1.9f};
+  std::vector<char> keep;
+  std::vector<float> out;  // distances, bounds or points
+
+  KernelRun(const float *points, const int n)
+      : points(points), n(n), keep(n), out(4 * n) {}
+
+  void run(const SimdKernels &kernels, const int kernel) {
+    switch (kernel) {
+      case 0:
+        kernels.cropBox(points, n, 4, min, max, keep.data());
+        break;
+      case 1:
+        std::fill(keep.begin(), keep.end(), 1);
+        kernels.excludeBox(points, n, 4, min, max, keep.data());
+        break;
+      case 2:
+        kernels.planeDistances(points, n, 4, plane, out.data());
+        break;
+      case 3:
+        kernels.minMax(points, n, 4, out.data(), out.data() + 3);
+        break;
+      case 4:
+        kernels.transformedMinMax(points, n, 4, transform, out.data(),
+                                  out.data() + 3);
+        break;
+      default:
+        kernels.transformPoints(points, n, 4, transform, out.data());
+    }
+  }
+
+  // Bytes of the last run's result, to compare with the scalar kernel
+  std::vector<char> result(const int kernel) const {
+    const char *begin = kernel < 2 ? keep.data()
+                                   : reinterpret_cast<const char *>(out.data());
+    const size_t size = kernel < 2    ? n
+                        : kernel == 2 ? n * sizeof(float)
+                        : kernel < 5  ? 6 * sizeof(float)
+                                      : 4 * n * sizeof(float);
+    return std::vector<char>(begin, begin + size);
+  }
+};
+
+// Mean ms of a kernel over `repeat` runs, after a warm-up run
+double measure(KernelRun *run, const SimdKernels &kernels, const int kernel,
+               const int repeat) {
+  run->run(kernels, kernel);
+  const auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < repeat; ++r) run->run(kernels, kernel);
+  const auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count() /
+         repeat;
+}
+
+}  // namespace lidar_obstacle_detector
+
+int main(int argc, char **argv) {
+  using namespace lidar_obstacle_detector;
+
+  int num_points = 120000;
+  int repeat = 200;
+  std::string csv_file = "simd.csv";
+  for (int i = 1; i < argc; i += 2) {
+    const std::string option = argv[i];
+    const std::string value = i + 1 < argc ? argv[i + 1] : "";
+    if (option == "--points") {
+      num_points = std::atoi(value.c_str());
+    } else if (option == "--repeat") {
+      repeat = std::max(std::atoi(value.c_str()), 1);
+    } else if (option == "--csv") {
+      csv_file = value;
+    } else {
+      std::cerr << "Usage: simd_benchmark [--points n] [--repeat n] "
+                   "[--csv file]"
+                << std::endl;
+      return 1;
+    }
+  }
+
+  const auto scan = syntheticScan<pcl::PointXYZ>(num_points);
+  const float *points = reinterpret_cast<const float *>(scan->points.data());
+  const int n = scan->size();
+  KernelRun run(points, n), reference(points, n);
+
+  std::ofstream csv(csv_file);
+  csv << "level,kernel,ms,mpoints_per_second,speedup,matches_scalar\n";
+  bool matches = true;
+  for (int kernel = 0; kernel < NUM_KERNELS; ++kernel) {
+    reference.run(simdKernels(SIMD_SCALAR), kernel);
+    const double scalar_ms =
+        measure(&reference, simdKernels(SIMD_SCALAR), kernel, repeat);
+    for (int level = SIMD_SCALAR; level <= SIMD_AVX512; ++level) {
+      if (!simdLevelSupported(level)) continue;
+      const SimdKernels &kernels = simdKernels(level);
+      const double ms = measure(&run, kernels, kernel, repeat);
+      const bool same = run.result(kernel) == reference.result(kernel);
+      const double mpps = ms > 0 ? n / ms / 1000.0 : 0.0;
+      const double speedup = ms > 0 ? scalar_ms / ms : 0.0;
+      matches &= same;
+      csv << kernels.name << "," << KERNELS[kernel] << "," << ms << ","
+          << mpps << "," << speedup << "," << same << "\n";
+      std::cout << KERNELS[kernel] << " " << kernels.name << ": " << ms
+                << " ms (" << mpps << " Mpoints/s, x" << speedup << ")"
+                << (same ? "" : " DIFFERS FROM SCALAR") << std::endl;
+    }
+  }
+
+  std::cout << "Best level: " << simdKernels(bestSimdLevel()).name
+            << ", report written to " << csv_file << std::endl;
+  return matches ? 0 : 1;
+}
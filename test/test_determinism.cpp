@@ -0,0 +1,102 @@
+/* test_determinism.cpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Tests that the boxes do not depend on the number of threads
+
+**/
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include "lidar_obstacle_detector/replay.hpp"
+
+using lidar_obstacle_detector::DETECTION_EUCLIDEAN;
+using lidar_obstacle_detector::DETECTION_RANGE_IMAGE;
+using lidar_obstacle_detector::DETECTION_SCAN_LINE_RUN;
+using lidar_obstacle_detector::DETECTION_VOXEL_GRID;
+using lidar_obstacle_detector::PipelineParams;
+using lidar_obstacle_detector::ReplayPipeline;
+using lidar_obstacle_detector::syntheticScan;
+
+namespace {
+
+const int NUM_FRAMES = 4;
+const int MANY_THREADS = 4;
+
+// The boxes of every frame of a replay of the same synthetic scans
+std::vector<std::vector<Box>> replay(PipelineParams params,
+                                     const int num_threads) {
+  params.num_threads = num_threads;
+  ReplayPipeline<pcl::PointXYZ> pipeline(params);
+  std::vector<std::vector<Box>> boxes;
+  for (int f = 0; f < NUM_FRAMES; ++f)
+    boxes.push_back(
+        pipeline.process(syntheticScan<pcl::PointXYZ>(30000, 40, f), nullptr));
+  return boxes;
+}
+
+// Bit for bit, ids included, in deterministic mode and out of it
+void expectSameWithAnyThreads(PipelineParams params) {
+  for (const bool deterministic : {true, false}) {
+    params.deterministic = deterministic;
+    const auto reference = replay(params, 1);
+    const auto boxes = replay(params, MANY_THREADS);
+    ASSERT_EQ(boxes.size(), reference.size());
+    for (size_t f = 0; f < boxes.size(); ++f) {
+      SCOPED_TRACE("frame " + std::to_string(f) +
+                   (deterministic ? ", deterministic" : ""));
+      EXPECT_FALSE(reference[f].empty());
+      ASSERT_EQ(boxes[f].size(), reference[f].size());
+      for (size_t i = 0; i < boxes[f].size(); ++i) {
+        const Box &a = boxes[f][i], &b = reference[f][i];
+        EXPECT_EQ(a.id, b.id);
+        EXPECT_TRUE(a.position == b.position);
+        EXPECT_TRUE(a.dimension == b.dimension);
+        EXPECT_TRUE(a.quaternion.coeffs() == b.quaternion.coeffs());
+      }
+    }
+  }
+}
+
+}  // namespace
+
+TEST(Determinism, Euclidean) {
+  PipelineParams params;
+  params.detection_mode = DETECTION_EUCLIDEAN;
+  expectSameWithAnyThreads(params);
+}
+
+TEST(Determinism, Sectors) {
+  PipelineParams params;
+  params.detection_mode = DETECTION_EUCLIDEAN;
+  params.num_sectors = 8;
+  expectSameWithAnyThreads(params);
+}
+
+TEST(Determinism, RangeImage) {
+  PipelineParams params;
+  params.detection_mode = DETECTION_RANGE_IMAGE;
+  expectSameWithAnyThreads(params);
+}
+
+TEST(Determinism, ScanLineRun) {
+  PipelineParams params;
+  params.detection_mode = DETECTION_SCAN_LINE_RUN;
+  expectSameWithAnyThreads(params);
+}
+
+TEST(Determinism, VoxelGrid) {
+  PipelineParams params;
+  params.detection_mode = DETECTION_VOXEL_GRID;
+  expectSameWithAnyThreads(params);
+}
+
+// The pca boxes, which the parallel box fitting computes per cluster
+TEST(Determinism, PcaBoxes) {
+  PipelineParams params;
+  params.use_pca_box = true;
+  params.num_sectors = 8;
+  expectSameWithAnyThreads(params);
+}
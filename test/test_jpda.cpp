@@ -0,0 +1,84 @@
+/* test_jpda.cpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Tests of the JPDA track update
+
+**/
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <vector>
+
+#include "lidar_obstacle_detector/obstacle_detector.hpp"
+
+using lidar_obstacle_detector::JPDAParams;
+using lidar_obstacle_detector::ObstacleDetector;
+using lidar_obstacle_detector::weightedUpdate;
+
+namespace {
+
+// A pedestrian sized box on the x axis
+Box pedestrian(const int id, const float x) {
+  return Box(id, Eigen::Vector3f(x, 0, 0), Eigen::Vector3f(0.5, 0.5, 1.7));
+}
+
+}  // namespace
+
+TEST(JPDA, WeightedUpdate) {
+  const std::vector<Box> detections = {pedestrian(0, 1), pedestrian(1, 3)};
+  const Eigen::Vector3f state = weightedUpdate(
+      {0.5f, 0.25f, 0.25f}, detections, Eigen::Vector3f(5, 4, 0));
+  EXPECT_FLOAT_EQ(state.x(), 0.5f * 1 + 0.25f * 3 + 0.25f * 5);
+  EXPECT_FLOAT_EQ(state.y(), 0.25f * 4);
+}
+
+// Two pedestrians walking into each other, both detections are in the gate
+// of both tracks
+TEST(JPDA, CrossingTracks) {
+  ObstacleDetector<pcl::PointXYZ> detector;
+  std::vector<Box> prev_boxes = {pedestrian(1, -0.3f), pedestrian(2, 0.3f)};
+  for (auto &box : prev_boxes) {
+    box.track_position = box.position;
+    box.track_filtered = true;
+  }
+  std::vector<Box> curr_boxes = {pedestrian(10, -0.1f), pedestrian(11, 0.1f)};
+  detector.obstacleTrackingJPDA(prev_boxes, &curr_boxes, 1.5f, 1.0f,
+                                JPDAParams());
+
+  // The nearest track continues every detection, whose box is untouched
+  ASSERT_EQ(curr_boxes.size(), 2);
+  EXPECT_EQ(curr_boxes[0].id, 1);
+  EXPECT_EQ(curr_boxes[1].id, 2);
+  EXPECT_FLOAT_EQ(curr_boxes[0].position.x(), -0.1f);
+  EXPECT_FLOAT_EQ(curr_boxes[1].position.x(), 0.1f);
+
+  // The state of each track mixes both detections and its prediction, so it
+  // lies strictly between its prediction and the other detection, and it is
+  // not its own detection
+  for (int t = 0; t < 2; ++t) {
+    const Box &box = curr_boxes[t];
+    const float sign = t == 0 ? -1.0f : 1.0f;
+    EXPECT_TRUE(box.track_filtered);
+    EXPECT_GT(sign * box.track_position.x(), -0.1f);
+    EXPECT_LT(sign * box.track_position.x(), 0.3f);
+    EXPECT_GT(std::abs(box.track_position.x() - box.position.x()), 1e-4f);
+  }
+  // The scene is symmetric, and so are the updates
+  EXPECT_NEAR(curr_boxes[0].track_position.x(),
+              -curr_boxes[1].track_position.x(), 1e-5f);
+}
+
+// A track with nothing in its gate is missed, the new detection starts a
+// track at its measured position
+TEST(JPDA, NewTrack) {
+  ObstacleDetector<pcl::PointXYZ> detector;
+  std::vector<Box> prev_boxes = {pedestrian(1, -10.0f)};
+  std::vector<Box> curr_boxes = {pedestrian(10, 10.0f)};
+  detector.obstacleTrackingJPDA(prev_boxes, &curr_boxes, 1.5f, 1.0f,
+                                JPDAParams());
+  EXPECT_EQ(curr_boxes[0].id, 10);
+  EXPECT_TRUE(curr_boxes[0].track_filtered);
+  EXPECT_FLOAT_EQ(curr_boxes[0].track_position.x(), 10.0f);
+}
@@ -0,0 +1,98 @@
+/* test_packet_decoder.cpp
+
+ * Copyright (C) 2021 SS47816
+
+ * Tests of the decoding of the raw Velodyne packets
+
+**/
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "lidar_obstacle_detector/packet_decoder.hpp"
+
+using lidar_obstacle_detector::PacketScan;
+using lidar_obstacle_detector::VelodyneDecoder;
+using lidar_obstacle_detector::VelodyneLaser;
+
+namespace {
+
+const uint8_t HDL_32E = 0x21, VLP_16 = 0x22, VLP_32C = 0x28, HDL_64E = 0x00;
+const uint8_t STRONGEST = 0x37, DUAL = 0x39;
+
+// Lasers without any correction, so a return lies at its raw distance along
+// the azimuth of its block
+std::vector<VelodyneLaser> flatLasers(const int count) {
+  return std::vector<VelodyneLaser>(count, VelodyneLaser{0, 1, 0, 1, 0, 0, 0});
+}
+
+void write16(uint8_t *data, const int value) {
+  data[0] = value & 0xFF;
+  data[1] = value >> 8;
+}
+
+// A packet of 12 blocks at the given azimuth, with `raw` on the first
+// channel of the first block and `second_raw` on that of the second
+std::vector<uint8_t> packet(const uint8_t product_id, const uint8_t mode,
+                            const int azimuth, const int raw,
+                            const int second_raw = 0) {
+  std::vector<uint8_t> data(VelodyneDecoder::PACKET_SIZE, 0);
+  for (int b = 0; b < 12; ++b) {
+    write16(&data[b * 100], 0xEEFF);
+    write16(&data[b * 100 + 2], azimuth);
+  }
+  write16(&data[4], raw);
+  write16(&data[104], second_raw);
+  data[1204] = mode;
+  data[1205] = product_id;
+  return data;
+}
+
+// The scan of a packet, completed by a second packet that wraps around
+PacketScan decodeScan(VelodyneDecoder *decoder,
+                      const std::vector<uint8_t> &data) {
+  const std::vector<uint8_t> next = packet(data[1205], data[1204], 0, 0);
+  EXPECT_FALSE(decoder->decode(data.data(), data.size(), 1.0));
+  EXPECT_TRUE(decoder->decode(next.data(), next.size(), 1.1));
+  return decoder->takeScan();
+}
+
+void expectDistance(const uint8_t product_id, const int lasers,
+                    const float distance) {
+  VelodyneDecoder decoder(flatLasers(lasers));
+  const PacketScan scan =
+      decodeScan(&decoder, packet(product_id, STRONGEST, 9000, 5000));
+  ASSERT_TRUE(scan.cloud);
+  ASSERT_EQ(scan.cloud->size(), 1u);
+  const pcl::PointXYZ &p = scan.cloud->points[0];
+  EXPECT_NEAR(std::hypot(p.x, p.y), distance, 1e-4f);
+  EXPECT_NEAR(p.z, 0.0f, 1e-4f);
+}
+
+}  // namespace
+
+TEST(VelodyneDecoder, DistanceResolutionOfEveryModel) {
+  expectDistance(HDL_32E, 32, 10.0f);
+  expectDistance(VLP_16, 16, 10.0f);
+  expectDistance(VLP_32C, 32, 20.0f);
+  expectDistance(HDL_64E, 64, 10.0f);
+}
+
+TEST(VelodyneDecoder, DualReturnEpsilonInMetres) {
+  // Returns 5 units apart: 1 cm on the VLP-16, 2 cm on the VLP-32C
+  VelodyneDecoder vlp16(flatLasers(16));
+  vlp16.setDualReturnEpsilon(0.015f);
+  PacketScan scan =
+      decodeScan(&vlp16, packet(VLP_16, DUAL, 9000, 5000, 5005));
+  EXPECT_EQ(scan.dual_returns_dropped, 1);
+  EXPECT_EQ(scan.cloud->size(), 1u);
+
+  VelodyneDecoder vlp32c(flatLasers(32));
+  vlp32c.setDualReturnEpsilon(0.015f);
+  scan = decodeScan(&vlp32c, packet(VLP_32C, DUAL, 9000, 5000, 5005));
+  EXPECT_EQ(scan.dual_returns_dropped, 0);
+  EXPECT_EQ(scan.cloud->size(), 2u);
+}